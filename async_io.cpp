@@ -0,0 +1,284 @@
+#include "async_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The rings shared with the kernel, mapped as described by io_uring_setup(2)
+struct io_engine::uring{
+    int fd = -1;
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned to_submit = 0;
+
+    ~uring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool setup(unsigned entries) {
+        io_uring_params params{};
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return false;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        cq_ring = single_map ? sq_ring
+            : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ring);
+        char* cq = static_cast<char*>(cq_ring);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    int enter(unsigned min_complete) {
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        if (submitted > 0) {
+            to_submit -= submitted;
+        }
+        return submitted;
+    }
+};
+
+io_engine::io_engine(unsigned depth, bool allow_uring): queue_depth(std::max(depth, 1u)) {
+    if (allow_uring) {
+        ring = std::make_unique<uring>();
+        if (!ring->setup(queue_depth)) {
+            ring.reset();
+        }
+    }
+    if (!ring) {
+        unsigned threads = std::min(queue_depth, 8u);
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back(&io_engine::worker, this);
+        }
+    }
+}
+
+io_engine::~io_engine() {
+    wait();
+    {
+        std::lock_guard<std::mutex> guard(pool_mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+}
+
+void io_engine::read(int fd, char* buffer, size_t length, off_t offset, completion done) {
+    queue(std::unique_ptr<operation>(new operation{fd, buffer, length, offset, false, 0, 0, std::move(done)}));
+}
+
+void io_engine::write(int fd, const char* buffer, size_t length, off_t offset, completion done) {
+    queue(std::unique_ptr<operation>(new operation{fd, const_cast<char*>(buffer), length, offset, true, 0, 0, std::move(done)}));
+}
+
+void io_engine::queue(std::unique_ptr<operation> op) {
+    in_flight++;
+    if (ring) {
+        if (ring_used < queue_depth) {
+            submit_uring(op.release());
+        } else {
+            pending.push_back(op.release());
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(pool_mutex);
+        pending.push_back(op.release());
+    }
+    work_ready.notify_one();
+}
+
+// Fills the next submission entry, the kernel sees it on the next io_uring_enter
+void io_engine::submit_uring(operation* op) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+
+    op->vector.iov_base = op->buffer + op->done;
+    op->vector.iov_len = op->length - op->done;
+    sqe->opcode = op->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&op->vector);
+    sqe->len = 1;
+    sqe->off = op->offset + op->done;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring_used++;
+}
+
+bool io_engine::poll_uring(std::vector<operation*>& completed) {
+    while (ring->enter(1) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = ring->cqes[head & *ring->cq_mask];
+        operation* op = reinterpret_cast<operation*>(cqe.user_data);
+        int result = cqe.res;
+        ring_used--;
+
+        if (result == -EINTR || result == -EAGAIN) {
+            pending.push_front(op);
+        } else if (result > 0 && op->done + result < op->length) {
+            op->done += result;
+            pending.push_front(op);
+        } else {
+            op->result = result < 0 ? result : static_cast<ssize_t>(op->done + result);
+            completed.push_back(op);
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    while (!pending.empty() && ring_used < queue_depth) {
+        submit_uring(pending.front());
+        pending.pop_front();
+    }
+    return true;
+}
+
+bool io_engine::poll() {
+    if (in_flight == 0) {
+        return false;
+    }
+
+    std::vector<operation*> completed;
+    if (ring) {
+        if (!poll_uring(completed)) {
+            // The ring stopped working, everything still in it is failed
+            while (!pending.empty()) {
+                pending.front()->result = -EIO;
+                completed.push_back(pending.front());
+                pending.pop_front();
+            }
+            if (completed.empty()) {
+                return false;
+            }
+        }
+    } else {
+        std::unique_lock<std::mutex> guard(pool_mutex);
+        work_done.wait(guard, [this] { return !finished.empty(); });
+        completed.assign(finished.begin(), finished.end());
+        finished.clear();
+    }
+
+    // Completions run after the ring is updated, so they are free to queue more requests
+    for (operation* op : completed) {
+        in_flight--;
+        std::unique_ptr<operation> owned(op);
+        if (owned->callback) {
+            owned->callback(owned->result);
+        }
+    }
+    return true;
+}
+
+void io_engine::wait() {
+    while (poll()) {
+    }
+}
+
+void io_engine::worker() {
+    for (;;) {
+        operation* op;
+        {
+            std::unique_lock<std::mutex> guard(pool_mutex);
+            work_ready.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            op = pending.front();
+            pending.pop_front();
+        }
+
+        op->result = 0;
+        while (op->done < op->length) {
+            ssize_t n = op->is_write
+                ? ::pwrite(op->fd, op->buffer + op->done, op->length - op->done, op->offset + op->done)
+                : ::pread(op->fd, op->buffer + op->done, op->length - op->done, op->offset + op->done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                op->result = -errno;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            op->done += n;
+        }
+        if (op->result == 0) {
+            op->result = static_cast<ssize_t>(op->done);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(pool_mutex);
+            finished.push_back(op);
+        }
+        work_done.notify_one();
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Positional reads and writes with many requests in flight.
+// io_uring is used when the kernel allows it (set up through the raw system calls), otherwise a small
+// pool of threads runs pread/pwrite. Requests are only queued by read()/write(), poll() and wait() hand
+// them to the kernel and run the completions on the calling thread, a completion may queue new requests.
+// Short transfers are continued, a completion gets the bytes transferred or -errno.
+class io_engine{
+public:
+    using completion = std::function<void(ssize_t result)>;
+
+    explicit io_engine(unsigned depth = 64, bool allow_uring = true);
+    ~io_engine();
+    io_engine(const io_engine&) = delete;
+    io_engine& operator=(const io_engine&) = delete;
+
+    void read(int fd, char* buffer, size_t length, off_t offset, completion done);
+    void write(int fd, const char* buffer, size_t length, off_t offset, completion done);
+    // Runs at least one completion, waiting for it if needed. Returns false when nothing is in flight
+    bool poll();
+    // Runs completions until no request is left
+    void wait();
+
+    unsigned depth() const { return queue_depth; }
+    const char* backend() const { return ring ? "io_uring" : "threads"; }
+
+private:
+    struct operation{
+        int fd;
+        char* buffer;
+        size_t length;
+        off_t offset;
+        bool is_write;
+        size_t done = 0;
+        ssize_t result = 0;
+        completion callback;
+        iovec vector{};
+    };
+    struct uring;
+
+    void queue(std::unique_ptr<operation> op);
+    void submit_uring(operation* op);
+    bool poll_uring(std::vector<operation*>& completed);
+    void worker();
+
+    unsigned queue_depth;
+    size_t in_flight = 0;       // Queued and not completed yet
+    std::unique_ptr<uring> ring;
+    unsigned ring_used = 0;     // Requests handed to the ring, at most queue_depth
+
+    // Thread pool backend
+    std::vector<std::thread> workers;
+    std::mutex pool_mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::deque<operation*> pending;     // Also the backlog of a full ring
+    std::deque<operation*> finished;
+    bool stopping = false;
+};
+
+#endif
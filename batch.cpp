@@ -0,0 +1,101 @@
+#include <iterator>
+#include "filesystem.h"
+#include "path_utils.h"
+
+// Every batch resolves its directories once, matches in one pass over the entries and commits once
+
+fs_status filesystem::remove_matching(const std::string& pattern, int32_t& count) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    count = 0;
+    std::string name_pattern;
+    directory_item* parent = get_parent_directory(pattern, working_directory(), name_pattern);
+    if (!parent) {
+        return fs_status::not_found;
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> commit_guard(commit_lock);
+        std::unique_lock<std::shared_mutex> dir_guard(parent->contents->lock);
+        std::list<directory_item>& children = parent->contents->children;
+        for (auto it = children.begin(); it != children.end();) {
+            auto next = std::next(it);
+            if (it->is_file && glob_match(name_pattern, it->item_name)) {
+                remove_entry(parent, it);
+                count++;
+            }
+            it = next;
+        }
+    }
+    return count == 0 ? fs_status::not_found : save_fs();
+}
+
+fs_status filesystem::copy_matching(const std::string& pattern, const std::string& dest_dir, int32_t& count) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    count = 0;
+    std::string name_pattern;
+    directory_item* source_parent = get_parent_directory(pattern, working_directory(), name_pattern);
+    if (!source_parent) {
+        return fs_status::not_found;
+    }
+    directory_item* dest_parent = find_directory_by_path(working_directory(), dest_dir);
+    if (!dest_parent) {
+        return fs_status::path_not_found;
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> commit_guard(commit_lock);
+        std::unique_lock<std::shared_mutex> first_guard, second_guard;
+        lock_directories(source_parent, dest_parent, first_guard, second_guard);
+
+        // Matched before anything is added, copies into the same directory are not matched again
+        std::vector<copy_job> jobs;
+        for (directory_item& child : source_parent->contents->children) {
+            if (child.is_file && glob_match(name_pattern, child.item_name)) {
+                jobs.push_back(copy_job{&child, dest_parent, child.item_name});
+            }
+        }
+        if (jobs.empty()) {
+            return fs_status::not_found;
+        }
+        fs_status status = copy_entries(jobs);
+        if (status != fs_status::ok) {
+            return status;
+        }
+        count = static_cast<int32_t>(jobs.size());
+    }
+    return save_fs();
+}
+
+fs_status filesystem::move_matching(const std::string& pattern, const std::string& dest_dir, int32_t& count) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    count = 0;
+    std::string name_pattern;
+    directory_item* source_parent = get_parent_directory(pattern, working_directory(), name_pattern);
+    if (!source_parent) {
+        return fs_status::not_found;
+    }
+    directory_item* dest_parent = find_directory_by_path(working_directory(), dest_dir);
+    if (!dest_parent) {
+        return fs_status::path_not_found;
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> commit_guard(commit_lock);
+        std::unique_lock<std::shared_mutex> first_guard, second_guard;
+        lock_directories(source_parent, dest_parent, first_guard, second_guard);
+
+        std::list<directory_item>& children = source_parent->contents->children;
+        for (auto it = children.begin(); it != children.end();) {
+            auto next = std::next(it);
+            if (it->is_file && glob_match(name_pattern, it->item_name)) {
+                // Into its own directory a file stays as it is
+                if (dest_parent != source_parent) {
+                    move_entry(source_parent, it, dest_parent, it->item_name);
+                }
+                count++;
+            }
+            it = next;
+        }
+    }
+    return count == 0 ? fs_status::not_found : save_fs();
+}
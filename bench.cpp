@@ -0,0 +1,738 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compression.h"
+#include "filesystem.h"
+#include "protocol.h"
+#include "async_io.h"
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Chunk size used by compressed files, one cluster
+static const size_t CHUNK_SIZE = 4096;
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compresses a host file chunk by chunk the same way 'incp -c' does and reports ratio and throughput
+static int bench_compress(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "File not found\n";
+        return 1;
+    }
+    std::vector<char> input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (input.empty()) {
+        std::cerr << "File is empty\n";
+        return 1;
+    }
+
+    size_t chunks = (input.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<char> packed(chunks * CHUNK_SIZE);
+    std::vector<size_t> packed_sizes(chunks);
+    std::vector<char> output(input.size());
+
+    // Repeat until the measurement is long enough to be stable
+    size_t rounds = 0;
+    size_t stored = 0;
+    auto start = std::chrono::steady_clock::now();
+    do {
+        stored = 0;
+        for (size_t i = 0; i < chunks; ++i) {
+            size_t length = std::min(CHUNK_SIZE, input.size() - i * CHUNK_SIZE);
+            packed_sizes[i] = lz_compress(input.data() + i * CHUNK_SIZE, length, packed.data() + i * CHUNK_SIZE, length - 1);
+            stored += packed_sizes[i] == 0 ? length : packed_sizes[i];
+        }
+        rounds++;
+    } while (seconds_since(start) < 0.5);
+    double compress_time = seconds_since(start) / rounds;
+
+    rounds = 0;
+    start = std::chrono::steady_clock::now();
+    do {
+        for (size_t i = 0; i < chunks; ++i) {
+            size_t length = std::min(CHUNK_SIZE, input.size() - i * CHUNK_SIZE);
+            if (packed_sizes[i] == 0) {
+                std::memcpy(output.data() + i * CHUNK_SIZE, input.data() + i * CHUNK_SIZE, length);
+            } else if (lz_decompress(packed.data() + i * CHUNK_SIZE, packed_sizes[i], output.data() + i * CHUNK_SIZE, length) != length) {
+                std::cerr << "Decompression failed in chunk " << i << "\n";
+                return 1;
+            }
+        }
+        rounds++;
+    } while (seconds_since(start) < 0.5);
+    double decompress_time = seconds_since(start) / rounds;
+
+    if (output != input) {
+        std::cerr << "Round trip mismatch\n";
+        return 1;
+    }
+
+    double megabytes = input.size() / (1024.0 * 1024.0);
+    std::cout << "Input: " << input.size() << " bytes in " << chunks << " chunks\n";
+    std::cout << "Stored: " << stored << " bytes, ratio " << static_cast<double>(input.size()) / stored << "\n";
+    std::cout << "Clusters: " << chunks << " -> " << (stored + CHUNK_SIZE - 1) / CHUNK_SIZE << "\n";
+    std::cout << "Compress: " << megabytes / compress_time << " MB/s\n";
+    std::cout << "Decompress: " << megabytes / decompress_time << " MB/s\n";
+    return 0;
+}
+
+// Imports, copies and exports a host file with each I/O backend and queue depth, checks the round trip
+// and reports the throughput of every step
+static int bench_copy(const std::string& image, const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "File not found\n";
+        return 1;
+    }
+    double megabytes = static_cast<double>(in.tellg()) / (1024.0 * 1024.0);
+    std::string exported = image + ".out";
+    int64_t image_megabytes = std::max<int64_t>(16, static_cast<int64_t>(megabytes * 3) + 8);
+
+    std::cout << "backend   depth  incp MB/s  cp MB/s   outcp MB/s\n";
+    for (bool uring : {true, false}) {
+        for (unsigned depth : {1u, 8u, 64u}) {
+            filesystem fs(image);
+            if (fs.format_fs(std::to_string(image_megabytes) + "MB") != fs_status::ok) {
+                std::cerr << "Format failed\n";
+                return 1;
+            }
+            fs.io_uring_enabled = uring;
+            fs.io_depth = depth;
+
+            auto start = std::chrono::steady_clock::now();
+            fs_status status = fs.copy_file_in(path, "/a.bin");
+            double incp_time = seconds_since(start);
+            start = std::chrono::steady_clock::now();
+            if (status == fs_status::ok) {
+                status = fs.copy_file("/a.bin", "/b.bin");
+            }
+            double cp_time = seconds_since(start);
+            start = std::chrono::steady_clock::now();
+            if (status == fs_status::ok) {
+                status = fs.copy_file_out("/b.bin", exported);
+            }
+            double outcp_time = seconds_since(start);
+            if (status != fs_status::ok) {
+                std::cerr << status_message(status) << "\n";
+                return 1;
+            }
+
+            std::ifstream original(path, std::ios::binary);
+            std::ifstream copy(exported, std::ios::binary);
+            if (!std::equal(std::istreambuf_iterator<char>(original), std::istreambuf_iterator<char>(),
+                            std::istreambuf_iterator<char>(copy), std::istreambuf_iterator<char>())) {
+                std::cerr << "Round trip mismatch\n";
+                return 1;
+            }
+            std::printf("%-9s %-6u %-10.1f %-9.1f %.1f\n", io_engine(1, uring).backend(), depth,
+                        megabytes / incp_time, megabytes / cp_time, megabytes / outcp_time);
+        }
+    }
+    std::remove(exported.c_str());
+    return 0;
+}
+
+// Appends one entry in the on-disk tree format, the layout filesystem::save_directory() writes
+static void put_tree_entry(std::string& tree, const std::string& name, bool is_file, int32_t parent_id, int32_t id, size_t children) {
+    char item_name[12] = {};
+    std::strncpy(item_name, name.c_str(), sizeof(item_name) - 1);
+    int32_t size = is_file ? CLUSTER_SIZE : 0;
+    int32_t start_cluster = -1;
+    uint8_t flags = 0;
+    tree.append(item_name, sizeof(item_name));
+    tree.append(reinterpret_cast<const char*>(&is_file), sizeof(is_file));
+    tree.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    tree.append(reinterpret_cast<const char*>(&start_cluster), sizeof(start_cluster));
+    tree.append(reinterpret_cast<const char*>(&parent_id), sizeof(parent_id));
+    tree.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    tree.append(reinterpret_cast<const char*>(&flags), sizeof(flags));
+    tree.append(reinterpret_cast<const char*>(&children), sizeof(children));
+}
+
+// The entry layout before directory state moved into directory_contents, every entry carried a child
+// list, a lock and usage totals. Kept here as the baseline of the memory benchmark.
+struct legacy_item{
+    char item_name[12];
+    bool is_file = false;
+    int32_t size = 0;
+    int32_t start_cluster = -1;
+    int32_t parent_id = -1;
+    int32_t id = -1;
+    uint8_t flags = 0;
+    std::list<legacy_item> children;
+    std::shared_ptr<std::shared_mutex> lock;
+    usage_totals usage;
+};
+
+// Reads a serialized tree the way load_dir() did with the legacy layout
+static void load_legacy(std::istream& in, legacy_item& item) {
+    in.read(item.item_name, sizeof(item.item_name));
+    in.read(reinterpret_cast<char*>(&item.is_file), sizeof(item.is_file));
+    in.read(reinterpret_cast<char*>(&item.size), sizeof(item.size));
+    in.read(reinterpret_cast<char*>(&item.start_cluster), sizeof(item.start_cluster));
+    in.read(reinterpret_cast<char*>(&item.parent_id), sizeof(item.parent_id));
+    in.read(reinterpret_cast<char*>(&item.id), sizeof(item.id));
+    in.read(reinterpret_cast<char*>(&item.flags), sizeof(item.flags));
+    size_t children = 0;
+    in.read(reinterpret_cast<char*>(&children), sizeof(children));
+    if (!item.is_file) {
+        item.lock = std::make_shared<std::shared_mutex>();
+    }
+    item.children.resize(children);
+    for (legacy_item& child : item.children) {
+        load_legacy(in, child);
+    }
+}
+
+// Loads a synthetic tree of the given number of files, 1000 per directory, the way an image is opened,
+// once with the legacy entry layout and once with the current one. Reports the heap each tree takes
+// per entry and the smallest image that stores the tree.
+static int bench_memory(int32_t files) {
+    const int32_t per_directory = 1000;
+    int32_t directories = (files + per_directory - 1) / per_directory;
+    std::string tree;
+    put_tree_entry(tree, "/", false, -1, 0, directories);
+    int32_t id = 1;
+    for (int32_t d = 0; d < directories; ++d) {
+        int32_t dir_id = id++;
+        int32_t count = std::min(per_directory, files - d * per_directory);
+        put_tree_entry(tree, "d" + std::to_string(d), false, 0, dir_id, count);
+        for (int32_t f = 0; f < count; ++f) {
+            put_tree_entry(tree, "f" + std::to_string(f), true, dir_id, id++, 0);
+        }
+    }
+
+    // Only a tree an image can store is worth measuring, the tree area grows with the volume
+    int32_t max_clusters = std::numeric_limits<int32_t>::max() / CLUSTER_SIZE;
+    if (static_cast<int64_t>(tree.size()) > filesystem::tree_area_size(max_clusters)) {
+        std::cerr << "The largest image holds " << filesystem::tree_area_size(max_clusters) / TREE_ENTRY_SIZE << " entries\n";
+        return 1;
+    }
+    int32_t low = 2, high = max_clusters;
+    while (low < high) {
+        int32_t middle = low + (high - low) / 2;
+        if (filesystem::tree_area_size(middle) < static_cast<int64_t>(tree.size())) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    int64_t entries = 1 + directories + static_cast<int64_t>(files);
+    std::printf("%lld entries (%d directories)\n", static_cast<long long>(entries), directories + 1);
+    std::printf("%-8s %-8s %-10s %-16s %s\n", "layout", "sizeof", "heap MB", "bytes per entry", "load s");
+
+    {
+        std::istringstream in(tree);
+        auto start = std::chrono::steady_clock::now();
+        size_t before = mallinfo2().uordblks;
+        legacy_item root;
+        load_legacy(in, root);
+        size_t after = mallinfo2().uordblks;
+        double load_time = seconds_since(start);
+        if (!in) {
+            std::cerr << "Tree did not load\n";
+            return 1;
+        }
+        std::printf("%-8s %-8zu %-10.1f %-16.1f %.3f\n", "legacy", sizeof(legacy_item), (after - before) / (1024.0 * 1024.0),
+                    static_cast<double>(after - before) / entries, load_time);
+    }
+
+    filesystem fs("");
+    std::istringstream in(tree);
+    auto start = std::chrono::steady_clock::now();
+    size_t before = mallinfo2().uordblks;
+    directory_item root;
+    fs.load_dir(in, root);
+    size_t after = mallinfo2().uordblks;
+    double load_time = seconds_since(start);
+    if (!in) {
+        std::cerr << "Tree did not load\n";
+        return 1;
+    }
+    std::printf("%-8s %-8zu %-10.1f %-16.1f %.3f\n", "current", sizeof(directory_item), (after - before) / (1024.0 * 1024.0),
+                static_cast<double>(after - before) / entries, load_time);
+    std::printf("sizeof(directory_contents) %zu, allocated once per directory\n", sizeof(directory_contents));
+    std::printf("The tree needs an image of at least %lld KB\n", static_cast<long long>(low) * CLUSTER_SIZE / 1024);
+    return 0;
+}
+
+// Reads a whole file of the filesystem, an empty result on any error
+static std::string read_all(filesystem& fs, const std::string& path) {
+    entry_info info;
+    if (fs.stat(path, info) != fs_status::ok) {
+        return "";
+    }
+    std::string content(info.size, '\0');
+    int32_t bytes_read = 0;
+    if (fs.read(path, 0, std::span<char>(content.data(), content.size()), bytes_read) != fs_status::ok) {
+        return "";
+    }
+    content.resize(bytes_read);
+    return content;
+}
+
+// Preallocates most of a small volume, appends to the file and scrubs. The data region of a small
+// volume ends past the disk size, every preallocated cluster has to read back as the zeros its
+// checksum records.
+static int bench_preallocate(const std::string& image) {
+    filesystem fs(image);
+    const std::string text = "hello";
+    fs_status status = fs.format_fs("1MB");
+    if (status == fs_status::ok) {
+        status = fs.preallocate("/f", 700 * 1024);
+    }
+    if (status == fs_status::ok) {
+        status = fs.append("/f", std::span<const char>(text.data(), text.size()));
+    }
+    scrub_report report;
+    if (status == fs_status::ok) {
+        status = fs.scrub(report);
+    }
+    if (status != fs_status::ok) {
+        std::cerr << "Failed: " << status_message(status) << "\n";
+        return 1;
+    }
+    if (!report.bad_clusters.empty() || read_all(fs, "/f") != text) {
+        std::cerr << report.bad_clusters.size() << " checksum mismatches\n";
+        return 1;
+    }
+    std::printf("%lld clusters verified\n", static_cast<long long>(report.verified_clusters));
+    return 0;
+}
+
+// Hammers one image from several threads. Every writer works in its own directory and remembers
+// what its files should hold, readers keep reading a shared file. Afterwards every file is verified
+// and check() must find the tables consistent. Build with -DZOSFS_TSAN=ON to run it under ThreadSanitizer.
+// Each thread uses at most 9 names, the whole tree has to fit the tree area of a metadata slot.
+static int bench_stress(const std::string& image, int threads, int operations) {
+    filesystem fs(image);
+    if (fs.format_fs("64MB") != fs_status::ok) {
+        std::cerr << "Format failed\n";
+        return 1;
+    }
+
+    std::string shared_content(3 * 4096 + 100, 's');
+    std::string host_shared = image + ".shared";
+    std::ofstream(host_shared, std::ios::binary) << shared_content;
+    fs.copy_file_in(host_shared, "/shared.txt");
+
+    std::vector<std::map<std::string, std::string>> expected(threads);
+    std::vector<int> failures(threads + 2, 0);
+    bool done = false;
+    std::mutex done_mutex;
+
+    auto writer = [&](int t) {
+        std::mt19937 random(t);
+        std::string dir = "/t" + std::to_string(t);
+        std::string host = image + ".host" + std::to_string(t);
+        std::map<std::string, std::string>& files = expected[t];
+        if (fs.make_directory(dir) != fs_status::ok) {
+            failures[t]++;
+            return;
+        }
+
+        for (int i = 0; i < operations; ++i) {
+            std::string name = "f" + std::to_string(random() % 3) + ".txt";
+            std::string path = dir + "/" + name;
+            uint8_t flags = random() % 3 == 0 ? FILE_DEDUP : 0;
+            switch (random() % 6) {
+                case 0: {
+                    if (files.count(name)) {
+                        break;
+                    }
+                    std::string content(random() % (4 * 4096), static_cast<char>('a' + t % 26));
+                    std::ofstream(host, std::ios::binary | std::ios::trunc) << content;
+                    if (fs.copy_file_in(host, path, flags) == fs_status::ok) {
+                        files[name] = content;
+                    } else {
+                        failures[t]++;
+                    }
+                    break;
+                }
+                case 1: {
+                    if (!files.count(name)) {
+                        break;
+                    }
+                    entry_info info;
+                    if (fs.stat(path, info) != fs_status::ok) {
+                        failures[t]++;
+                        break;
+                    }
+                    if (info.flags != 0) {
+                        break;
+                    }
+                    std::string tail(random() % 5000, static_cast<char>('A' + i % 26));
+                    if (fs.append(path, std::span<const char>(tail.data(), tail.size())) == fs_status::ok) {
+                        files[name] += tail;
+                    } else {
+                        failures[t]++;
+                    }
+                    break;
+                }
+                case 2:
+                    if (files.count(name) && read_all(fs, path) != files[name]) {
+                        failures[t]++;
+                    }
+                    break;
+                case 3: {
+                    std::string copy = "c" + std::to_string(random() % 3) + ".txt";
+                    if (!files.count(name) || files.count(copy)) {
+                        break;
+                    }
+                    if (fs.copy_file(path, dir + "/" + copy) == fs_status::ok) {
+                        files[copy] = files[name];
+                    } else {
+                        failures[t]++;
+                    }
+                    break;
+                }
+                case 4: {
+                    std::string target = "m" + std::to_string(random() % 3) + ".txt";
+                    if (!files.count(name) || files.count(target)) {
+                        break;
+                    }
+                    if (fs.move_file(path, dir + "/" + target) == fs_status::ok) {
+                        files[target] = files[name];
+                        files.erase(name);
+                    } else {
+                        failures[t]++;
+                    }
+                    break;
+                }
+                case 5:
+                    if (!files.count(name)) {
+                        break;
+                    }
+                    if (fs.remove_file(path) == fs_status::ok) {
+                        files.erase(name);
+                    } else {
+                        failures[t]++;
+                    }
+                    break;
+            }
+        }
+        std::remove(host.c_str());
+    };
+
+    auto reader = [&](int slot) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> guard(done_mutex);
+                if (done) {
+                    return;
+                }
+            }
+            if (read_all(fs, "/shared.txt") != shared_content) {
+                failures[slot]++;
+            }
+            std::vector<entry_info> entries;
+            if (fs.list_directory("/", entries) != fs_status::ok) {
+                failures[slot]++;
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back(writer, t);
+    }
+    std::thread reader1(reader, threads);
+    std::thread reader2(reader, threads + 1);
+    for (std::thread& thread : writers) {
+        thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> guard(done_mutex);
+        done = true;
+    }
+    reader1.join();
+    reader2.join();
+    double elapsed = seconds_since(start);
+
+    int total_failures = 0;
+    for (int count : failures) {
+        total_failures += count;
+    }
+
+    // Everything has to survive a reload from the image as well
+    filesystem reopened(image);
+    check_report report;
+    fs_status status = reopened.open(&report);
+    if (status != fs_status::ok) {
+        std::cerr << "Reopen: " << status_message(status) << "\n";
+        total_failures++;
+    }
+    int files = 0;
+    for (int t = 0; t < threads; ++t) {
+        for (const auto& [name, content] : expected[t]) {
+            files++;
+            if (read_all(reopened, "/t" + std::to_string(t) + "/" + name) != content) {
+                std::cerr << "Mismatch in /t" << t << "/" << name << "\n";
+                total_failures++;
+            }
+        }
+    }
+    if (report.fixed_refcounts > 0 || report.reclaimed_clusters > 0) {
+        std::cerr << "Check fixed " << report.fixed_refcounts << " reference counts and reclaimed "
+                  << report.reclaimed_clusters << " clusters\n";
+        total_failures++;
+    }
+    std::remove(host_shared.c_str());
+
+    std::cout << threads << " threads x " << operations << " operations in " << elapsed << " s, "
+              << files << " files verified, " << total_failures << " failures\n";
+    return total_failures == 0 ? 0 : 1;
+}
+
+// One pipelined client connection of the load generator
+struct client_connection{
+    int fd = -1;
+    std::string in;
+
+    bool connect_to(const std::string& socket_path) {
+        sockaddr_un address{};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, socket_path.c_str());
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        return fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    }
+
+    bool send(const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    bool receive(response& res) {
+        char chunk[64 * 1024];
+        for (;;) {
+            bool malformed = false;
+            size_t used = decode_response(in.data(), in.size(), res, malformed);
+            if (used > 0) {
+                in.erase(0, used);
+                return true;
+            }
+            if (malformed) {
+                return false;
+            }
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0) {
+                return false;
+            }
+            in.append(chunk, n);
+        }
+    }
+
+    ~client_connection() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+static fs_status call(client_connection& connection, const request& req) {
+    std::string frame;
+    encode_request(frame, req);
+    response res;
+    if (!connection.send(frame) || !connection.receive(res)) {
+        return fs_status::io_error;
+    }
+    return res.status;
+}
+
+// Drives a running 'ZOS_sem --serve' with 4 KB reads and stats of one file, depth requests in flight per client,
+// and reports throughput and latency percentiles for every client count
+static int bench_load(const std::string& socket_path, double seconds, const std::vector<int>& client_counts, int depth) {
+    const int32_t file_size = 4 * 1024 * 1024;
+    const uint32_t read_size = 4096;
+    std::string host = "/tmp/zos_load_" + std::to_string(::getpid());
+    {
+        std::string content(file_size, '\0');
+        std::mt19937 random(1);
+        for (char& c : content) {
+            c = static_cast<char>('a' + random() % 26);
+        }
+        std::ofstream(host, std::ios::binary) << content;
+    }
+
+    client_connection setup;
+    if (!setup.connect_to(socket_path)) {
+        std::cerr << "Cannot connect to " << socket_path << "\n";
+        return 1;
+    }
+    call(setup, request{0, opcode::rm, {"/load.bin"}});
+    fs_status status = call(setup, request{0, opcode::incp, {host, "/load.bin", std::string(1, '\0')}});
+    std::remove(host.c_str());
+    if (status != fs_status::ok) {
+        std::cerr << "Import failed: " << status_message(status) << "\n";
+        return 1;
+    }
+
+    std::cout << "clients  ops/s       p50 us   p99 us   p99.9 us  max us\n";
+    for (int clients : client_counts) {
+        std::vector<std::vector<double>> latencies(clients);
+        std::vector<int> errors(clients, 0);
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+        auto client = [&](int c) {
+            client_connection connection;
+            if (!connection.connect_to(socket_path)) {
+                errors[c]++;
+                return;
+            }
+            std::mt19937 random(c);
+            std::vector<std::chrono::steady_clock::time_point> sent;
+            uint32_t tag = 0;
+            auto next_request = [&]() {
+                request req;
+                req.tag = tag++;
+                if (random() % 5 == 0) {
+                    req.op = opcode::stat;
+                    req.args = {"/load.bin"};
+                } else {
+                    req.op = opcode::read;
+                    req.args = {"/load.bin", u32_arg(random() % (file_size / read_size) * read_size), u32_arg(read_size)};
+                }
+                std::string frame;
+                encode_request(frame, req);
+                sent.push_back(std::chrono::steady_clock::now());
+                return frame;
+            };
+
+            std::string batch;
+            for (int i = 0; i < depth; ++i) {
+                batch += next_request();
+            }
+            if (!connection.send(batch)) {
+                errors[c]++;
+                return;
+            }
+
+            // Every response is replaced by a new request until the time is up, then the pipe is drained
+            size_t answered = 0;
+            bool sending = true;
+            while (answered < sent.size()) {
+                response res;
+                if (!connection.receive(res) || res.tag != answered) {
+                    errors[c]++;
+                    return;
+                }
+                auto now = std::chrono::steady_clock::now();
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(now - sent[answered]).count());
+                if (res.status != fs_status::ok) {
+                    errors[c]++;
+                }
+                answered++;
+                if (sending && now >= deadline) {
+                    sending = false;
+                }
+                if (sending && !connection.send(next_request())) {
+                    errors[c]++;
+                    return;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int c = 0; c < clients; ++c) {
+            threads.emplace_back(client, c);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        double elapsed = seconds_since(start);
+
+        std::vector<double> all;
+        int total_errors = 0;
+        for (int c = 0; c < clients; ++c) {
+            all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+            total_errors += errors[c];
+        }
+        if (all.empty()) {
+            std::cerr << "No responses from " << socket_path << "\n";
+            return 1;
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&all](double p) {
+            return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+        };
+        std::printf("%-8d %-11.0f %-8.1f %-8.1f %-9.1f %.1f", clients, all.size() / elapsed,
+                    percentile(0.50), percentile(0.99), percentile(0.999), all.back());
+        if (total_errors > 0) {
+            std::printf(" %d errors", total_errors);
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && std::string(argv[1]) == "compress") {
+        return bench_compress(argv[2]);
+    }
+    if (argc == 4 && std::string(argv[1]) == "copy") {
+        return bench_copy(argv[2], argv[3]);
+    }
+    if ((argc == 2 || argc == 3) && std::string(argv[1]) == "memory") {
+        return bench_memory(argc == 3 ? std::stoi(argv[2]) : 1000000);
+    }
+    if (argc == 3 && std::string(argv[1]) == "preallocate") {
+        return bench_preallocate(argv[2]);
+    }
+    if ((argc == 3 || argc == 5) && std::string(argv[1]) == "stress") {
+        int threads = argc == 5 ? std::stoi(argv[3]) : 8;
+        int operations = argc == 5 ? std::stoi(argv[4]) : 500;
+        return bench_stress(argv[2], threads, operations);
+    }
+
+    if ((argc == 4 || argc == 5 || argc == 6) && std::string(argv[1]) == "load") {
+        std::vector<int> client_counts = {1, 2, 4, 8, 16};
+        if (argc >= 5) {
+            client_counts.clear();
+            std::stringstream list(argv[4]);
+            std::string count;
+            while (std::getline(list, count, ',')) {
+                client_counts.push_back(std::stoi(count));
+            }
+        }
+        return bench_load(argv[2], std::stod(argv[3]), client_counts, argc == 6 ? std::stoi(argv[5]) : 16);
+    }
+
+    std::cerr << "Usage: " << argv[0] << " compress <host file>\n"
+              << "       " << argv[0] << " copy <image> <host file>\n"
+              << "       " << argv[0] << " memory [<files>]\n"
+              << "       " << argv[0] << " preallocate <image>\n"
+              << "       " << argv[0] << " stress <image> [<threads> <operations per thread>]\n"
+              << "       " << argv[0] << " load <socket> <seconds> [<client counts, e.g. 1,4,16> [<pipeline depth>]]" << std::endl;
+    return 1;
+}
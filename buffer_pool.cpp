@@ -0,0 +1,44 @@
+#include "buffer_pool.h"
+#include <cstdlib>
+#include <new>
+
+buffer_pool::buffer_pool(size_t buffer_size, size_t capacity)
+    : size((buffer_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT), capacity(capacity) {
+}
+
+buffer_pool::~buffer_pool() {
+    for (char* buffer : free_buffers) {
+        std::free(buffer);
+    }
+}
+
+std::vector<char*> buffer_pool::acquire(size_t wanted) {
+    std::unique_lock<std::mutex> guard(mutex);
+    available.wait(guard, [this] { return !free_buffers.empty() || allocated < capacity; });
+
+    std::vector<char*> buffers;
+    while (buffers.size() < wanted && !free_buffers.empty()) {
+        buffers.push_back(free_buffers.back());
+        free_buffers.pop_back();
+    }
+    while (buffers.size() < wanted && allocated < capacity) {
+        char* buffer = static_cast<char*>(std::aligned_alloc(ALIGNMENT, size));
+        if (!buffer) {
+            if (buffers.empty()) {
+                throw std::bad_alloc();
+            }
+            break;
+        }
+        allocated++;
+        buffers.push_back(buffer);
+    }
+    return buffers;
+}
+
+void buffer_pool::release(const std::vector<char*>& buffers) {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        free_buffers.insert(free_buffers.end(), buffers.begin(), buffers.end());
+    }
+    available.notify_all();
+}
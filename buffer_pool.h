@@ -0,0 +1,34 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+// Reusable I/O buffers of one size, aligned for direct I/O and allocated on first use up to a fixed count.
+// acquire() waits only while the caller holds nothing, so copies sharing the pool cannot deadlock.
+class buffer_pool{
+public:
+    static const size_t ALIGNMENT = 4096;
+
+    buffer_pool(size_t buffer_size, size_t capacity);
+    ~buffer_pool();
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    // Between 1 and wanted buffers, waits until at least one is free
+    std::vector<char*> acquire(size_t wanted);
+    void release(const std::vector<char*>& buffers);
+    size_t buffer_size() const { return size; }
+
+private:
+    size_t size;
+    size_t capacity;
+    size_t allocated = 0;
+    std::vector<char*> free_buffers;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#include "chain_index.h"
+#include "structures.h"
+#include <algorithm>
+#include <bit>
+
+void chain_index::build(int32_t start_cluster, const std::vector<int32_t>& fat){
+    // First pass only counts the clusters, the stride depends on the final length. A cycle in a damaged
+    // FAT ends the chain once it is as long as the FAT.
+    length = 0;
+    tail = -1;
+    int32_t cluster = start_cluster;
+    while (cluster != FAT_FILE_END && cluster >= 0 && cluster < static_cast<int32_t>(fat.size()) && length < static_cast<int32_t>(fat.size())){
+        tail = cluster;
+        length++;
+        cluster = fat[cluster];
+    }
+
+    stride = std::max(1, static_cast<int32_t>(std::bit_width(static_cast<uint32_t>(length))));
+    marks.clear();
+    marks.reserve(length / stride + 1);
+
+    cluster = start_cluster;
+    for (int32_t position = 0; position < length; ++position){
+        if (position % stride == 0){
+            marks.push_back(cluster);
+        }
+        cluster = fat[cluster];
+    }
+}
+
+int32_t chain_index::cluster_at(int32_t position, const std::vector<int32_t>& fat) const{
+    if (position < 0 || position >= length){
+        return -1;
+    }
+    if (position == length - 1){
+        return tail;
+    }
+
+    int32_t cluster = marks[position / stride];
+    for (int32_t i = 0; i < position % stride; ++i){
+        cluster = fat[cluster];
+    }
+    return cluster;
+}
+
+void chain_index::extend(int32_t cluster){
+    // The stride is kept, appended chains only get denser marks which keeps lookups within the bound
+    if (length % stride == 0){
+        marks.push_back(cluster);
+    }
+    tail = cluster;
+    length++;
+}
@@ -0,0 +1,21 @@
+#ifndef CHAIN_INDEX_H
+#define CHAIN_INDEX_H
+
+#include <vector>
+#include <cstdint>
+
+// Sparse skip index over one FAT cluster chain.
+// Every stride-th cluster of the chain is remembered, stride grows with log2 of the chain length,
+// so finding the cluster at any position needs at most ~log(n) FAT hops.
+struct chain_index{
+    int32_t length = 0;             // Number of clusters in the chain
+    int32_t stride = 1;             // Distance between two remembered positions
+    int32_t tail = -1;              // Last cluster of the chain
+    std::vector<int32_t> marks;     // marks[k] = cluster at position k * stride
+
+    void build(int32_t start_cluster, const std::vector<int32_t>& fat);
+    int32_t cluster_at(int32_t position, const std::vector<int32_t>& fat) const;
+    void extend(int32_t cluster);
+};
+
+#endif
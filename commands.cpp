@@ -0,0 +1,565 @@
+#include "commands.h"
+#include <cctype>
+#include <ctime>
+#include <iostream>
+#include <unordered_map>
+#include <unistd.h>
+#include "crc32c.h"
+#include "path_utils.h"
+#include "script.h"
+#include "timeline.h"
+#include "trace.h"
+
+void split_words(std::string_view line, std::vector<std::string_view>& words) {
+    words.clear();
+    size_t position = 0;
+    while (true) {
+        position = line.find_first_not_of(" \t\r\n\v\f", position);
+        if (position == std::string_view::npos) {
+            return;
+        }
+        size_t end = line.find_first_of(" \t\r\n\v\f", position);
+        if (end == std::string_view::npos) {
+            end = line.size();
+        }
+        words.push_back(line.substr(position, end - position));
+        position = end;
+    }
+}
+
+// Status the running command reported, execute_command() hands it to the trace recorder
+static fs_status reported_status = fs_status::ok;
+
+void print_status(const filesystem& fs, fs_status status) {
+    reported_status = status;
+    if (status == fs_status::checksum_error) {
+        std::cerr << "Checksum mismatch in cluster " << fs.bad_cluster << "\n";
+        return;
+    }
+    std::cerr << status_message(status) << "\n";
+}
+
+// Prints "OK" on success and the reason otherwise
+static void print_result(const filesystem& fs, fs_status status) {
+    if (status == fs_status::ok) {
+        std::cout << "OK\n";
+    } else {
+        print_status(fs, status);
+    }
+}
+
+void print_check_report(const check_report& report) {
+    if (report.corrupted) {
+        std::cout << status_message(fs_status::corrupted) << "\n";
+        return;
+    }
+    std::cout << "Filesystem is not corrupted\n";
+    if (report.fixed_refcounts > 0) {
+        std::cout << "Fixed " << report.fixed_refcounts << " cluster reference counts\n";
+    }
+    if (report.reclaimed_clusters > 0) {
+        std::cout << "Reclaimed " << report.reclaimed_clusters << " orphaned clusters\n";
+    }
+}
+
+static void print_fragmentation(const fragmentation_report& report) {
+    for (const auto& file : report.files) {
+        std::cout << file.path << " clusters: " << file.clusters << " runs: " << file.runs
+                  << " score: " << file.score << "\n";
+    }
+    std::cout << "Image fragmentation score: " << report.image_score << " (" << report.files.size() << " files)\n";
+}
+
+static void print_scrub_report(const scrub_report& report) {
+    double megabytes = report.verified_clusters * static_cast<double>(CLUSTER_SIZE) / (1024.0 * 1024.0);
+    std::cout << "Scrubbed " << report.verified_clusters << " clusters (" << megabytes << " MB) in "
+              << report.seconds * 1000.0 << " ms";
+    if (report.seconds > 0) {
+        std::cout << ", " << megabytes / report.seconds << " MB/s";
+    }
+    std::cout << " [crc32c " << crc32c_implementation() << "]\n";
+
+    if (report.bad_clusters.empty()) {
+        std::cout << "No checksum errors\n";
+        return;
+    }
+    for (const auto& [cluster, owner] : report.bad_clusters) {
+        std::cout << "Checksum mismatch in cluster " << cluster << (owner.empty() ? std::string() : " (" + owner + ")") << "\n";
+    }
+    std::cout << report.bad_clusters.size() << " checksum errors\n";
+}
+
+static void print_file(filesystem& fs, const std::string& path, int32_t offset, int32_t length) {
+    if (length < 0) {
+        print_status(fs, fs_status::invalid_argument);
+        return;
+    }
+    std::vector<char> data(length);
+    int32_t bytes_read = 0;
+    fs_status status = fs.read(path, offset, data, bytes_read);
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return;
+    }
+    std::cout.write(data.data(), bytes_read);
+    std::cout << "\n";
+}
+
+static void format_command(filesystem& fs, const arg_list& args) {
+    fs_status status = fs.format_fs(args[1]);
+    if (status == fs_status::ok) {
+        std::cout << "OK\n";
+    } else {
+        print_status(fs, status);
+        std::cout << "Cannot create file system\n";
+    }
+}
+
+static void resize_command(filesystem& fs, const arg_list& args) {
+    print_result(fs, fs.resize(args[1]));
+}
+
+static void mkdir_command(filesystem& fs, const arg_list& args) {
+    fs_status status = fs.make_directory(args[1]);
+    if (status == fs_status::ok) {
+        std::cout << "Directory created successfully\n";
+    } else {
+        print_status(fs, status);
+        std::cout << "Failed to create directory\n";
+    }
+}
+
+static void ls_command(filesystem& fs, const arg_list& args) {
+    std::vector<entry_info> entries;
+    reported_status = fs.list_directory(args.size() == 1 ? "" : args[1], entries);
+    if (reported_status != fs_status::ok) {
+        std::cerr << "Directory not found\n";
+        return;
+    }
+    if (entries.empty()) {
+        std::cout << "Directory is empty\n";
+        return;
+    }
+    for (const auto& entry : entries) {
+        std::cout << (entry.is_file ? "F" : "D") << " " << entry.name;
+        if (entry.is_file) {
+            std::cout << " (" << entry.size << " bytes)";
+        }
+        std::cout << "\n";
+    }
+}
+
+static void cd_command(filesystem& fs, const arg_list& args) {
+    reported_status = fs.change_directory(args[1]);
+    if (reported_status != fs_status::ok) {
+        std::cerr << "Directory not found\n";
+    }
+}
+
+// Prints how many files a wildcard command handled, or the reason it failed
+static void print_batch_result(const filesystem& fs, fs_status status, int32_t count, const char* verb) {
+    if (status == fs_status::ok) {
+        std::cout << verb << " " << count << (count == 1 ? " file\n" : " files\n");
+    } else {
+        print_status(fs, status);
+    }
+}
+
+static void rm_command(filesystem& fs, const arg_list& args) {
+    if (has_wildcards(args[1])) {
+        int32_t count = 0;
+        fs_status status = fs.remove_matching(args[1], count);
+        print_batch_result(fs, status, count, "Removed");
+        return;
+    }
+    fs_status status = fs.remove_file(args[1]);
+    if (status == fs_status::ok) {
+        std::cout << "Ok\n";
+    } else {
+        print_status(fs, status);
+    }
+}
+
+static void rmdir_command(filesystem& fs, const arg_list& args) {
+    fs_status status = fs.remove_directory(args[1]);
+    if (status == fs_status::ok) {
+        std::cout << "Ok\n";
+    } else {
+        print_status(fs, status);
+    }
+}
+
+static void pwd_command(filesystem& fs, const arg_list&) {
+    std::cout << fs.print_working_directory() << "\n";
+}
+
+static void incp_command(filesystem& fs, const arg_list& args) {
+    bool with_mode = args.size() == 4 && (args[1] == "-c" || args[1] == "-d");
+    if (args.size() != 3 && !with_mode) {
+        std::cerr << "Usage: incp [-c | -d] <source> <destination>\n";
+        return;
+    }
+    uint8_t flags = !with_mode ? 0 : args[1] == "-c" ? FILE_COMPRESSED : FILE_DEDUP;
+    import_report report;
+    fs_status status = fs.copy_file_in(args[args.size() - 2], args[args.size() - 1], flags, &report);
+    if (status == fs_status::ok && (flags & FILE_DEDUP)) {
+        std::cout << "Deduplicated " << report.shared_clusters << " of " << report.total_clusters << " clusters\n";
+    }
+    print_result(fs, status);
+}
+
+static void outcp_command(filesystem& fs, const arg_list& args) {
+    bool verify = args.size() == 4 && args[1] == "--verify";
+    if (args.size() != 3 && !verify) {
+        std::cerr << "Usage: outcp [--verify] <source> <destination>\n";
+        return;
+    }
+    print_result(fs, fs.copy_file_out(args[args.size() - 2], args[args.size() - 1], verify));
+}
+
+static void info_command(filesystem& fs, const arg_list& args) {
+    entry_info info;
+    fs_status status = fs.stat(args[1], info);
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return;
+    }
+    std::cout << info.name;
+    for (int32_t cluster : info.clusters) {
+        std::cout << " " << cluster;
+    }
+    if (info.flags & FILE_COMPRESSED) {
+        std::cout << "\ncompressed: " << info.size << " -> " << info.stored_size << " bytes, ratio "
+                  << (info.stored_size > 0 ? static_cast<double>(info.size) / info.stored_size : 0.0);
+    }
+    std::cout << "\n";
+}
+
+static void cat_command(filesystem& fs, const arg_list& args) {
+    entry_info info;
+    if (fs.stat(args[1], info) != fs_status::ok || !info.is_file) {
+        print_status(fs, fs_status::not_found);
+        return;
+    }
+    // Into a pipe, file or socket the contents go without a detour through the stream buffers
+    if (!isatty(STDOUT_FILENO)) {
+        std::cout.flush();
+        fs_status status = fs.send_file(args[1], STDOUT_FILENO);
+        if (status != fs_status::ok) {
+            print_status(fs, status);
+            return;
+        }
+        std::cout << "\n";
+        return;
+    }
+    print_file(fs, args[1], 0, info.size);
+}
+
+static void read_command(filesystem& fs, const arg_list& args) {
+    print_file(fs, args[1], std::stoi(args[2]), std::stoi(args[3]));
+}
+
+static void write_command(filesystem& fs, const arg_list& args) {
+    print_result(fs, fs.write(args[1], std::stoi(args[2]), args[3]));
+}
+
+static void append_command(filesystem& fs, const arg_list& args) {
+    print_result(fs, fs.append(args[1], args[2]));
+}
+
+// With wildcards in the source the destination is a directory
+static void cp_command(filesystem& fs, const arg_list& args) {
+    if (args.size() == 4 && args[1] == "-r") {
+        print_result(fs, fs.copy_tree(args[2], args[3]));
+        return;
+    }
+    if (args.size() != 3) {
+        std::cerr << "Usage: cp [-r] <source | pattern> <destination>\n";
+        return;
+    }
+    if (has_wildcards(args[1])) {
+        int32_t count = 0;
+        fs_status status = fs.copy_matching(args[1], args[2], count);
+        print_batch_result(fs, status, count, "Copied");
+        return;
+    }
+    print_result(fs, fs.copy_file(args[1], args[2]));
+}
+
+static void mv_command(filesystem& fs, const arg_list& args) {
+    if (has_wildcards(args[1])) {
+        int32_t count = 0;
+        fs_status status = fs.move_matching(args[1], args[2], count);
+        print_batch_result(fs, status, count, "Moved");
+        return;
+    }
+    print_result(fs, fs.move_file(args[1], args[2]));
+}
+
+static void load_command(filesystem& fs, const arg_list& args) {
+    run_script(fs, args[1]);
+}
+
+static void bug_command(filesystem& fs, const arg_list& args) {
+    fs_status status = fs.bug(args[1]);
+    if (status == fs_status::invalid_argument) {
+        std::cout << "Error: Unable to corrupt the file.\n";
+    } else {
+        print_result(fs, status);
+    }
+}
+
+static void scrub_command(filesystem& fs, const arg_list&) {
+    scrub_report report;
+    fs_status status = fs.scrub(report);
+    if (status != fs_status::ok && status != fs_status::checksum_error) {
+        print_status(fs, status);
+        return;
+    }
+    print_scrub_report(report);
+}
+
+static void trim_command(filesystem& fs, const arg_list&) {
+    trim_report report;
+    fs_status status = fs.trim(report);
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return;
+    }
+    std::cout << "Trimmed " << report.clusters << " clusters in " << report.runs << " runs\n";
+    std::cout << "Host file: " << report.host_bytes_before << " bytes allocated before, " << report.host_bytes_after << " after\n";
+}
+
+static void iostat_command(filesystem& fs, const arg_list&) {
+    uint64_t zero_copy = fs.zero_copy_bytes;
+    uint64_t buffered = fs.buffered_bytes;
+    std::cout << "Exported zero-copy: " << zero_copy << " bytes\n";
+    std::cout << "Exported buffered: " << buffered << " bytes\n";
+    std::cout << "Punched: " << fs.trimmed_clusters << " clusters in " << fs.trimmed_runs << " runs\n";
+    if (zero_copy + buffered > 0) {
+        std::cout << "Zero-copy share: " << 100.0 * zero_copy / (zero_copy + buffered) << " %\n";
+    }
+}
+
+static void dedup_command(filesystem& fs, const arg_list&) {
+    dedup_report report = fs.dedup_statistics();
+    int64_t saved = report.references - report.unique_clusters;
+    std::cout << "Deduplicated clusters: " << report.unique_clusters << "\n";
+    std::cout << "References: " << report.references << "\n";
+    std::cout << "Saved: " << saved << " clusters (" << saved * CLUSTER_SIZE << " bytes)\n";
+    if (report.unique_clusters > 0) {
+        std::cout << "Dedup ratio: " << static_cast<double>(report.references) / report.unique_clusters << "\n";
+    }
+}
+
+// The size is a byte count or carries a unit like the one of format
+static void fallocate_command(filesystem& fs, const arg_list& args) {
+    const std::string& size = args[2];
+    int32_t bytes = std::isdigit(static_cast<unsigned char>(size.back())) ? std::stoi(size) : fs.parse_size(size);
+    print_result(fs, fs.preallocate(args[1], bytes));
+}
+
+static void du_command(filesystem& fs, const arg_list& args) {
+    usage_totals totals;
+    fs_status status = fs.disk_usage(args.size() == 1 ? "" : args[1], totals);
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return;
+    }
+    std::cout << totals.files << " files, " << totals.bytes << " bytes, " << totals.clusters << " clusters ("
+              << totals.clusters * CLUSTER_SIZE << " bytes on disk)\n";
+}
+
+static void df_command(filesystem& fs, const arg_list&) {
+    space_report report = fs.disk_free();
+    int64_t used = report.total_clusters - report.free_clusters;
+    std::cout << "Clusters: " << report.total_clusters << " total, " << used << " used, " << report.free_clusters << " free\n";
+    std::cout << "Bytes: " << static_cast<int64_t>(report.total_clusters) * CLUSTER_SIZE << " total, " << used * CLUSTER_SIZE
+              << " used, " << static_cast<int64_t>(report.free_clusters) * CLUSTER_SIZE << " free\n";
+    if (report.total_clusters > 0) {
+        std::cout << "Use: " << 100.0 * used / report.total_clusters << " %\n";
+    }
+}
+
+static void snapshot_command(filesystem& fs, const arg_list& args) {
+    const std::string& action = args[1];
+    if (action == "list" && args.size() == 2) {
+        std::vector<snapshot_info> list;
+        fs.list_snapshots(list);
+        if (list.empty()) {
+            std::cout << "No snapshots\n";
+        }
+        for (const snapshot_info& info : list) {
+            char created[32];
+            std::time_t time = static_cast<std::time_t>(info.created);
+            std::strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
+            std::cout << info.name << " " << created << " (" << info.saved_entries << " FAT entries diverged)\n";
+        }
+        return;
+    }
+    if (args.size() != 3) {
+        std::cerr << "Usage: snapshot create <name> | list | restore <name> | delete <name>\n";
+        return;
+    }
+    if (action == "create") {
+        print_result(fs, fs.create_snapshot(args[2]));
+    } else if (action == "restore") {
+        print_result(fs, fs.restore_snapshot(args[2]));
+    } else if (action == "delete") {
+        print_result(fs, fs.delete_snapshot(args[2]));
+    } else {
+        std::cerr << "Usage: snapshot create <name> | list | restore <name> | delete <name>\n";
+    }
+}
+
+static void defrag_command(filesystem& fs, const arg_list& args) {
+    if (args.size() == 1) {
+        int32_t moved = 0;
+        reported_status = fs.defrag(moved);
+        std::cout << "Defragmented " << moved << " files\n";
+        if (reported_status != fs_status::ok) {
+            print_status(fs, reported_status);
+        }
+        print_fragmentation(fs.fragmentation());
+    } else if (args[1] == "score" && args.size() == 2) {
+        print_fragmentation(fs.fragmentation());
+    } else if (args[1] == "start" && args.size() == 3) {
+        fs.start_background_defrag(std::stoi(args[2]));
+        std::cout << "OK\n";
+    } else if (args[1] == "stop" && args.size() == 2) {
+        fs.stop_background_defrag();
+        std::cout << "OK\n";
+    } else {
+        std::cerr << "Usage: defrag [score | start <ms> | stop]\n";
+    }
+}
+
+static void trace_command(filesystem& fs, const arg_list& args) {
+    if (args.size() == 1) {
+        std::cout << (tracing() ? "Recording a trace\n" : "Not recording\n");
+    } else if (args[1] == "start" && args.size() == 3) {
+        if (start_trace(fs, args[2])) {
+            std::cout << "OK\n";
+        } else {
+            print_status(fs, fs_status::io_error);
+        }
+    } else if (args[1] == "stop" && args.size() == 2) {
+        stop_trace();
+        std::cout << "OK\n";
+    } else {
+        std::cerr << "Usage: trace [start <file> | stop]\n";
+    }
+}
+
+static void timeline_command(filesystem& fs, const arg_list& args) {
+    if (args[1] == "start" && args.size() == 2) {
+        timeline_start();
+        std::cout << "OK\n";
+    } else if (args[1] == "stop" && args.size() == 3) {
+        print_result(fs, timeline_stop(args[2]));
+    } else {
+        std::cerr << "Usage: timeline start | stop <json file>\n";
+    }
+}
+
+static void check_command(filesystem& fs, const arg_list&) {
+    check_report report;
+    fs_status status = fs.check(report);
+    if (status != fs_status::ok && status != fs_status::corrupted) {
+        print_status(fs, status);
+    }
+    print_check_report(report);
+}
+
+static const command_spec commands[] = {
+    {"format", 1, 1, "format <size>", format_command},
+    {"resize", 1, 1, "resize <size>", resize_command},
+    {"mkdir", 1, 1, "mkdir <directory_name>", mkdir_command},
+    {"ls", 0, 1, "ls [directory_path]", ls_command},
+    {"cd", 1, 1, "cd <directory_path>", cd_command},
+    {"rmdir", 1, 1, "rmdir <directory_path>", rmdir_command},
+    {"rm", 1, 1, "rm <file_path | pattern>", rm_command},
+    {"pwd", 0, 0, "pwd", pwd_command},
+    {"incp", 2, 3, "incp [-c | -d] <source> <destination>", incp_command},
+    {"outcp", 2, 3, "outcp [--verify] <source> <destination>", outcp_command},
+    {"info", 1, 1, "info <path>", info_command},
+    {"cat", 1, 1, "cat <file>", cat_command},
+    {"read", 3, 3, "read <file> <offset> <length>", read_command},
+    {"write", 3, 3, "write <file> <offset> <text>", write_command, 3},
+    {"append", 2, 2, "append <file> <text>", append_command, 2},
+    {"fallocate", 2, 2, "fallocate <file> <size>", fallocate_command},
+    {"cp", 2, 3, "cp [-r] <source | pattern> <destination>", cp_command},
+    {"mv", 2, 2, "mv <source | pattern> <destination>", mv_command},
+    {"load", 1, 1, "load <file_path>", load_command},
+    {"bug", 1, 1, "bug <file_path>", bug_command},
+    {"scrub", 0, 0, "scrub", scrub_command},
+    {"trim", 0, 0, "trim", trim_command},
+    {"iostat", 0, 0, "iostat", iostat_command},
+    {"dedup", 0, 0, "dedup", dedup_command},
+    {"du", 0, 1, "du [path]", du_command},
+    {"df", 0, 0, "df", df_command},
+    {"snapshot", 1, 2, "snapshot create <name> | list | restore <name> | delete <name>", snapshot_command},
+    {"defrag", 0, 2, "defrag [score | start <ms> | stop]", defrag_command},
+    {"trace", 0, 2, "trace [start <file> | stop]", trace_command},
+    {"timeline", 1, 2, "timeline start | stop <json file>", timeline_command},
+    {"check", 0, 0, "check", check_command},
+};
+
+const command_spec* find_command(std::string_view name) {
+    static const std::unordered_map<std::string_view, const command_spec*> index = [] {
+        std::unordered_map<std::string_view, const command_spec*> map;
+        for (const command_spec& spec : commands) {
+            map.emplace(spec.name, &spec);
+        }
+        return map;
+    }();
+
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : it->second;
+}
+
+fs_status execute_command(filesystem& fs, const command_spec* spec, const arg_list& args) {
+    if (!spec) {
+        std::cerr << "Command not found\n";
+        return fs_status::invalid_argument;
+    }
+    int count = static_cast<int>(args.size()) - 1;
+    if (count < spec->min_args || (spec->max_args >= 0 && count > spec->max_args)) {
+        std::cerr << "Usage: " << spec->usage << "\n";
+        return fs_status::invalid_argument;
+    }
+    auto start = std::chrono::steady_clock::now();
+    reported_status = fs_status::ok;
+    spec->run(fs, args);
+    fs_status status = reported_status;
+    record_command(args, start, status);
+    return status;
+}
+
+void split_command(std::string_view line, std::vector<std::string_view>& words) {
+    split_words(line, words);
+    const command_spec* spec = words.empty() ? nullptr : find_command(words[0]);
+    if (!spec || spec->text_arg == 0 || words.size() <= spec->text_arg) {
+        return;
+    }
+    // Runs of whitespace inside the text are kept, only the line ending is not part of it
+    std::string_view text = line.substr(words[spec->text_arg].data() - line.data());
+    text = text.substr(0, text.find_last_not_of("\r\n") + 1);
+    words.resize(spec->text_arg + 1);
+    words.back() = text;
+}
+
+void execute_line(filesystem& fs, const std::string& line) {
+    std::vector<std::string_view> words;
+    split_command(line, words);
+    if (words.empty()) {
+        return;
+    }
+
+    std::vector<std::string> strings(words.begin(), words.end());
+    std::vector<const std::string*> pointers;
+    for (const std::string& word : strings) {
+        pointers.push_back(&word);
+    }
+    execute_command(fs, find_command(words[0]), arg_list(pointers.data(), pointers.size()));
+}
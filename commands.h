@@ -0,0 +1,50 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "filesystem.h"
+
+// Arguments of one command, [0] is the command name.
+// They point into the words of a typed line or into the interned strings of a script plan.
+class arg_list{
+public:
+    arg_list(const std::string* const* items, size_t count): items(items), count(count) {}
+    const std::string& operator[](size_t i) const { return *items[i]; }
+    size_t size() const { return count; }
+
+private:
+    const std::string* const* items;
+    size_t count;
+};
+
+using command_handler = void (*)(filesystem& fs, const arg_list& args);
+
+// One entry of the shell's command table. Argument counts do not include the command name,
+// max_args of -1 means any number. The usage line is printed when the count does not fit.
+// A command taking free text names the argument where it starts, that argument holds the rest
+// of the line as typed.
+struct command_spec{
+    const char* name;
+    int min_args;
+    int max_args;
+    const char* usage;
+    command_handler run;
+    size_t text_arg = 0;
+};
+
+const command_spec* find_command(std::string_view name);
+// Checks the argument count and runs the command, a null spec is an unknown command.
+// Returns the status the command reported, ok when it reported none.
+fs_status execute_command(filesystem& fs, const command_spec* spec, const arg_list& args);
+// Splits a line on whitespace and runs it, used by the interactive shell
+void execute_line(filesystem& fs, const std::string& line);
+void split_words(std::string_view line, std::vector<std::string_view>& words);
+// Splits a command line into its arguments, the free text of a command stays one argument
+void split_command(std::string_view line, std::vector<std::string_view>& words);
+
+void print_status(const filesystem& fs, fs_status status);
+void print_check_report(const check_report& report);
+
+#endif
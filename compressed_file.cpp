@@ -0,0 +1,123 @@
+#include "filesystem.h"
+#include "compression.h"
+
+bool filesystem::build_compressed_stream(std::ifstream& source, std::streamsize size, std::vector<char>& stream) {
+    compressed_header header;
+    header.magic = COMPRESSED_MAGIC;
+    header.chunk_count = static_cast<uint32_t>((size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+
+    std::vector<uint32_t> offsets;
+    offsets.reserve(header.chunk_count + 1);
+    std::vector<char> data;
+    data.reserve(size / 2);
+
+    char raw[CLUSTER_SIZE];
+    char packed[CLUSTER_SIZE];
+    for (uint32_t chunk = 0; chunk < header.chunk_count; ++chunk) {
+        std::streamsize chunk_size = std::min<std::streamsize>(CLUSTER_SIZE, size - static_cast<std::streamsize>(chunk) * CLUSTER_SIZE);
+        if (!source.read(raw, chunk_size)) {
+            return false;
+        }
+
+        // A chunk only stays compressed if that saves at least one byte, otherwise it is kept as is
+        size_t packed_size = lz_compress(raw, chunk_size, packed, chunk_size - 1);
+        uint32_t position = static_cast<uint32_t>(data.size());
+        if (packed_size == 0) {
+            offsets.push_back(position | CHUNK_RAW);
+            data.insert(data.end(), raw, raw + chunk_size);
+        } else {
+            offsets.push_back(position);
+            data.insert(data.end(), packed, packed + packed_size);
+        }
+    }
+    offsets.push_back(static_cast<uint32_t>(data.size()));
+
+    stream.resize(sizeof(header) + offsets.size() * sizeof(uint32_t) + data.size());
+    char* out = stream.data();
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    std::memcpy(out, offsets.data(), offsets.size() * sizeof(uint32_t));
+    out += offsets.size() * sizeof(uint32_t);
+    std::memcpy(out, data.data(), data.size());
+    return true;
+}
+
+const std::vector<uint32_t>* filesystem::get_chunk_index(directory_item* file) {
+    {
+        std::lock_guard<std::mutex> cache_guard(cache_mutex);
+        auto it = chunk_cache.find(file->start_cluster);
+        if (it != chunk_cache.end()) {
+            return &it->second;
+        }
+    }
+
+    compressed_header header;
+    if (read_chain_range(file->start_cluster, 0, sizeof(header), reinterpret_cast<char*>(&header)) != fs_status::ok ||
+        header.magic != COMPRESSED_MAGIC) {
+        return nullptr;
+    }
+
+    std::vector<uint32_t> offsets(header.chunk_count + 1);
+    if (read_chain_range(file->start_cluster, sizeof(header), offsets.size() * sizeof(uint32_t),
+        reinterpret_cast<char*>(offsets.data())) != fs_status::ok) {
+        return nullptr;
+    }
+
+    // Another reader may have loaded it meanwhile, emplace keeps whichever came first
+    std::lock_guard<std::mutex> cache_guard(cache_mutex);
+    return &chunk_cache.emplace(file->start_cluster, std::move(offsets)).first->second;
+}
+
+int32_t filesystem::compressed_stored_size(directory_item* file) {
+    const std::vector<uint32_t>* offsets = get_chunk_index(file);
+    if (!offsets) {
+        return 0;
+    }
+    return sizeof(compressed_header) + offsets->size() * sizeof(uint32_t) + (offsets->back() & ~CHUNK_RAW);
+}
+
+fs_status filesystem::read_compressed_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out) {
+    const std::vector<uint32_t>* offsets = get_chunk_index(file);
+    if (!offsets) {
+        return fs_status::io_error;
+    }
+
+    int32_t data_start = sizeof(compressed_header) + offsets->size() * sizeof(uint32_t);
+    char packed[CLUSTER_SIZE];
+    char raw[CLUSTER_SIZE];
+    int32_t done = 0;
+
+    // Only the chunks overlapping the range are fetched and decoded
+    while (done < length) {
+        int32_t position = offset + done;
+        uint32_t chunk = position / CLUSTER_SIZE;
+        if (chunk + 1 >= offsets->size()) {
+            return fs_status::io_error;
+        }
+
+        uint32_t begin = (*offsets)[chunk] & ~CHUNK_RAW;
+        uint32_t end = (*offsets)[chunk + 1] & ~CHUNK_RAW;
+        int32_t chunk_size = std::min(CLUSTER_SIZE, file->size - static_cast<int32_t>(chunk) * CLUSTER_SIZE);
+        if (end < begin || end - begin > static_cast<uint32_t>(CLUSTER_SIZE)) {
+            return fs_status::io_error;
+        }
+        fs_status status = read_chain_range(in, file->start_cluster, data_start + begin, end - begin, packed);
+        if (status != fs_status::ok) {
+            return status;
+        }
+
+        const char* chunk_data = packed;
+        if (!((*offsets)[chunk] & CHUNK_RAW)) {
+            if (lz_decompress(packed, end - begin, raw, CLUSTER_SIZE) != static_cast<size_t>(chunk_size)) {
+                return fs_status::io_error;
+            }
+            chunk_data = raw;
+        }
+
+        int32_t in_chunk = position % CLUSTER_SIZE;
+        int32_t bytes = std::min(chunk_size - in_chunk, length - done);
+        std::memcpy(out + done, chunk_data + in_chunk, bytes);
+        done += bytes;
+    }
+    return fs_status::ok;
+}
@@ -0,0 +1,136 @@
+#include "compression.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// A sequence is: token, literal length extension, literals, 16 bit offset, match length extension.
+// The high nibble of the token is the literal count, the low nibble the match length - MIN_MATCH,
+// a nibble of 15 means that more length bytes follow. The last sequence of a block has literals only.
+static const size_t MIN_MATCH = 4;
+static const int HASH_BITS = 12;
+static const size_t MAX_OFFSET = 65535;
+
+static uint32_t read32(const char* p){
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value){
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static bool put_length(size_t length, char* out, size_t& op, size_t capacity){
+    while (length >= 255){
+        if (op >= capacity) return false;
+        out[op++] = static_cast<char>(255);
+        length -= 255;
+    }
+    if (op >= capacity) return false;
+    out[op++] = static_cast<char>(length);
+    return true;
+}
+
+static bool put_sequence(const char* literals, size_t literal_count, size_t offset, size_t match_length,
+    char* out, size_t& op, size_t capacity){
+
+    if (op >= capacity) return false;
+    size_t token_pos = op++;
+    uint8_t token = static_cast<uint8_t>(std::min<size_t>(literal_count, 15) << 4);
+    if (literal_count >= 15 && !put_length(literal_count - 15, out, op, capacity)) return false;
+
+    if (op + literal_count > capacity) return false;
+    std::memcpy(out + op, literals, literal_count);
+    op += literal_count;
+
+    if (match_length > 0){
+        size_t code = match_length - MIN_MATCH;
+        token |= static_cast<uint8_t>(std::min<size_t>(code, 15));
+        if (op + 2 > capacity) return false;
+        out[op++] = static_cast<char>(offset & 0xFF);
+        out[op++] = static_cast<char>(offset >> 8);
+        if (code >= 15 && !put_length(code - 15, out, op, capacity)) return false;
+    }
+    out[token_pos] = static_cast<char>(token);
+    return true;
+}
+
+size_t lz_compress(const char* in, size_t length, char* out, size_t capacity){
+    std::vector<int32_t> table(1 << HASH_BITS, -1);
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    while (ip + MIN_MATCH <= length){
+        uint32_t sequence = read32(in + ip);
+        uint32_t h = hash32(sequence);
+        int32_t candidate = table[h];
+        table[h] = static_cast<int32_t>(ip);
+
+        if (candidate < 0 || ip - candidate > MAX_OFFSET || read32(in + candidate) != sequence){
+            ip++;
+            continue;
+        }
+
+        size_t match_length = MIN_MATCH;
+        while (ip + match_length < length && in[candidate + match_length] == in[ip + match_length]){
+            match_length++;
+        }
+
+        if (!put_sequence(in + anchor, ip - anchor, ip - candidate, match_length, out, op, capacity)){
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+    }
+
+    if (!put_sequence(in + anchor, length - anchor, 0, 0, out, op, capacity)){
+        return 0;
+    }
+    return op;
+}
+
+static bool get_length(const char* in, size_t length, size_t& ip, size_t& value){
+    uint8_t byte;
+    do {
+        if (ip >= length) return false;
+        byte = static_cast<uint8_t>(in[ip++]);
+        value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t lz_decompress(const char* in, size_t length, char* out, size_t capacity){
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < length){
+        uint8_t token = static_cast<uint8_t>(in[ip++]);
+
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !get_length(in, length, ip, literal_count)) return SIZE_MAX;
+        if (ip + literal_count > length || op + literal_count > capacity) return SIZE_MAX;
+        std::memcpy(out + op, in + ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+
+        if (ip == length){
+            break;
+        }
+
+        if (ip + 2 > length) return SIZE_MAX;
+        size_t offset = static_cast<uint8_t>(in[ip]) | (static_cast<size_t>(static_cast<uint8_t>(in[ip + 1])) << 8);
+        ip += 2;
+        size_t match_length = token & 0x0F;
+        if (match_length == 15 && !get_length(in, length, ip, match_length)) return SIZE_MAX;
+        match_length += MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + match_length > capacity) return SIZE_MAX;
+        // Byte by byte on purpose, matches may overlap the bytes they produce
+        for (size_t i = 0; i < match_length; ++i){
+            out[op] = out[op - offset];
+            op++;
+        }
+    }
+    return op;
+}
@@ -0,0 +1,16 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Self contained LZ77 block codec (LZ4 style sequences), used for compressed files.
+// Every call works on one independent block, so any chunk of a file can be decoded on its own.
+
+// Returns the compressed size, or 0 when the result would not fit into capacity
+size_t lz_compress(const char* in, size_t length, char* out, size_t capacity);
+
+// Returns the decompressed size, or SIZE_MAX when the input is malformed or does not fit into capacity
+size_t lz_decompress(const char* in, size_t length, char* out, size_t capacity);
+
+#endif
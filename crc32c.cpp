@@ -0,0 +1,99 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+static const uint32_t POLYNOMIAL = 0x82F63B78; // Castagnoli, reflected
+
+static std::array<uint32_t, 256> make_table(){
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i){
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit){
+            crc = (crc >> 1) ^ ((crc & 1) ? POLYNOMIAL : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+static uint32_t crc32c_software(uint32_t crc, const char* data, size_t length){
+    static const std::array<uint32_t, 256> table = make_table();
+    for (size_t i = 0; i < length; ++i){
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t length){
+    size_t i = 0;
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; i + 8 <= length; i += 8){
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    for (; i < length; ++i){
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(data[i]));
+    }
+    return crc;
+}
+
+static bool has_hardware(){
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#elif defined(CRC32C_ARM)
+static uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t length){
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8){
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; i < length; ++i){
+        crc = __crc32cb(crc, static_cast<uint8_t>(data[i]));
+    }
+    return crc;
+}
+
+static bool has_hardware(){
+    return true;
+}
+#else
+static uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t length){
+    return crc32c_software(crc, data, length);
+}
+
+static bool has_hardware(){
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t length){
+    crc = ~crc;
+    crc = has_hardware() ? crc32c_hardware(crc, data, length) : crc32c_software(crc, data, length);
+    return ~crc;
+}
+
+const char* crc32c_implementation(){
+#if defined(CRC32C_X86)
+    return has_hardware() ? "sse4.2" : "table";
+#elif defined(CRC32C_ARM)
+    return "armv8-crc";
+#else
+    return "table";
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli) of a buffer, continuing from crc (0 for a new checksum).
+// Uses the SSE4.2 / ARMv8 CRC instructions when the CPU has them, a lookup table otherwise.
+uint32_t crc32c(uint32_t crc, const char* data, size_t length);
+
+// Name of the implementation crc32c() dispatches to, for reports
+const char* crc32c_implementation();
+
+#endif
@@ -0,0 +1,211 @@
+#include "filesystem.h"
+
+// 64 bit content fingerprint of one cluster (murmur style mixing of 8 byte words)
+static uint64_t block_hash(const char* data, size_t length) {
+    const uint64_t m = 0xC6A4A7935BD1E995ull;
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (length * m);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t k;
+        std::memcpy(&k, data + i, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    for (; i < length; ++i) {
+        h ^= static_cast<uint8_t>(data[i]);
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    // 0 marks clusters without a fingerprint
+    return h == 0 ? 1 : h;
+}
+
+void filesystem::rebuild_fingerprint_index() {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    fingerprint_index.clear();
+    for (size_t i = 1; i < refcounts.size(); ++i) {
+        if (refcounts[i] > 0 && fingerprints[i] != 0) {
+            fingerprint_index.emplace(fingerprints[i], static_cast<int32_t>(i));
+        }
+    }
+}
+
+void filesystem::retain_block(int32_t cluster) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    refcounts[cluster]++;
+}
+
+void filesystem::release_block(int32_t cluster) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    if (refcounts[cluster] > 1) {
+        refcounts[cluster]--;
+        return;
+    }
+
+    // Last reference gone, the cluster goes back to the free pool
+    auto it = fingerprint_index.find(fingerprints[cluster]);
+    if (it != fingerprint_index.end() && it->second == cluster) {
+        fingerprint_index.erase(it);
+    }
+    refcounts[cluster] = 0;
+    release_cluster(cluster);
+    // A held cluster keeps its fingerprint in case a snapshot restore brings it back
+    if (fat1[cluster] != FAT_SNAPSHOT) {
+        fingerprints[cluster] = 0;
+    }
+}
+
+fs_status filesystem::build_dedup_map(std::ifstream& source, std::streamsize size, std::vector<char>& stream, import_report* report) {
+    int32_t block_count = static_cast<int32_t>((size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    std::vector<int32_t> blocks;
+    blocks.reserve(block_count);
+
+    std::fstream fs_file(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+
+    char buffer[CLUSTER_SIZE];
+    char existing[CLUSTER_SIZE];
+    int32_t shared = 0;
+    int32_t last_new = -1;
+
+    for (int32_t i = 0; i < block_count; ++i) {
+        std::memset(buffer, 0, CLUSTER_SIZE);
+        source.read(buffer, std::min<std::streamsize>(CLUSTER_SIZE, size - static_cast<std::streamsize>(i) * CLUSTER_SIZE));
+        uint64_t fingerprint = block_hash(buffer, CLUSTER_SIZE);
+
+        // Lookup, compare and retain happen under the table lock so a hit cannot be released in between
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+
+        // A fingerprint hit is confirmed byte by byte before the cluster is shared
+        auto it = fingerprint_index.find(fingerprint);
+        if (it != fingerprint_index.end()) {
+            if (read_cluster(fs_file, it->second, existing) == fs_status::ok && std::memcmp(existing, buffer, CLUSTER_SIZE) == 0) {
+                retain_block(it->second);
+                blocks.push_back(it->second);
+                shared++;
+                continue;
+            }
+            fs_file.clear();
+        }
+
+        // New blocks of one file are placed behind each other
+        int cluster = allocate_cluster_near(last_new);
+        if (cluster == -1) {
+            for (int32_t block : blocks) {
+                release_block(block);
+            }
+            return fs_status::no_space;
+        }
+
+        write_cluster(fs_file, cluster, buffer);
+        refcounts[cluster] = 1;
+        fingerprints[cluster] = fingerprint;
+        fingerprint_index.emplace(fingerprint, cluster);
+        blocks.push_back(cluster);
+        last_new = cluster;
+    }
+
+    if (!fs_file) {
+        for (int32_t block : blocks) {
+            release_block(block);
+        }
+        return fs_status::io_error;
+    }
+
+    if (report) {
+        report->shared_clusters = shared;
+        report->total_clusters = block_count;
+    }
+    stream.resize(blocks.size() * sizeof(int32_t));
+    std::memcpy(stream.data(), blocks.data(), stream.size());
+    return fs_status::ok;
+}
+
+// Drops the references a map from build_dedup_map() holds, for an import that does not complete
+void filesystem::release_dedup_map(const std::vector<char>& stream) {
+    for (size_t offset = 0; offset + sizeof(int32_t) <= stream.size(); offset += sizeof(int32_t)) {
+        int32_t block;
+        std::memcpy(&block, stream.data() + offset, sizeof(block));
+        release_block(block);
+    }
+}
+
+fs_status filesystem::read_block_map(directory_item* file, std::vector<int32_t>& blocks) {
+    int32_t block_count = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    blocks.resize(block_count);
+    return read_chain_range(file->start_cluster, 0, block_count * sizeof(int32_t), reinterpret_cast<char*>(blocks.data()));
+}
+
+fs_status filesystem::read_dedup_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out) {
+    if (length == 0) {
+        return fs_status::ok;
+    }
+
+    // Only the part of the block map covering the range is fetched
+    int32_t first = offset / CLUSTER_SIZE;
+    int32_t last = (offset + length - 1) / CLUSTER_SIZE;
+    std::vector<int32_t> blocks(last - first + 1);
+    fs_status status = read_chain_range(in, file->start_cluster, first * sizeof(int32_t), blocks.size() * sizeof(int32_t),
+        reinterpret_cast<char*>(blocks.data()));
+    if (status != fs_status::ok) {
+        return status;
+    }
+
+    char buffer[CLUSTER_SIZE];
+    int32_t done = 0;
+    for (int32_t block : blocks) {
+        if (block < 0 || block >= static_cast<int32_t>(fat1.size())) {
+            return fs_status::io_error;
+        }
+        status = read_cluster(in, block, buffer);
+        if (status != fs_status::ok) {
+            return status;
+        }
+        int32_t in_cluster = (offset + done) % CLUSTER_SIZE;
+        int32_t bytes = std::min(CLUSTER_SIZE - in_cluster, length - done);
+        std::memcpy(out + done, buffer + in_cluster, bytes);
+        done += bytes;
+    }
+    return fs_status::ok;
+}
+
+void filesystem::count_block_references(directory_item* dir, std::vector<uint32_t>& references) {
+    for (auto& child : dir->contents->children) {
+        if (!child.is_file) {
+            count_block_references(&child, references);
+            continue;
+        }
+        if (!(child.flags & FILE_DEDUP)) {
+            continue;
+        }
+
+        std::vector<int32_t> blocks;
+        if (read_block_map(&child, blocks) != fs_status::ok) {
+            continue;
+        }
+        for (int32_t block : blocks) {
+            if (block > 0 && block < static_cast<int32_t>(references.size())) {
+                references[block]++;
+            }
+        }
+    }
+}
+
+dedup_report filesystem::dedup_statistics() {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    dedup_report report;
+    for (size_t i = 1; i < refcounts.size(); ++i) {
+        if (refcounts[i] > 0) {
+            report.references += refcounts[i];
+            report.unique_clusters++;
+        }
+    }
+    return report;
+}
@@ -0,0 +1,253 @@
+#include <chrono>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include "filesystem.h"
+
+static const int32_t DEFRAG_PAUSE_MS = 100;      // Between background steps that moved files
+static const int32_t DEFRAG_IDLE_PAUSE_MS = 1000; // Between background steps after one that found nothing
+
+// Number of contiguous runs in a chain, a contiguous file has exactly one
+int32_t filesystem::count_runs(int32_t start_cluster, int32_t& clusters) {
+    clusters = 0;
+    int32_t runs = 0;
+    int32_t previous = -2;
+    int32_t cluster = start_cluster;
+    while (cluster != FAT_FILE_END && cluster >= 0 && cluster < static_cast<int32_t>(fat1.size()) &&
+           clusters < static_cast<int32_t>(fat1.size())) {
+        if (cluster != previous + 1) {
+            runs++;
+        }
+        clusters++;
+        previous = cluster;
+        cluster = fat1[cluster];
+    }
+    return runs;
+}
+
+// 0 means contiguous, 1 means that no two neighbouring clusters of the file are adjacent in the image
+double filesystem::fragmentation_score(int32_t start_cluster) {
+    int32_t clusters = 0;
+    int32_t runs = count_runs(start_cluster, clusters);
+    if (clusters <= 1) {
+        return 0.0;
+    }
+    return static_cast<double>(runs - 1) / (clusters - 1);
+}
+
+void filesystem::collect_files(directory_item* dir, const std::string& path,
+    std::vector<std::pair<std::string, directory_item*>>& files) {
+
+    for (auto& child : dir->contents->children) {
+        std::string child_path = path + "/" + child.item_name;
+        if (child.is_file) {
+            files.emplace_back(child_path, &child);
+        } else {
+            collect_files(&child, child_path, files);
+        }
+    }
+}
+
+fragmentation_report filesystem::fragmentation() {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    std::vector<std::pair<std::string, directory_item*>> files;
+    collect_files(&root_folder[0], "", files);
+
+    fragmentation_report report;
+    int64_t total_breaks = 0;
+    int64_t total_links = 0;
+    for (const auto& [path, file] : files) {
+        file_fragmentation entry;
+        entry.path = path;
+        entry.runs = count_runs(file->start_cluster, entry.clusters);
+        entry.score = fragmentation_score(file->start_cluster);
+        if (entry.clusters > 1) {
+            total_breaks += entry.runs - 1;
+            total_links += entry.clusters - 1;
+        }
+        report.files.push_back(std::move(entry));
+    }
+
+    report.image_score = total_links == 0 ? 0.0 : static_cast<double>(total_breaks) / total_links;
+    return report;
+}
+
+int32_t filesystem::find_free_run(int32_t length) {
+    // Best fit, the smallest free run that still holds the whole chain
+    int32_t best_start = -1;
+    int32_t best_length = INT32_MAX;
+    int32_t count = static_cast<int32_t>(fat1.size());
+    int32_t i = 1;
+    while (i < count) {
+        if (fat1[i] != FAT_UNUSED) {
+            i++;
+            continue;
+        }
+        int32_t start = i;
+        while (i < count && fat1[i] == FAT_UNUSED) {
+            i++;
+        }
+        int32_t run = i - start;
+        if (run >= length && run < best_length) {
+            best_start = start;
+            best_length = run;
+            if (run == length) {
+                break;
+            }
+        }
+    }
+    return best_start;
+}
+
+void filesystem::sync_image() {
+    int fd = ::open(file_name.c_str(), O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+    ::fsync(fd);
+    ::close(fd);
+}
+
+// Moves a fragmented file into one free run. A file that cannot move stays where it is with moved false
+// and an ok status, a failed commit is returned.
+fs_status filesystem::defrag_file(directory_item* file, bool& moved) {
+    moved = false;
+    // A damaged chain stays where it is. The walk stops at a FAT_BAD_CLUSTER link, which leaves the last
+    // cluster of the chain without FAT_FILE_END.
+    std::vector<int32_t> old_chain = get_cluster_chain(file->start_cluster, fat1);
+    if (old_chain.empty() || fat1[old_chain.back()] != FAT_FILE_END) {
+        return fs_status::ok;
+    }
+
+    int32_t clusters = 0;
+    int32_t runs = count_runs(file->start_cluster, clusters);
+    if (runs <= 1) {
+        return fs_status::ok;
+    }
+
+    int32_t target = find_free_run(clusters);
+    if (target == -1) {
+        return fs_status::ok;
+    }
+
+    // Step 1: copy the data into the free run, the old chain stays untouched and referenced
+    std::fstream fs_file(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs_file) {
+        return fs_status::ok;
+    }
+
+    char buffer[CLUSTER_SIZE];
+    for (int32_t i = 0; i < clusters; ++i) {
+        // A cluster that fails its checksum is not moved, the file stays where it is
+        if (read_cluster(fs_file, old_chain[i], buffer) != fs_status::ok) {
+            return fs_status::ok;
+        }
+        write_cluster(fs_file, target + i, buffer);
+    }
+    if (!fs_file) {
+        return fs_status::ok;
+    }
+    fs_file.close();
+    sync_image();
+
+    // Step 2: commit the new chain while the old one is still allocated, a crash leaves only orphans for check()
+    for (int32_t i = 0; i < clusters; ++i) {
+        set_fat(target + i, (i == clusters - 1) ? FAT_FILE_END : target + i + 1);
+    }
+    free_cluster_count -= clusters;
+    invalidate_chain_index(file->start_cluster);
+    file->start_cluster = target;
+    fs_status status = save_fs();
+    if (status != fs_status::ok) {
+        // The last commit still has the old chain, the file goes back to it
+        invalidate_chain_index(target);
+        file->start_cluster = old_chain[0];
+        for (int32_t i = 0; i < clusters; ++i) {
+            release_cluster(target + i);
+        }
+        return status;
+    }
+    sync_image();
+
+    // Step 3: release the old clusters
+    for (int32_t cluster : old_chain) {
+        release_cluster(cluster);
+    }
+    moved = true;
+    return save_fs();
+}
+
+fs_status filesystem::defrag_step(int32_t budget_ms, int32_t& moved) {
+    // Moving chains rewrites start clusters and FAT entries that readers follow without the table lock
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms);
+    moved = 0;
+    if (root_folder.empty()) {
+        return fs_status::ok;
+    }
+
+    std::vector<std::pair<std::string, directory_item*>> files;
+    collect_files(&root_folder[0], "", files);
+    if (files.empty()) {
+        return fs_status::ok;
+    }
+
+    // The cursor keeps background steps moving through the tree instead of retrying the same files
+    for (size_t visited = 0; visited < files.size(); ++visited) {
+        if (budget_ms > 0 && std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+        defrag_cursor = (defrag_cursor + 1) % files.size();
+        bool file_moved = false;
+        fs_status status = defrag_file(files[defrag_cursor].second, file_moved);
+        if (file_moved) {
+            moved++;
+        }
+        if (status != fs_status::ok) {
+            return status;
+        }
+    }
+    return fs_status::ok;
+}
+
+fs_status filesystem::defrag(int32_t& moved) {
+    // Every move frees the old clusters, which can open up a run for a file that did not fit before
+    moved = 0;
+    int32_t pass = 0;
+    do {
+        fs_status status = defrag_step(0, pass);
+        moved += pass;
+        if (status != fs_status::ok) {
+            return status;
+        }
+    } while (pass > 0);
+    return fs_status::ok;
+}
+
+// The worker waits between steps so that operations get the volume, longer while nothing is left to move
+void filesystem::start_background_defrag(int32_t budget_ms) {
+    stop_background_defrag();
+    defrag_budget_ms = budget_ms;
+    defrag_worker = std::thread([this] {
+        std::unique_lock<std::mutex> guard(defrag_mutex);
+        int32_t moved = 0;
+        while (!defrag_wake.wait_for(guard, std::chrono::milliseconds(moved > 0 ? DEFRAG_PAUSE_MS : DEFRAG_IDLE_PAUSE_MS),
+                                     [this] { return defrag_budget_ms <= 0; })) {
+            guard.unlock();
+            // A failed commit leaves the volume as the last commit has it, the next step tries again
+            defrag_step(defrag_budget_ms, moved);
+            guard.lock();
+        }
+    });
+}
+
+void filesystem::stop_background_defrag() {
+    {
+        std::lock_guard<std::mutex> guard(defrag_mutex);
+        defrag_budget_ms = 0;
+    }
+    defrag_wake.notify_all();
+    if (defrag_worker.joinable()) {
+        defrag_worker.join();
+    }
+}
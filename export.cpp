@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include "filesystem.h"
+#include "timeline.h"
+
+// Runs shorter than this are not worth a system call each, they take the verified buffered path
+static const int32_t ZERO_COPY_MIN_RUN = 4;
+
+// Writes all of data to out_fd, at out_offset unless it is negative
+static bool write_all(int out_fd, const char* data, size_t length, off_t out_offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = out_offset >= 0 ? ::pwrite(out_fd, data + done, length - done, out_offset + done)
+                                    : ::write(out_fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Moves bytes from the image to out_fd inside the kernel and returns how many made it.
+// copy_file_range needs regular files on both ends and an explicit output offset, sendfile also writes
+// to pipes and sockets. Whatever is left after a failure is up to the buffered path.
+static size_t kernel_copy(int image_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length, bool& use_copy_range) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n;
+        if (use_copy_range && out_offset >= 0) {
+            loff_t in = in_offset + done;
+            loff_t out = out_offset + done;
+            n = ::copy_file_range(image_fd, &in, out_fd, &out, length - done, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                use_copy_range = false;
+                continue;
+            }
+        } else {
+            if (out_offset >= 0 && ::lseek(out_fd, out_offset + done, SEEK_SET) < 0) {
+                break;
+            }
+            off_t in = in_offset + done;
+            n = ::sendfile(out_fd, image_fd, &in, length - done);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Writes a plain file to out_fd run by run. Runs of contiguous clusters are copied by the kernel without
+// checksum verification, fragmented pieces and anything the kernel refused are read, verified and written.
+// A positioned output is written at file offsets, otherwise at its current position.
+fs_status filesystem::export_chain(directory_item* file, int out_fd, bool positioned) {
+    std::vector<int32_t> chain = get_cluster_chain(file->start_cluster, fat1);
+    int32_t clusters = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (static_cast<int32_t>(chain.size()) < clusters) {
+        return fs_status::io_error;
+    }
+
+    int image_fd = ::open(filesystem::file_name.c_str(), O_RDONLY);
+    if (image_fd < 0) {
+        return fs_status::io_error;
+    }
+
+    bool use_copy_range = positioned;
+    char buffer[CLUSTER_SIZE];
+    fs_status status = fs_status::ok;
+    for (int32_t first = 0; first < clusters && status == fs_status::ok;) {
+        int32_t run = 1;
+        while (first + run < clusters && chain[first + run] == chain[first + run - 1] + 1) {
+            run++;
+        }
+        timeline_span run_span("export run", "io");
+        run_span.note("clusters", run);
+        off_t file_offset = static_cast<off_t>(first) * CLUSTER_SIZE;
+        size_t length = static_cast<size_t>(std::min<off_t>(static_cast<off_t>(run) * CLUSTER_SIZE, file->size - file_offset));
+
+        size_t moved = 0;
+        if (run >= ZERO_COPY_MIN_RUN) {
+            off_t image_offset = desc.data_start_address + static_cast<off_t>(chain[first]) * CLUSTER_SIZE;
+            moved = kernel_copy(image_fd, image_offset, out_fd, positioned ? file_offset : -1, length, use_copy_range);
+            zero_copy_bytes += moved;
+        }
+
+        for (size_t position = moved; position < length && status == fs_status::ok;) {
+            int32_t cluster = chain[first + position / CLUSTER_SIZE];
+            size_t in_cluster = position % CLUSTER_SIZE;
+            size_t bytes = std::min(CLUSTER_SIZE - in_cluster, length - position);
+            off_t image_offset = desc.data_start_address + static_cast<off_t>(cluster) * CLUSTER_SIZE;
+            if (::pread(image_fd, buffer, CLUSTER_SIZE, image_offset) != CLUSTER_SIZE) {
+                status = fs_status::io_error;
+                break;
+            }
+            status = verify_cluster(cluster, buffer);
+            if (status == fs_status::ok &&
+                !write_all(out_fd, buffer + in_cluster, bytes, positioned ? file_offset + position : -1)) {
+                status = fs_status::io_error;
+            }
+            buffered_bytes += bytes;
+            position += bytes;
+        }
+        first += run;
+    }
+    ::close(image_fd);
+    return status;
+}
+
+fs_status filesystem::send_file(const std::string& path, int out_fd) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    std::string name;
+    directory_item* parent = get_parent_directory(path, working_directory(), name);
+    if (!parent) {
+        return fs_status::not_found;
+    }
+
+    std::shared_lock<std::shared_mutex> dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, name, true);
+    if (!file) {
+        return fs_status::not_found;
+    }
+    if (!(file->flags & (FILE_COMPRESSED | FILE_DEDUP))) {
+        return export_chain(file, out_fd, false);
+    }
+
+    // Compressed and deduplicated contents only exist after decoding
+    std::ifstream fs_file(filesystem::file_name, std::ios::binary);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    std::vector<char> block(io_buffers.buffer_size());
+    for (int32_t offset = 0; offset < file->size; offset += static_cast<int32_t>(block.size())) {
+        int32_t length = std::min(static_cast<int32_t>(block.size()), file->size - offset);
+        fs_status status = read_item_range(fs_file, file, offset, length, block.data());
+        if (status != fs_status::ok) {
+            return status;
+        }
+        if (!write_all(out_fd, block.data(), length, -1)) {
+            return fs_status::io_error;
+        }
+        buffered_bytes += length;
+    }
+    return fs_status::ok;
+}
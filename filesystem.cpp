@@ -1,51 +1,89 @@
+#include <cctype>
 #include <cstdint>
 #include <functional>
-#include <iostream>
 #include "filesystem.h"
 #include <algorithm>
 #include "path_utils.h"
+#include "crc32c.h"
+#include "async_io.h"
+#include "timeline.h"
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 const int32_t FAT_UNUSED = INT32_MAX -1;
 const int32_t FAT_FILE_END = INT32_MAX -2;
 const int32_t FAT_BAD_CLUSTER = INT32_MAX -3;
+const int32_t FAT_SNAPSHOT = INT32_MAX -4;
 
 const int32_t CLUSTER_SIZE = 4096;
- 
-filesystem::filesystem(const std::string &file): file_name(file), current_directory(nullptr), next_dir_id(0){
+
+const uint8_t FILE_COMPRESSED = 0x01;
+const uint8_t FILE_DEDUP = 0x02;
+const uint32_t COMPRESSED_MAGIC = 0x315A4C5A; // "ZLZ1"
+const uint32_t CHUNK_RAW = 0x80000000;
+// As save_directory() writes an entry: name, is_file, size, start_cluster, parent_id, id, flags, child count
+const int32_t TREE_ENTRY_SIZE = sizeof(directory_item::item_name) + sizeof(bool) + 4 * sizeof(int32_t) + sizeof(uint8_t) + sizeof(size_t);
+
+static const char SUPERBLOCK_SIGNATURE[8] = "ZOSFS";
+static const uint32_t SUPERBLOCK_VERSION = 1;
+static const int32_t SUPERBLOCK_SIZE = 4096;
+static const uint32_t SLOT_MAGIC = 0x544F4C53; // "SLOT"
+static const int32_t TREE_AREA_SIZE = 64 * 4096; // Smallest room for the directory tree in every slot
+static const int32_t TREE_ENTRIES_PER_CLUSTER = 2; // Room in the tree area grows with the volume by this much
+
+using shared_guard = std::shared_lock<std::shared_mutex>;
+using exclusive_guard = std::unique_lock<std::shared_mutex>;
+
+// Exclusive locks on two directories, always taken in id order so that two threads never wait on each other
+void filesystem::lock_directories(directory_item* a, directory_item* b, exclusive_guard& first, exclusive_guard& second){
+    if (a->id > b->id){
+        std::swap(a, b);
+    }
+    first = exclusive_guard(a->contents->lock);
+    if (b != a){
+        second = exclusive_guard(b->contents->lock);
+    }
+}
+
+filesystem::filesystem(const std::string &file): file_name(file), next_dir_id(0), io_buffers(16 * CLUSTER_SIZE, 64){
+}
+
+filesystem::~filesystem(){
+    stop_background_defrag();
+}
+
+fs_status filesystem::open(check_report* report){
     std::ifstream file_stream(file_name, std::ios::binary);
     if (!file_stream){
-        std::string command, arg;
-        while (true){
-            std::cout << "You need to format the file, enter format <size><unit(MB,KB)>" << std::endl;
-            std::cout << "> ";
-            std::cin >> command;
-
-            if (command == "exit"){
-                break;
-            }
+        return fs_status::not_formatted;
+    }
+    file_stream.close();
 
-            if (command == "format"){
-                std::cin >> arg;
-                if (format_fs(arg)) {
-                   break;
-                }
-            }
-        }
-    } else{
-        load_fs();
-        update_dir_id();
+    fs_status status = load_fs();
+    if (status != fs_status::ok){
+        return status;
     }
+    update_dir_id();
+
+    check_report local_report;
+    return check(report ? *report : local_report);
 }
 
 int32_t filesystem::parse_size(const std::string& size_str) {
+    if (size_str.size() < 2) {
+        return -1;
+    }
     int32_t base_size = 0;
-    std::string unit = size_str.substr(size_str.size() - 2);
+    size_t unit_length = std::isalpha(static_cast<unsigned char>(size_str[size_str.size() - 2])) ? 2 : 1;
+    std::string unit = size_str.substr(size_str.size() - unit_length);
     try {
-        base_size = std::stoi(size_str.substr(0, size_str.size() - 2)); // Get the numeric part
+        base_size = std::stoi(size_str.substr(0, size_str.size() - unit_length)); // Get the numeric part
     }
     catch (...) {
-        std::cerr << "Invalid size" << std::endl;
         return -1;
     }
     if (unit == "B") {
@@ -61,15 +99,15 @@ int32_t filesystem::parse_size(const std::string& size_str) {
         return base_size * 1024 * 1024 * 1024;
     }
 
-    std::cerr << "Invalid size unit." << std::endl;
     return -1;
 }
 
     // Format the disk
-bool filesystem::format_fs(const std::string &sizeStr){
+fs_status filesystem::format_fs(const std::string &sizeStr){
+    exclusive_guard namespace_guard(namespace_lock);
     const int32_t DISK_SIZE = parse_size(sizeStr);
-    if (DISK_SIZE == -1) {
-        return false;
+    if (DISK_SIZE <= 0) {
+        return fs_status::invalid_argument;
     }
 
     std::strcpy(desc.signature, "reichm");
@@ -79,31 +117,42 @@ bool filesystem::format_fs(const std::string &sizeStr){
     desc.cluster_count = desc.disk_size / desc.cluster_size;
     desc.fat_count = desc.cluster_count;
 
-    desc.fat1_start_address = sizeof(description);
-    desc.fat2_start_address = desc.fat1_start_address + desc.fat_count * sizeof(int32_t);
-    desc.data_start_address = desc.fat2_start_address + desc.fat_count * sizeof(int32_t);
-    desc.directory_start_address = desc.data_start_address;
-
-    fat1.resize(desc.fat_count, FAT_UNUSED);
-    fat2.resize(desc.fat_count, FAT_UNUSED);
-
-    // Create or overwrite the .dat file with the specified disk size
+    // Superblock, two metadata slots of equal size, then the data clusters
+    slot_size = compute_slot_layout();
+    slots_offset = SUPERBLOCK_SIZE;
+    desc.data_start_address = SUPERBLOCK_SIZE + 2 * slot_size;
+    desc.snapshot_cluster = -1;
+    active_slot = 1;
+    generation = 0;
+
+    fat1.assign(desc.fat_count, FAT_UNUSED);
+    fat2.assign(desc.fat_count, FAT_UNUSED);
+    refcounts.assign(desc.fat_count, 0);
+    fingerprints.assign(desc.fat_count, 0);
+    checksums.assign(desc.fat_count, 0);
+    fingerprint_index.clear();
+    chain_cache.clear();
+    chunk_cache.clear();
+    snapshots.clear();
+    snapshot_store.clear();
+    trim_pending.clear();
+    trim_retry.clear();
+    committed_fat.clear();
+
+    // Create or overwrite the .dat file so that it reaches the end of the last data cluster, the slots
+    // in front of the data make it larger than the disk size. It is sparse, the host only allocates
+    // what gets written.
     std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
 
     if (!out.is_open()){
-        std::cerr << "Cannot create filesystem\n";
-        return false;
-    }
-
-    const size_t chunk_size = 4096;
-    std::vector<char> buffer(chunk_size, 0);
-    size_t total_written = 0;
-
-    while (total_written < DISK_SIZE){
-        out.write(buffer.data(), std::min(chunk_size, DISK_SIZE - total_written));
-        total_written += chunk_size;
+        return fs_status::io_error;
     }
+    out.seekp(desc.data_start_address + static_cast<std::streamoff>(desc.cluster_count) * CLUSTER_SIZE - 1);
+    out.put('\0');
     out.close();
+    if (!out || !write_superblock()){
+        return fs_status::io_error;
+    }
 
     root_folder.clear();
     directory_item root;
@@ -113,40 +162,176 @@ bool filesystem::format_fs(const std::string &sizeStr){
     root.start_cluster = -1;
     root.parent_id = -1;
     root.id = next_dir_id++;
-    root_folder.push_back(root);
-    current_directory = &root_folder[0];
+    current_directory_id = root.id;
+    root_folder.push_back(std::move(root));
+    rebuild_directory_index();
+    rebuild_usage();
+    corrupted = false;
 
-    save_fs();
+    return save_fs();
+}
 
-    std::cout << "OK\n";
-    return true;
+// Places the tables and the tree of a metadata slot for desc.fat_count clusters, returns the slot size
+int32_t filesystem::compute_slot_layout(){
+    desc.fat1_start_address = sizeof(slot_header) + sizeof(description);
+    desc.fat2_start_address = desc.fat1_start_address + desc.fat_count * sizeof(int32_t);
+    desc.refcount_start_address = desc.fat2_start_address + desc.fat_count * sizeof(int32_t);
+    desc.fingerprint_start_address = desc.refcount_start_address + desc.fat_count * sizeof(uint32_t);
+    desc.checksum_start_address = desc.fingerprint_start_address + desc.fat_count * sizeof(uint64_t);
+    desc.directory_start_address = desc.checksum_start_address + desc.fat_count * sizeof(uint32_t);
+    return static_cast<int32_t>((desc.directory_start_address + sizeof(uint64_t) + tree_area_size(desc.cluster_count) + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE);
 }
 
-void filesystem::save_fs(){
-    std::ofstream file(file_name, std::ios::binary | std::ios::in | std::ios::out);
-    if (!file){
-        std::cerr << "Error opening file for saving.\n";
-        return;
-    }
+// Room for the serialized tree in a slot of a volume with cluster_count clusters
+int64_t filesystem::tree_area_size(int32_t cluster_count){
+    return std::max<int64_t>(TREE_AREA_SIZE, static_cast<int64_t>(cluster_count) * TREE_ENTRIES_PER_CLUSTER * TREE_ENTRY_SIZE);
+}
 
-    file.seekp(0);
-    file.write(reinterpret_cast<const char *>(&desc), sizeof(desc));
+// Entries the tree area of the current slots holds. Images formatted before the area grew with the
+// volume keep their smaller area.
+int64_t filesystem::tree_capacity(){
+    return (static_cast<int64_t>(slot_size) - desc.directory_start_address - static_cast<int64_t>(sizeof(uint64_t))) / TREE_ENTRY_SIZE;
+}
 
+// Takes room for count new entries before the tree changes, so that save_fs() never finds a tree it
+// cannot store. False when the tree area is full.
+bool filesystem::reserve_entries(int64_t count){
+    int64_t capacity = tree_capacity();
+    int64_t current = tree_entries;
+    do {
+        if (current + count > capacity){
+            return false;
+        }
+    } while (!tree_entries.compare_exchange_weak(current, current + count));
+    return true;
+}
 
-    file.seekp(desc.fat1_start_address);
-    file.write(reinterpret_cast<const char *>(fat1.data()), fat1.size() * sizeof(int32_t));
-    file.seekp(desc.fat2_start_address);
-    file.write(reinterpret_cast<const char *>(fat2.data()), fat2.size() * sizeof(int32_t));
+void filesystem::release_entries(int64_t count){
+    tree_entries -= count;
+}
 
-    file.seekp(desc.directory_start_address);
-    for (const auto &dir : root_folder){
-        save_directory(file, dir);
+// Points the superblock at the current slots, a single sector written in place
+bool filesystem::write_superblock(){
+    superblock super{};
+    std::memcpy(super.signature, SUPERBLOCK_SIGNATURE, sizeof(super.signature));
+    super.version = SUPERBLOCK_VERSION;
+    super.slot_size = slot_size;
+    super.slots_offset = slots_offset;
+
+    int fd = ::open(file_name.c_str(), O_RDWR);
+    if (fd < 0){
+        return false;
     }
+    bool written = ::pwrite(fd, &super, sizeof(super), 0) == static_cast<ssize_t>(sizeof(super)) && ::fdatasync(fd) == 0;
+    ::close(fd);
+    return written;
+}
 
-    file.close();
+fs_status filesystem::save_fs(){
+    timeline_span span("save_fs", "commit");
+    // Group commit: a snapshot taken after this caller's change covers it, whoever wrote it
+    uint64_t ticket = ++save_requests;
+    std::lock_guard<std::mutex> save_guard(save_mutex);
+    if (saved_requests >= ticket){
+        return fs_status::ok;
+    }
+
+    // The snapshot is taken while no metadata change is in flight, the disk write blocks nobody
+    std::ostringstream tree;
+    std::vector<int32_t> fat1_snapshot;
+    std::vector<uint32_t> refcount_snapshot;
+    std::vector<uint64_t> fingerprint_snapshot;
+    std::vector<uint32_t> checksum_snapshot;
+    std::string snapshot_bytes;
+    std::vector<int32_t> snapshot_clusters;
+    std::vector<int32_t> freed;
+    description desc_snapshot;
+    uint64_t covered;
+    {
+        timeline_span snapshot_span("save_fs snapshot", "commit");
+        exclusive_guard commit_guard(commit_lock);
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        covered = save_requests;
+        // Allocations leave room for the store, without it nothing of this commit is written
+        if (!store_snapshots(snapshot_bytes)) {
+            return fs_status::no_space;
+        }
+        freed.swap(trim_pending);
+        snapshot_clusters = snapshot_store;
+        desc_snapshot = desc;
+        for (const auto &dir : root_folder){
+            save_directory(tree, dir);
+        }
+        fat1_snapshot = fat1;
+        refcount_snapshot = refcounts;
+        fingerprint_snapshot = fingerprints;
+        checksum_snapshot = checksums;
+    }
+
+    // The commit goes to the inactive slot, the one holding the previous commit stays intact until this
+    // one is on disk. A torn write fails its checksum and load_fs() falls back to the other slot.
+    std::string tree_bytes = tree.str();
+    uint64_t tree_length = tree_bytes.size();
+    // Entries are reserved before they are added, this only catches a tree that was already too large
+    if (desc_snapshot.directory_start_address + sizeof(tree_length) + tree_length > static_cast<size_t>(slot_size)) {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        trim_pending.insert(trim_pending.end(), freed.begin(), freed.end());
+        return fs_status::no_space;
+    }
+    std::string slot(sizeof(slot_header), '\0');
+    slot.append(reinterpret_cast<const char *>(&desc_snapshot), sizeof(desc_snapshot));
+    slot.append(reinterpret_cast<const char *>(fat1_snapshot.data()), fat1_snapshot.size() * sizeof(int32_t));
+    slot.append(reinterpret_cast<const char *>(fat2.data()), fat2.size() * sizeof(int32_t));
+    slot.append(reinterpret_cast<const char *>(refcount_snapshot.data()), refcount_snapshot.size() * sizeof(uint32_t));
+    slot.append(reinterpret_cast<const char *>(fingerprint_snapshot.data()), fingerprint_snapshot.size() * sizeof(uint64_t));
+    slot.append(reinterpret_cast<const char *>(checksum_snapshot.data()), checksum_snapshot.size() * sizeof(uint32_t));
+    slot.append(reinterpret_cast<const char *>(&tree_length), sizeof(tree_length));
+    slot.append(tree_bytes);
+
+    slot_header header;
+    header.magic = SLOT_MAGIC;
+    header.generation = generation + 1;
+    header.length = slot.size() - sizeof(header);
+    header.checksum = crc32c(0, slot.data() + sizeof(header), header.length);
+    std::memcpy(slot.data(), &header, sizeof(header));
+
+    int fd = ::open(file_name.c_str(), O_RDWR);
+    if (fd < 0){
+        return fs_status::io_error;
+    }
+    bool written = true;
+    int target = 1 - active_slot;
+    {
+        timeline_span write_span("save_fs write", "commit");
+        write_span.note("bytes", static_cast<int64_t>(slot.size()));
+        // Clusters the new slot refers to go first
+        for (size_t i = 0; i < snapshot_clusters.size() && written; ++i) {
+            off_t offset = desc_snapshot.data_start_address + static_cast<off_t>(snapshot_clusters[i]) * CLUSTER_SIZE;
+            written = ::pwrite(fd, snapshot_bytes.data() + i * CLUSTER_SIZE, CLUSTER_SIZE, offset) == CLUSTER_SIZE;
+        }
+        off_t slot_offset = slots_offset + static_cast<off_t>(target) * slot_size;
+        written = written && ::pwrite(fd, slot.data(), slot.size(), slot_offset) == static_cast<ssize_t>(slot.size());
+    }
+    {
+        // One flush per commit: the next commit overwrites the other slot only once this one is durable
+        timeline_span sync_span("fdatasync", "commit");
+        written = written && ::fdatasync(fd) == 0;
+    }
+    ::close(fd);
+    if (!written){
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        trim_pending.insert(trim_pending.end(), freed.begin(), freed.end());
+        return fs_status::io_error;
+    }
+    active_slot = target;
+    generation = header.generation;
+    saved_requests = covered;
+    punch_freed(freed, fat1_snapshot);
+    committed_fat = std::move(fat1_snapshot);
+    return fs_status::ok;
 }
 
-void filesystem::save_directory(std::ofstream &outFile, const directory_item &dir){
+void filesystem::save_directory(std::ostream &outFile, const directory_item &dir){
 
     outFile.write(reinterpret_cast<const char *>(&dir.item_name), sizeof(dir.item_name));
     outFile.write(reinterpret_cast<const char *>(&dir.is_file), sizeof(dir.is_file));
@@ -154,54 +339,120 @@ void filesystem::save_directory(std::ofstream &outFile, const directory_item &di
     outFile.write(reinterpret_cast<const char *>(&dir.start_cluster), sizeof(dir.start_cluster));
     outFile.write(reinterpret_cast<const char *>(&dir.parent_id), sizeof(dir.parent_id));
     outFile.write(reinterpret_cast<const char *>(&dir.id), sizeof(dir.id));
+    outFile.write(reinterpret_cast<const char *>(&dir.flags), sizeof(dir.flags));
 
-    size_t childrenCount = dir.children.size();
+    size_t childrenCount = dir.contents ? dir.contents->children.size() : 0;
     outFile.write(reinterpret_cast<const char *>(&childrenCount), sizeof(size_t));
 
-    for (const auto &child : dir.children){
-        save_directory(outFile, child);
+    if (dir.contents){
+        for (const auto &child : dir.contents->children){
+            save_directory(outFile, child);
+        }
     }
 }
 
-void filesystem::load_fs(){
+fs_status filesystem::load_fs(){
 
     std::ifstream in(file_name, std::ios::binary);
     if (!in){
-        throw std::runtime_error("Error opening filesystem file");
+        return fs_status::io_error;
     }
 
-    in.read(reinterpret_cast<char *>(&desc), sizeof(desc));
+    superblock super{};
+    in.read(reinterpret_cast<char *>(&super), sizeof(super));
+    if (!in || std::memcmp(super.signature, SUPERBLOCK_SIGNATURE, sizeof(super.signature)) != 0 ||
+        super.version != SUPERBLOCK_VERSION || super.slot_size <= static_cast<int32_t>(sizeof(slot_header) + sizeof(description))) {
+        return fs_status::io_error;
+    }
 
-    fat1.resize(desc.fat_count);
-    in.seekg(desc.fat1_start_address);
-    in.read(reinterpret_cast<char *>(fat1.data()), fat1.size() * sizeof(int32_t));
-    fat2.resize(desc.fat_count);
-    in.seekg(desc.fat2_start_address);
-    in.read(reinterpret_cast<char *>(fat2.data()), fat2.size() * sizeof(int32_t));
+    // Images that never moved their slots keep them right behind the superblock
+    int64_t offset = super.slots_offset != 0 ? super.slots_offset : SUPERBLOCK_SIZE;
 
-    in.seekg(desc.directory_start_address);
+    // The newest slot that is complete and passes its checksum holds the last commit
+    std::string slot;
+    int chosen = -1;
+    uint64_t newest = 0;
+    for (int i = 0; i < 2; ++i) {
+        std::string candidate(super.slot_size, '\0');
+        in.clear();
+        in.seekg(offset + static_cast<std::streamoff>(i) * super.slot_size);
+        in.read(candidate.data(), candidate.size());
+        if (!in) {
+            continue;
+        }
+        slot_header header;
+        std::memcpy(&header, candidate.data(), sizeof(header));
+        if (header.magic != SLOT_MAGIC || header.length < sizeof(description) ||
+            header.length > candidate.size() - sizeof(header) ||
+            crc32c(0, candidate.data() + sizeof(header), header.length) != header.checksum) {
+            continue;
+        }
+        if (chosen < 0 || header.generation > newest) {
+            chosen = i;
+            newest = header.generation;
+            candidate.resize(sizeof(header) + header.length);
+            slot = std::move(candidate);
+        }
+    }
+    if (chosen < 0) {
+        return fs_status::io_error;
+    }
+    slot_size = super.slot_size;
+    slots_offset = offset;
+    active_slot = chosen;
+    generation = newest;
 
-    root_folder.clear();
+    std::memcpy(&desc, slot.data() + sizeof(slot_header), sizeof(desc));
+    uint64_t tree_length = 0;
+    size_t tables_end = static_cast<size_t>(desc.directory_start_address) + sizeof(tree_length);
+    if (desc.fat_count <= 0 || tables_end > slot.size()) {
+        return fs_status::io_error;
+    }
+    auto load_table = [&](auto& table, int32_t offset) {
+        table.resize(desc.fat_count);
+        std::memcpy(table.data(), slot.data() + offset, table.size() * sizeof(table[0]));
+    };
+    load_table(fat1, desc.fat1_start_address);
+    load_table(fat2, desc.fat2_start_address);
+    load_table(refcounts, desc.refcount_start_address);
+    load_table(fingerprints, desc.fingerprint_start_address);
+    load_table(checksums, desc.checksum_start_address);
+    rebuild_fingerprint_index();
+    chain_cache.clear();
+    chunk_cache.clear();
+    trim_pending.clear();
+    trim_retry.clear();
+    committed_fat = fat1; // The next commit goes to the other slot, the loaded one becomes the older slot
+
+    std::memcpy(&tree_length, slot.data() + desc.directory_start_address, sizeof(tree_length));
+    if (tree_length > slot.size() - tables_end) {
+        return fs_status::io_error;
+    }
+    std::istringstream tree(slot.substr(tables_end, tree_length));
 
-    size_t count = 0;
-    while (in && count < 1000){
+    root_folder.clear();
+    while (tree.peek() != std::char_traits<char>::eof()){
         directory_item dir;
-        load_dir(in, dir);
-        if (std::strlen(dir.item_name) == 0 || dir.id < 0 || dir.parent_id < -1){
+        load_dir(tree, dir);
+        if (!tree || std::strlen(dir.item_name) == 0 || dir.id < 0 || dir.parent_id < -1){
             break;
         }
-        root_folder.push_back(dir);
-        count++;
+        root_folder.push_back(std::move(dir));
     }
 
-    current_directory = &root_folder[0];
-    in.close();
-    if (!check()) {
-        std::cout << "Loaded filesystem with signature: " << desc.signature << std::endl;
-        std::cout << "Disk size: " << desc.disk_size << " bytes" << std::endl;
-        std::cout << "Cluster size: " << desc.cluster_size << " bytes" << std::endl;
-        std::cout << "Total clusters: " << desc.cluster_count << std::endl;
+    if (root_folder.empty()){
+        return fs_status::io_error;
     }
+    rebuild_directory_index();
+    in.clear();
+    fs_status status = load_snapshots(in);
+    if (status != fs_status::ok) {
+        return status;
+    }
+    rebuild_usage();
+    current_directory_id = root_folder[0].id;
+    in.close();
+    return fs_status::ok;
 }
 
 void filesystem::update_dir_id(){
@@ -212,8 +463,10 @@ void filesystem::update_dir_id(){
             next_dir_id = dir.id;
         }
 
-        for (const auto &child : dir.children){
-            findMaxId(child);
+        if (dir.contents){
+            for (const auto &child : dir.contents->children){
+                findMaxId(child);
+            }
         }
     };
 
@@ -224,20 +477,31 @@ void filesystem::update_dir_id(){
     next_dir_id++;
 }
 
-void filesystem::load_dir(std::ifstream &in, directory_item &dir){
+void filesystem::load_dir(std::istream &in, directory_item &dir){
     in.read(reinterpret_cast<char *>(&dir.item_name), sizeof(dir.item_name));
     in.read(reinterpret_cast<char *>(&dir.is_file), sizeof(dir.is_file));
+    if (dir.is_file){
+        dir.contents.reset();
+    }
     in.read(reinterpret_cast<char *>(&dir.size), sizeof(dir.size));
     in.read(reinterpret_cast<char *>(&dir.start_cluster), sizeof(dir.start_cluster));
     in.read(reinterpret_cast<char *>(&dir.parent_id), sizeof(dir.parent_id));
     in.read(reinterpret_cast<char *>(&dir.id), sizeof(dir.id));
+    in.read(reinterpret_cast<char *>(&dir.flags), sizeof(dir.flags));
 
     size_t childrenCount;
     in.read(reinterpret_cast<char *>(&childrenCount), sizeof(size_t));
+    if (!dir.contents){
+        // A file has no children, a tree that says otherwise is damaged
+        if (childrenCount != 0){
+            in.setstate(std::ios::failbit);
+        }
+        return;
+    }
 
-    dir.children.resize(childrenCount);
+    dir.contents->children.resize(childrenCount);
 
-    for (auto &child : dir.children){
+    for (auto &child : dir.contents->children){
         load_dir(in, child);
     }
 }
@@ -252,7 +516,10 @@ std::string filesystem::current_file_path(directory_item* dir){
 
     while (current->parent_id != -1) {
         pathParts.push_back(current->item_name);
-        current = find_dir_by_given_id(current->parent_id, &root_folder[0]);
+        current = directory_by_id(current->parent_id);
+        if (!current) {
+            break;
+        }
     }
 
     std::reverse(pathParts.begin(), pathParts.end());
@@ -275,98 +542,147 @@ std::string filesystem::trim_spaces(const std::string &input){
     return result;
 }
 
-directory_item *filesystem::find_dir_by_given_id(int32_t id, directory_item *dir){
-    if (dir->id == id){
-        return dir;
-    }
+void filesystem::rebuild_directory_index(){
+    std::unique_lock<std::shared_mutex> index_guard(index_mutex);
+    directory_index.clear();
 
-    for (auto &child : dir->children){
-        directory_item *foundDir = find_dir_by_given_id(id, &child);
-        if (foundDir){
-            return foundDir;
+    std::function<void(directory_item &)> add = [&](directory_item &dir){
+        directory_index[dir.id] = &dir;
+        for (auto &child : dir.contents->children){
+            if (!child.is_file){
+                add(child);
+            }
         }
+    };
+    for (auto &dir : root_folder){
+        add(dir);
     }
+}
 
-    return nullptr;
+directory_item *filesystem::directory_by_id(int32_t id){
+    std::shared_lock<std::shared_mutex> index_guard(index_mutex);
+    auto it = directory_index.find(id);
+    return it == directory_index.end() ? nullptr : it->second;
 }
 
-bool filesystem::directory_exists(directory_item* current_dir, const std::string& dir_name) {
-    for (const auto& child : current_dir->children) {
-        if (std::string(child.item_name) == dir_name) {
-            return true;
+directory_item *filesystem::working_directory(){
+    // A removed working directory falls back to the root
+    directory_item *dir = directory_by_id(current_directory_id);
+    return dir ? dir : &root_folder[0];
+}
+
+// Entry with the given name, the caller holds the directory's lock
+directory_item* filesystem::find_child(directory_item* dir, const std::string& name, bool files_only) {
+    for (auto& child : dir->contents->children) {
+        if (std::string(child.item_name) == name) {
+            return (files_only && !child.is_file) ? nullptr : &child;
         }
     }
-    return false;
+    return nullptr;
 }
 
-bool filesystem::make_directory(directory_item* current_dir, const std::string& path) {
+// Appends a counter to a name taken in the directory, "a.txt" becomes "a1.txt", "a2.txt", ...
+std::string filesystem::unique_name(directory_item* dir, const std::string& name) {
+    std::string final_name = name;
+    int counter = 1;
+    size_t dot_pos = name.find_last_of('.');
+    std::string name_part = (dot_pos != std::string::npos) ? name.substr(0, dot_pos) : name;
+    std::string ext_part = (dot_pos != std::string::npos) ? name.substr(dot_pos) : "";
+
+    while (find_child(dir, final_name, false)) {
+        final_name = name_part + std::to_string(counter) + ext_part;
+        counter++;
+    }
+    return final_name;
+}
+
+fs_status filesystem::make_directory(const std::string& path) {
+    shared_guard namespace_guard(namespace_lock);
     std::string new_dir_name;
-    directory_item* parent = get_parent_directory(path, current_dir, new_dir_name);
+    directory_item* parent = get_parent_directory(path, working_directory(), new_dir_name);
 
     if (!parent) {
-        std::cerr << "Parent directory does not exist\n";
-        return false;
+        return fs_status::path_not_found;
     }
 
-    if (new_dir_name.length() >= 12) {
-        std::cerr << "Directory name too long (max 11 characters)\n";
-        return false;
+    if (new_dir_name.empty()) {
+        return fs_status::invalid_argument;
     }
 
-    if (directory_exists(parent, new_dir_name)) {
-        std::cerr << "Directory already exists\n";
-        return false;
+    if (new_dir_name.length() >= 12) {
+        return fs_status::name_too_long;
     }
 
-    directory_item new_dir(new_dir_name, false);
-    new_dir.parent_id = parent->id;
-    new_dir.id = next_dir_id++;
-    new_dir.start_cluster = -1;
-
-    parent->children.push_back(new_dir);
-    save_fs();
-    return true;
-}
+    {
+        shared_guard commit_guard(commit_lock);
+        exclusive_guard dir_guard(parent->contents->lock);
+        if (find_child(parent, new_dir_name, false)) {
+            return fs_status::already_exists;
+        }
+        if (!reserve_entries(1)) {
+            return fs_status::no_space;
+        }
 
-void filesystem::list_directory(directory_item* dir) {
-    std::string path = current_file_path(dir);
+        directory_item new_dir(new_dir_name, false);
+        new_dir.parent_id = parent->id;
+        new_dir.id = next_dir_id++;
+        new_dir.start_cluster = -1;
 
-    if (dir->children.empty()) {
-        std::cout << "Directory is empty\n";
-        return;
+        directory_item& added = parent->contents->children.emplace_back(std::move(new_dir));
+        std::unique_lock<std::shared_mutex> index_guard(index_mutex);
+        directory_index[added.id] = &added;
     }
+    return save_fs();
+}
 
-    for (const auto& item : dir->children) {
-        std::string type = item.is_file ? "F" : "D";
-        std::cout << type << " " << item.item_name;
-        if (item.is_file) {
-            std::cout << " (" << item.size << " bytes)";
-        }
-        std::cout << "\n";
-    }
+fs_status filesystem::list_directory(const std::string& path, std::vector<entry_info>& entries) {
+    shared_guard namespace_guard(namespace_lock);
+    directory_item* dir = path.empty() ? working_directory() : find_directory_by_path(working_directory(), path);
+    if (!dir) {
+        return fs_status::not_found;
+    }
+
+    shared_guard dir_guard(dir->contents->lock);
+    entries.clear();
+    entries.reserve(dir->contents->children.size());
+    for (const auto& item : dir->contents->children) {
+        entry_info info;
+        info.name = item.item_name;
+        info.is_file = item.is_file;
+        info.size = item.size;
+        info.flags = item.flags;
+        entries.push_back(std::move(info));
+    }
+    return fs_status::ok;
 }
 
-directory_item* filesystem::change_directory(directory_item* current_dir, const std::string& path) {
-    directory_item* new_dir = find_directory_by_path(current_dir, path);
+fs_status filesystem::change_directory(const std::string& path) {
+    shared_guard namespace_guard(namespace_lock);
+    directory_item* new_dir = find_directory_by_path(working_directory(), path);
     if (!new_dir) {
-        std::cerr << "Directory not found\n";
-        return current_dir;
+        return fs_status::not_found;
     }
-    return new_dir;
+    current_directory_id = new_dir->id;
+    return fs_status::ok;
 }
 
+// Each directory on the way is locked only while its entries are searched, nodes are
+// never freed under a shared namespace_lock
 directory_item* filesystem::find_directory_by_path(directory_item* start_dir, const std::string& path) {
     if (path.empty() || path == "/") {
         return &root_folder[0];
     }
 
     auto parts = split_path(path);
-    directory_item* current = start_dir;
+    directory_item* current = path[0] == '/' ? &root_folder[0] : start_dir;
 
     for (const auto& part : parts) {
         if (part == "..") {
             if (current->parent_id != -1) {
-                current = find_dir_by_given_id(current->parent_id, &root_folder[0]);
+                current = directory_by_id(current->parent_id);
+                if (!current) {
+                    return nullptr;
+                }
             }
             continue;
         }
@@ -374,129 +690,143 @@ directory_item* filesystem::find_directory_by_path(directory_item* start_dir, co
             continue;
         }
 
-        bool found = false;
-        for (auto& child : current->children) {
-            if (!child.is_file && std::string(child.item_name) == part) {
-                current = &child;
-                found = true;
-                break;
-            }
-        }
-        if (!found) {
+        shared_guard dir_guard(current->contents->lock);
+        directory_item* child = find_child(current, part, false);
+        if (!child || child->is_file) {
             return nullptr;
         }
+        current = child;
     }
     return current;
 }
 
 directory_item* filesystem::get_parent_directory(const std::string& path, directory_item* current_dir, std::string& child_name) {
+    timeline_span span("resolve path", "path");
     auto parts = split_path(path);
     if (parts.empty()) {
-        return current_dir;
+        return !path.empty() && path[0] == '/' ? &root_folder[0] : current_dir;
     }
 
     child_name = parts.back();
     parts.pop_back();
 
     if (parts.empty()) {
-        return current_dir;
+        return path[0] == '/' ? &root_folder[0] : current_dir;
     }
 
-    directory_item* parent = find_directory_by_path(current_dir, join_path(parts));
+    std::string parent_path = join_path(parts);
+    directory_item* parent = find_directory_by_path(current_dir, path[0] == '/' ? parent_path : parent_path.substr(1));
     return parent;
 }
 
-bool filesystem::remove_directory(directory_item* current_dir, const std::string& path) {
+fs_status filesystem::remove_directory(const std::string& path) {
+    // Nobody else may be inside the tree while a directory node is freed
+    exclusive_guard namespace_guard(namespace_lock);
     std::string dir_name;
-    directory_item* parent = get_parent_directory(path, current_dir, dir_name);
+    directory_item* parent = get_parent_directory(path, working_directory(), dir_name);
 
     if (!parent) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
     }
 
     // Find the directory to remove
-    auto it = std::find_if(parent->children.begin(), parent->children.end(),
+    auto it = std::find_if(parent->contents->children.begin(), parent->contents->children.end(),
         [&dir_name](const directory_item& item) {
             return std::string(item.item_name) == dir_name;
         });
 
-    if (it == parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+    if (it == parent->contents->children.end()) {
+        return fs_status::not_found;
     }
 
     if (it->is_file) {
-        std::cerr << "Not a directory\n";
-        return false;
+        return fs_status::not_a_directory;
     }
 
     // Check if directory is empty
-    if (!it->children.empty()) {
-        std::cerr << "Directory is not empty\n";
-        return false;
+    if (!it->contents->children.empty()) {
+        return fs_status::not_empty;
     }
 
     // Remove the directory
-    parent->children.erase(it);
-    save_fs();
-    std::cout << "Ok\n";
-    return true;
+    {
+        std::unique_lock<std::shared_mutex> index_guard(index_mutex);
+        directory_index.erase(it->id);
+    }
+    parent->contents->children.erase(it);
+    release_entries(1);
+    return save_fs();
 }
 
-bool filesystem::remove_file(directory_item* current_dir, const std::string& path) {
+fs_status filesystem::remove_file(const std::string& path) {
+    shared_guard namespace_guard(namespace_lock);
     std::string dir_name;
-    directory_item* parent = get_parent_directory(path, current_dir, dir_name);
+    directory_item* parent = get_parent_directory(path, working_directory(), dir_name);
 
     if (!parent) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
     }
 
-    // Find the directory to remove
-    auto it = std::find_if(parent->children.begin(), parent->children.end(),
-        [&dir_name](const directory_item& item) {
-            return std::string(item.item_name) == dir_name;
-        });
+    {
+        shared_guard commit_guard(commit_lock);
+        exclusive_guard dir_guard(parent->contents->lock);
 
-    if (it == parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+        // Find the directory to remove
+        auto it = std::find_if(parent->contents->children.begin(), parent->contents->children.end(),
+            [&dir_name](const directory_item& item) {
+                return std::string(item.item_name) == dir_name;
+            });
+
+        if (it == parent->contents->children.end()) {
+            return fs_status::not_found;
+        }
+
+        // Check if directory is empty
+        if (!it->is_file) {
+            return fs_status::not_a_file;
+        }
+        remove_entry(parent, it);
     }
+    return save_fs();
+}
 
-    // Check if directory is empty
-    if (!it->is_file) {
-        std::cerr << "Not a file\n";
-        return false;
+// Frees a file's clusters and drops its entry, the caller holds commit_lock shared and the parent's lock
+void filesystem::remove_entry(directory_item* parent, std::list<directory_item>::iterator it) {
+    // Shared data clusters of a deduplicated file are only freed with their last reference
+    if (it->flags & FILE_DEDUP) {
+        std::vector<int32_t> blocks;
+        if (read_block_map(&*it, blocks) == fs_status::ok) {
+            for (int32_t block : blocks) {
+                release_block(block);
+            }
+        }
     }
 
+    invalidate_chain_index(it->start_cluster);
+    std::vector<int32_t> chain;
     int cluster = it->start_cluster;
     while (cluster != FAT_FILE_END && cluster >= 0 && cluster < fat1.size())
     {
-        int next_cluster = fat1[cluster];
-        fat1[cluster] = FAT_UNUSED; // Mark the cluster as unused
-        cluster = next_cluster;
+        chain.push_back(cluster);
+        cluster = fat1[cluster];
     }
-
-    // Remove the directory
-    parent->children.erase(it);
-    save_fs();
-    std::cout << "Ok\n";
-    return true;
+    free_clusters(chain);
+    add_usage(parent, file_usage(*it, static_cast<int64_t>(chain.size())), -1);
+    parent->contents->children.erase(it);
+    release_entries(1);
 }
 
-std::string filesystem::print_working_directory(directory_item* dir) {
-    std::string path = current_file_path(dir);
+std::string filesystem::print_working_directory() {
+    std::string path = current_file_path(working_directory());
     return path.empty() ? "/" : path;
 }
 
-bool filesystem::copy_file_to_fs(const std::string& source_path, directory_item* current_dir,
-    const std::string& dest_path, std::vector<int32_t>& fat, int32_t& cluster_count) {
+fs_status filesystem::copy_file_to_fs(const std::string& source_path, directory_item* current_dir,
+    const std::string& dest_path, uint8_t flags, import_report* report) {
 
     std::ifstream source(source_path, std::ios::binary | std::ios::ate);
     if (!source) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
     }
 
     std::streamsize file_size = source.tellg();
@@ -511,283 +841,769 @@ bool filesystem::copy_file_to_fs(const std::string& source_path, directory_item*
     directory_item* parent = get_parent_directory(dest_path, current_dir, file_name);
 
     if (!parent) {
-        std::cerr << "Path not found\n";
-        return false;
+        return fs_status::path_not_found;
     }
 
-    // Check for duplicate filename and add unique identifier if needed
-    int counter = 1;
-    std::string base_name = file_name;
-    size_t dot_pos = base_name.find_last_of('.');
-    std::string name_part = (dot_pos != std::string::npos) ? base_name.substr(0, dot_pos) : base_name;
-    std::string ext_part = (dot_pos != std::string::npos) ? base_name.substr(dot_pos) : "";
-
-    while (std::any_of(parent->children.begin(), parent->children.end(),
-           [&file_name](const directory_item& item) {
-               return std::string(item.item_name) == file_name;
-           })) {
-        file_name = name_part + std::to_string(counter) + ext_part;
-        counter++;
+    // Compressed files are stored as one stream of independently compressed chunks,
+    // deduplicated files as a map of shared data clusters
+    bool use_stream = flags & (FILE_COMPRESSED | FILE_DEDUP);
+    std::vector<char> stream;
+    if (flags & FILE_COMPRESSED) {
+        timeline_span compress_span("compress", "data");
+        if (!build_compressed_stream(source, file_size, stream)) {
+            return fs_status::io_error;
+        }
+    }
+    if (flags & FILE_DEDUP) {
+        timeline_span dedup_span("dedup map", "data");
+        fs_status status = build_dedup_map(source, file_size, stream, report);
+        if (status != fs_status::ok) {
+            return status;
+        }
     }
+    std::streamsize stored_size = use_stream ? static_cast<std::streamsize>(stream.size()) : file_size;
 
-    int32_t clusters_needed = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int32_t clusters_needed = (stored_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
     std::vector<int32_t> allocated_clusters;
 
-    for (int32_t i = 0; i < clusters_needed; ++i) {
-        int free_cluster = allocate_cluster();
-        if (free_cluster == -1){
-            std::cerr << "Not enough space\n";
-            return false;
+    // The data goes to clusters no entry references yet, the directory is only locked to add the entry.
+    // The stored size is final here, so the whole chain is reserved at once and concurrent imports do not interleave.
+    bool reserved = reserve_entries(1);
+    if (!reserved || !allocate_extent(clusters_needed, -1, allocated_clusters)) {
+        if (reserved) {
+            release_entries(1);
+        }
+        if (flags & FILE_DEDUP) {
+            release_dedup_map(stream);
         }
-        allocated_clusters.push_back(free_cluster);
+        return fs_status::no_space;
     }
 
-    std::ofstream outFile(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
-    for (int i = 0; i < clusters_needed; ++i){
-        char buffer[CLUSTER_SIZE];
-        source.read(buffer, CLUSTER_SIZE);
-        outFile.seekp(desc.data_start_address + allocated_clusters[i] * CLUSTER_SIZE);
-        outFile.write(buffer, CLUSTER_SIZE);
-
-        if (i < clusters_needed - 1){
-            fat[allocated_clusters[i]] = allocated_clusters[i + 1];
-        }
-        else
-        {
-            fat[allocated_clusters[i]] = FAT_FILE_END;
+    source.close();
+    int image_fd = ::open(filesystem::file_name.c_str(), O_RDWR);
+    int source_fd = use_stream ? -1 : ::open(source_path.c_str(), O_RDONLY);
+    fs_status status = image_fd < 0 || (!use_stream && source_fd < 0) ? fs_status::io_error : fs_status::ok;
+    if (status == fs_status::ok) {
+        copy_side from{source_fd, nullptr, stored_size, use_stream ? stream.data() : nullptr};
+        copy_side to{image_fd, &allocated_clusters};
+        status = copy_clusters(from, to, clusters_needed);
+    }
+    if (source_fd >= 0) {
+        ::close(source_fd);
+    }
+    if (image_fd >= 0) {
+        ::close(image_fd);
+    }
+    if (status != fs_status::ok) {
+        free_clusters(allocated_clusters);
+        release_entries(1);
+        if (flags & FILE_DEDUP) {
+            release_dedup_map(stream);
         }
+        return status;
     }
+    link_chain(allocated_clusters);
 
-    directory_item new_file;
-    std::strncpy(new_file.item_name, file_name.c_str(), sizeof(new_file.item_name) - 1);
-    new_file.is_file = true;
-    new_file.start_cluster = allocated_clusters[0];
+    directory_item new_file("", true);
+    new_file.start_cluster = allocated_clusters.empty() ? -1 : allocated_clusters[0];
     new_file.id = next_dir_id++;
     new_file.size = file_size;
+    new_file.flags = flags;
+    new_file.parent_id = parent->id;
 
+    {
+        // Check for duplicate filename and add unique identifier if needed
+        shared_guard commit_guard(commit_lock);
+        exclusive_guard dir_guard(parent->contents->lock);
+        file_name = unique_name(parent, file_name);
+        std::strncpy(new_file.item_name, file_name.c_str(), sizeof(new_file.item_name) - 1);
+        add_usage(parent, file_usage(new_file, clusters_needed));
+        parent->contents->children.push_back(std::move(new_file));
+    }
 
-    parent->children.push_back(new_file);
+    return save_fs();
 
-    save_fs();
+}
 
-    std::cout << "OK\n";
-    return true;
+fs_status filesystem::read_cluster(std::istream& in, int32_t cluster, char* buffer) {
+    in.seekg(desc.data_start_address + static_cast<std::streamoff>(cluster) * CLUSTER_SIZE);
+    in.read(buffer, CLUSTER_SIZE);
+    if (!in) {
+        in.clear();
+        return fs_status::io_error;
+    }
+
+    return verify_cluster(cluster, buffer);
+}
+
+fs_status filesystem::verify_cluster(int32_t cluster, const char* buffer) {
+    if (verify_checksums && crc32c(0, buffer, CLUSTER_SIZE) != checksums[cluster]) {
+        bad_cluster = cluster;
+        return fs_status::checksum_error;
+    }
+    return fs_status::ok;
+}
 
+void filesystem::write_cluster(std::ostream& out, int32_t cluster, const char* buffer) {
+    out.seekp(desc.data_start_address + static_cast<std::streamoff>(cluster) * CLUSTER_SIZE);
+    out.write(buffer, CLUSTER_SIZE);
+    record_checksum(cluster, buffer);
 }
 
-int filesystem::allocate_cluster() {
-    for (size_t i = 1; i < fat1.size(); ++i){
+void filesystem::record_checksum(int32_t cluster, const char* buffer) {
+    uint32_t checksum = crc32c(0, buffer, CLUSTER_SIZE);
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    checksums[cluster] = checksum;
+}
+
+// Streams count clusters from one side to the other with up to io_depth requests in flight.
+// Runs of clusters that are contiguous on both sides move as one request of up to a pool buffer.
+// Every run is read into a free buffer, its completion verifies the checksums and queues the write,
+// the write's completion returns the buffer. Image clusters are verified on read and checksummed on write.
+fs_status filesystem::copy_clusters(const copy_side& from, const copy_side& to, int32_t count) {
+    timeline_span span("copy_clusters", "io");
+    span.note("clusters", count);
+    const int32_t run_limit = static_cast<int32_t>(io_buffers.buffer_size() / CLUSTER_SIZE);
+    auto contiguous = [](const copy_side& side, int32_t i) {
+        return !side.clusters || (*side.clusters)[i] == (*side.clusters)[i - 1] + 1;
+    };
+    auto length_of = [](const copy_side& side, int32_t first, int32_t clusters) -> size_t {
+        int64_t length = static_cast<int64_t>(clusters) * CLUSTER_SIZE;
+        if (side.clusters) {
+            return static_cast<size_t>(length);
+        }
+        return static_cast<size_t>(std::min<int64_t>(length, side.size - static_cast<int64_t>(first) * CLUSTER_SIZE));
+    };
+    auto offset_of = [this](const copy_side& side, int32_t i) -> off_t {
+        if (side.clusters) {
+            return desc.data_start_address + static_cast<off_t>((*side.clusters)[i]) * CLUSTER_SIZE;
+        }
+        return static_cast<off_t>(i) * CLUSTER_SIZE;
+    };
+
+    io_engine engine(io_depth, io_uring_enabled);
+    size_t wanted = std::min<size_t>(engine.depth(), (std::max(count, 1) + run_limit - 1) / run_limit);
+    std::vector<char*> buffers = io_buffers.acquire(wanted);
+    std::vector<char*> free_buffers = buffers;
+
+    fs_status result = fs_status::ok;
+    // A run's span reaches from its read to the completion of its write
+    auto write_stage = [&](int32_t first, int32_t clusters, char* buffer, int64_t run_start) {
+        if (to.clusters) {
+            for (int32_t i = 0; i < clusters; ++i) {
+                record_checksum((*to.clusters)[first + i], buffer + static_cast<size_t>(i) * CLUSTER_SIZE);
+            }
+        }
+        size_t length = length_of(to, first, clusters);
+        engine.write(to.fd, buffer, length, offset_of(to, first), [&, buffer, length, clusters, run_start](ssize_t written) {
+            if (written != static_cast<ssize_t>(length) && result == fs_status::ok) {
+                result = fs_status::io_error;
+            }
+            if (run_start >= 0) {
+                timeline_record("run", "io", run_start, timeline_now(), "clusters", clusters);
+            }
+            free_buffers.push_back(buffer);
+        });
+    };
+
+    for (int32_t first = 0; first < count && result == fs_status::ok;) {
+        int32_t clusters = 1;
+        while (first + clusters < count && clusters < run_limit &&
+               contiguous(from, first + clusters) && contiguous(to, first + clusters)) {
+            clusters++;
+        }
+
+        while (free_buffers.empty()) {
+            engine.poll();
+        }
+        char* buffer = free_buffers.back();
+        free_buffers.pop_back();
+        int64_t run_start = timeline_enabled() ? timeline_now() : -1;
+        size_t length = length_of(from, first, clusters);
+        size_t padded = static_cast<size_t>(clusters) * CLUSTER_SIZE;
+        if (length < padded) {
+            std::memset(buffer + length, 0, padded - length);
+        }
+
+        if (from.memory) {
+            std::memcpy(buffer, from.memory + static_cast<size_t>(first) * CLUSTER_SIZE, length);
+            write_stage(first, clusters, buffer, run_start);
+        } else {
+            engine.read(from.fd, buffer, length, offset_of(from, first), [&, first, clusters, buffer, length, run_start](ssize_t got) {
+                fs_status status = got == static_cast<ssize_t>(length) ? fs_status::ok : fs_status::io_error;
+                for (int32_t i = 0; i < clusters && status == fs_status::ok && from.clusters; ++i) {
+                    status = verify_cluster((*from.clusters)[first + i], buffer + static_cast<size_t>(i) * CLUSTER_SIZE);
+                }
+                if (status != fs_status::ok || result != fs_status::ok) {
+                    if (result == fs_status::ok) {
+                        result = status;
+                    }
+                    free_buffers.push_back(buffer);
+                    return;
+                }
+                write_stage(first, clusters, buffer, run_start);
+            });
+        }
+        first += clusters;
+    }
+    engine.wait();
+    io_buffers.release(buffers);
+    return result;
+}
+
+int filesystem::allocate_cluster_near(int32_t hint) {
+    // Look right behind the hint first so that growing chains stay contiguous, then wrap around
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    if (free_cluster_count - snapshot_headroom(1) < 1) {
+        return -1;
+    }
+    int32_t count = static_cast<int32_t>(fat1.size());
+    int32_t begin = (hint >= 1 && hint < count) ? hint + 1 : 1;
+    for (int32_t i = begin; i < count; ++i){
+        if (fat1[i] == FAT_UNUSED){
+            set_fat(i, FAT_FILE_END);
+            free_cluster_count--;
+            return i;
+        }
+    }
+    for (int32_t i = 1; i < begin && i < count; ++i){
         if (fat1[i] == FAT_UNUSED){
-            fat1[i] = FAT_FILE_END;
+            set_fat(i, FAT_FILE_END);
+            free_cluster_count--;
             return i;
         }
     }
-    return -1; // No free cluster found
+    return -1;
 }
 
+// Reserves all clusters of a write in one step, once its final size is known. The run right behind the
+// hint comes first so that a growing chain stays contiguous, then the best fitting free run. Only when no
+// run is long enough is the data spread over the largest runs. Nothing is taken if the space does not suffice.
+bool filesystem::allocate_extent(int32_t count, int32_t hint, std::vector<int32_t>& clusters) {
+    timeline_span span("allocate_extent", "alloc");
+    span.note("clusters", count);
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    if (count <= 0) {
+        return true;
+    }
+    if (free_cluster_count - snapshot_headroom(count) < count) {
+        return false;
+    }
 
+    int32_t size = static_cast<int32_t>(fat1.size());
+    int32_t start = -1;
+    if (hint >= 1 && hint < size - count) {
+        start = hint + 1;
+        for (int32_t i = hint + 1; i <= hint + count; ++i) {
+            if (fat1[i] != FAT_UNUSED) {
+                start = -1;
+                break;
+            }
+        }
+    }
+    if (start < 0) {
+        start = find_free_run(count);
+    }
 
-bool filesystem::copy_file_from_fs(directory_item* current_dir, const std::string& source_path,
-                                   const std::string& dest_path, const std::vector<int32_t>& fat) {
+    std::vector<std::pair<int32_t, int32_t>> runs;
+    if (start >= 0) {
+        runs.emplace_back(start, count);
+    }
+    else {
+        for (int32_t i = 1; i < size;) {
+            if (fat1[i] != FAT_UNUSED) {
+                i++;
+                continue;
+            }
+            int32_t run_start = i;
+            while (i < size && fat1[i] == FAT_UNUSED) {
+                i++;
+            }
+            runs.emplace_back(run_start, i - run_start);
+        }
+        std::stable_sort(runs.begin(), runs.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    }
+
+    size_t first = clusters.size();
+    int32_t taken = 0;
+    for (const auto& [run_start, run_length] : runs) {
+        for (int32_t i = run_start; i < run_start + run_length && taken < count; ++i, ++taken) {
+            set_fat(i, FAT_FILE_END);
+            clusters.push_back(i);
+        }
+    }
+    free_cluster_count -= taken;
+    if (taken < count) {
+        for (size_t i = first; i < clusters.size(); ++i) {
+            release_cluster(clusters[i]);
+        }
+        clusters.resize(first);
+        return false;
+    }
+    return true;
+}
+
+// Links reserved clusters behind the file's chain, the caller holds the file's directory lock
+void filesystem::extend_chain(directory_item* file, const std::vector<int32_t>& clusters) {
+    if (clusters.empty()) {
+        return;
+    }
+    if (file->start_cluster < 0) {
+        file->start_cluster = clusters[0];
+        std::lock_guard<std::mutex> cache_guard(cache_mutex);
+        chain_cache[file->start_cluster] = chain_index();
+    }
+    chain_index& grown = get_chain_index(file->start_cluster);
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    for (int32_t cluster : clusters) {
+        if (grown.tail >= 0) {
+            set_fat(grown.tail, cluster);
+        }
+        grown.extend(cluster);
+    }
+}
+
+// Links the clusters in the given order into one chain
+void filesystem::link_chain(const std::vector<int32_t>& clusters) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    for (size_t i = 0; i < clusters.size(); ++i){
+        set_fat(clusters[i], (i == clusters.size() - 1) ? FAT_FILE_END : clusters[i + 1]);
+    }
+}
+
+void filesystem::free_clusters(const std::vector<int32_t>& clusters) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    for (int32_t cluster : clusters){
+        release_cluster(cluster);
+    }
+}
+
+fs_status filesystem::copy_file_from_fs(directory_item* current_dir, const std::string& source_path,
+                                   const std::string& dest_path, bool verify) {
 
     std::string file_name;
     directory_item* parent = get_parent_directory(source_path, current_dir, file_name);
     if (!parent) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
     }
 
-    auto it = std::find_if(parent->children.begin(), parent->children.end(),
-        [&file_name](const directory_item& item) {
-            return std::string(item.item_name) == file_name && item.is_file;
-        });
+    // Readers of one directory share its lock, only writers to it have to wait
+    shared_guard dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, file_name, true);
+    if (!file) {
+        return fs_status::not_found;
+    }
 
-    if (it == parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+    // Plain files go straight from their chain to the destination, contiguous runs without passing
+    // through user space unless every cluster has to be verified
+    if (!(file->flags & (FILE_COMPRESSED | FILE_DEDUP))) {
+        int dest_fd = ::open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (dest_fd < 0) {
+            return fs_status::path_not_found;
+        }
+        if (!verify) {
+            fs_status status = export_chain(file, dest_fd, true);
+            ::close(dest_fd);
+            return status;
+        }
+        buffered_bytes += file->size;
+        int image_fd = ::open(filesystem::file_name.c_str(), O_RDONLY);
+        fs_status status = fs_status::io_error;
+        if (image_fd >= 0) {
+            std::vector<int32_t> chain = get_cluster_chain(file->start_cluster, fat1);
+            int32_t clusters = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+            status = static_cast<int32_t>(chain.size()) < clusters ? fs_status::io_error
+                : copy_clusters(copy_side{image_fd, &chain}, copy_side{dest_fd, nullptr, file->size}, clusters);
+            ::close(image_fd);
+        }
+        ::close(dest_fd);
+        return status;
     }
 
     std::ofstream dest(dest_path, std::ios::binary);
     if (!dest) {
-        std::cerr << "Path not found\n";
-        return false;
+        return fs_status::path_not_found;
     }
 
-    // Copy file content
-    std::vector<int32_t> clusters = get_cluster_chain(it->start_cluster, fat);
-
-    char buffer[CLUSTER_SIZE];  // Buffer to hold data while reading from the clusters
-    size_t total_bytes_written = 0;
-    size_t file_size = it->size;
-    size_t bytes_left = file_size;
-
-    for (size_t i = 0; i < clusters.size() && bytes_left > 0; ++i) {
-        int32_t cluster = clusters[i];
+    // Compressed and deduplicated files are decoded block by block on a producer thread while
+    // this one writes the previous blocks, the two stages hand pool buffers back and forth
+    const int32_t block_size = static_cast<int32_t>(io_buffers.buffer_size());
+    std::vector<char*> buffers = io_buffers.acquire(4);
+    std::deque<char*> free_buffers(buffers.begin(), buffers.end());
+    std::deque<std::pair<char*, int32_t>> decoded;
+    std::mutex pipe_mutex;
+    std::condition_variable pipe_changed;
+    fs_status status = fs_status::ok;
+    bool producer_done = false;
 
-        // Open the filesystem in binary mode to read data
+    std::thread producer([&] {
         std::ifstream fs_file(filesystem::file_name, std::ios::binary);
-        if (!fs_file) {
-            std::cerr << "Error opening filesystem\n";
-            return false;
+        for (int32_t offset = 0; offset < file->size; offset += block_size) {
+            char* buffer;
+            {
+                std::unique_lock<std::mutex> guard(pipe_mutex);
+                pipe_changed.wait(guard, [&] { return !free_buffers.empty() || status != fs_status::ok; });
+                if (status != fs_status::ok) {
+                    break;
+                }
+                buffer = free_buffers.front();
+                free_buffers.pop_front();
+            }
+            int32_t bytes_to_read = std::min(block_size, file->size - offset);
+            fs_status read_status = fs_file ? read_item_range(fs_file, file, offset, bytes_to_read, buffer) : fs_status::io_error;
+            std::lock_guard<std::mutex> guard(pipe_mutex);
+            if (read_status != fs_status::ok) {
+                status = read_status;
+                break;
+            }
+            decoded.emplace_back(buffer, bytes_to_read);
+            pipe_changed.notify_all();
         }
+        std::lock_guard<std::mutex> guard(pipe_mutex);
+        producer_done = true;
+        pipe_changed.notify_all();
+    });
 
-        // Move the file pointer to the start of the current cluster
-        fs_file.seekg(desc.data_start_address + cluster * CLUSTER_SIZE, std::ios::beg);
-
-        // Read the data from the current cluster, but ensure that we don't read more than the remaining bytes
-        size_t bytes_to_read = std::min(static_cast<size_t>(CLUSTER_SIZE), bytes_left);
-        fs_file.read(buffer, bytes_to_read);
-        std::streamsize bytes_read = fs_file.gcount();
-
-        // Write the valid data (up to the remaining file size) to the destination file
-        dest.write(buffer, bytes_read);
+    for (;;) {
+        std::pair<char*, int32_t> block;
+        {
+            std::unique_lock<std::mutex> guard(pipe_mutex);
+            pipe_changed.wait(guard, [&] { return !decoded.empty() || producer_done; });
+            if (decoded.empty()) {
+                break;
+            }
+            block = decoded.front();
+            decoded.pop_front();
+        }
 
-        if (!dest) {
-            std::cerr << "Error writing to destination file\n";
-            return false;
+        dest.write(block.first, block.second);
+        buffered_bytes += block.second;
+        std::lock_guard<std::mutex> guard(pipe_mutex);
+        free_buffers.push_back(block.first);
+        if (!dest && status == fs_status::ok) {
+            status = fs_status::io_error;
         }
+        pipe_changed.notify_all();
+    }
+    producer.join();
+    io_buffers.release(buffers);
+    return status;
+}
 
-        total_bytes_written += bytes_read;
-        bytes_left -= bytes_read;
+fs_status filesystem::stat(const std::string& path, entry_info& info) {
+    shared_guard namespace_guard(namespace_lock);
+    std::string file_name;
+    directory_item* parent = get_parent_directory(path, working_directory(), file_name);
+    if (!parent) {
+        return fs_status::not_found;
     }
 
-    std::cout << "OK\n";
-    return true;
+    shared_guard dir_guard(parent->contents->lock);
+    directory_item* item = find_child(parent, file_name, false);
+    if (!item) {
+        return fs_status::not_found;
+    }
+
+    info.name = item->item_name;
+    info.is_file = item->is_file;
+    info.size = item->size;
+    info.flags = item->flags;
+    info.clusters = get_cluster_chain(item->start_cluster, fat1);
+    info.stored_size = (item->flags & FILE_COMPRESSED) ? compressed_stored_size(item) : item->size;
+    return fs_status::ok;
 }
 
-std::string filesystem::get_file_clusters(directory_item* current_dir, const std::string& path,
-    const std::vector<int32_t>& fat) {
 
-    std::string file_name;
-    directory_item* parent = get_parent_directory(path, current_dir, file_name);
-    if (!parent) {
-        std::cerr << "File not found\n";
-        return "";
+// The FAT is not trusted here: the chain ends at FAT_FILE_END and at any other value that is no cluster
+// (FAT_BAD_CLUSTER, FAT_UNUSED, out of range). No chain is longer than the FAT, a cycle stops there.
+std::vector<int32_t> filesystem::get_cluster_chain(int32_t start_cluster, const std::vector<int32_t>& fat) {
+    std::vector<int32_t> clusters;
+    int32_t current = start_cluster;
+    int32_t size = static_cast<int32_t>(fat.size());
+
+    while (current >= 0 && current < size && static_cast<int32_t>(clusters.size()) < size) {
+        clusters.push_back(current);
+        current = fat[current];
     }
 
-    auto it = std::find_if(parent->children.begin(), parent->children.end(),
-        [&file_name](const directory_item& item) {
-            return std::string(item.item_name) == file_name;
-        });
+    return clusters;
+}
 
-    if (it == parent->children.end()) {
-        std::cerr << "File not found\n";
-        return "";
+chain_index& filesystem::get_chain_index(int32_t start_cluster) {
+    // Empty files all have start cluster -1, each caller gets its own empty index instead of a shared entry
+    if (start_cluster < 0) {
+        static thread_local chain_index empty;
+        empty = chain_index();
+        return empty;
     }
 
-    std::vector<int32_t> clusters = get_cluster_chain(it->start_cluster, fat);
-    std::stringstream ss;
-    ss << file_name;
-    for (int32_t cluster : clusters) {
-        ss << " " << cluster;
+    std::lock_guard<std::mutex> cache_guard(cache_mutex);
+    auto it = chain_cache.find(start_cluster);
+    if (it == chain_cache.end()) {
+        it = chain_cache.emplace(start_cluster, chain_index()).first;
+        it->second.build(start_cluster, fat1);
     }
-    return ss.str();
+    return it->second;
+}
+
+void filesystem::invalidate_chain_index(int32_t start_cluster) {
+    std::lock_guard<std::mutex> cache_guard(cache_mutex);
+    chain_cache.erase(start_cluster);
+    chunk_cache.erase(start_cluster);
 }
 
-bool filesystem::read_file_content(directory_item* current_dir, const std::string& path) {
+fs_status filesystem::read(const std::string& path, int32_t offset, std::span<char> buffer, int32_t& bytes_read) {
+    shared_guard namespace_guard(namespace_lock);
+    bytes_read = 0;
     std::string file_name;
-    directory_item* parent = get_parent_directory(path, current_dir, file_name);
+    directory_item* parent = get_parent_directory(path, working_directory(), file_name);
     if (!parent) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
     }
 
-    auto it = std::find_if(parent->children.begin(), parent->children.end(),
-        [&file_name](const directory_item& item) {
-            return std::string(item.item_name) == file_name && item.is_file;
-        });
+    shared_guard dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, file_name, true);
+    if (!file) {
+        return fs_status::not_found;
+    }
 
-    if (it == parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+    if (offset < 0) {
+        return fs_status::invalid_argument;
     }
 
-    int cluster = it->start_cluster;
-    std::vector<char> data(it->size);
-    size_t bytes= 0;
+    // Reads past the end are cut to the file size
+    if (offset >= file->size) {
+        return fs_status::ok;
+    }
+    int32_t length = static_cast<int32_t>(std::min<size_t>(buffer.size(), file->size - offset));
 
     std::ifstream fs_file(filesystem::file_name, std::ios::binary);
     if (!fs_file) {
-        std::cerr << "Error opening filesystem\n";
-        return "";
+        return fs_status::io_error;
     }
-    while (cluster != FAT_FILE_END && bytes < it->size){
-        // Calculate the position in the file for the current cluster
-        fs_file.seekg(desc.data_start_address + cluster * CLUSTER_SIZE);
+    fs_status status = read_item_range(fs_file, file, offset, length, buffer.data());
+    if (status == fs_status::ok) {
+        bytes_read = length;
+    }
+    return status;
+}
 
-        // Determine the number of bytes to read from this cluster
-        size_t bytes_to_read = std::min(static_cast<size_t>(CLUSTER_SIZE), it->size - bytes);
+fs_status filesystem::read_item_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out) {
+    if (file->flags & FILE_COMPRESSED) {
+        return read_compressed_range(in, file, offset, length, out);
+    }
+    if (file->flags & FILE_DEDUP) {
+        return read_dedup_range(in, file, offset, length, out);
+    }
+    return read_chain_range(in, file->start_cluster, offset, length, out);
+}
 
-        // Read the data from the current cluster into the buffer
-        fs_file.read(data.data() + bytes, bytes_to_read);
+// For one-off reads of metadata kept in a chain, such as block maps and chunk tables
+fs_status filesystem::read_chain_range(int32_t start_cluster, int32_t offset, int32_t length, char* out) {
+    std::ifstream fs_file(filesystem::file_name, std::ios::binary);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    return read_chain_range(fs_file, start_cluster, offset, length, out);
+}
+
+fs_status filesystem::read_chain_range(std::istream& in, int32_t start_cluster, int32_t offset, int32_t length, char* out) {
+    // Jump straight to the first needed cluster, the rest of the range is walked sequentially
+    const chain_index& index = get_chain_index(start_cluster);
+    int32_t cluster = index.cluster_at(offset / CLUSTER_SIZE, fat1);
+    int32_t in_cluster = offset % CLUSTER_SIZE;
+    int32_t done = 0;
+
+    // Whole clusters are read so that every one of them can be verified against its checksum
+    char buffer[CLUSTER_SIZE];
+    while (done < length) {
+        if (cluster < 0 || cluster >= static_cast<int32_t>(fat1.size())) {
+            return fs_status::io_error;
+        }
+        fs_status status = read_cluster(in, cluster, buffer);
+        if (status != fs_status::ok) {
+            return status;
+        }
 
-        bytes += bytes_to_read;
+        int32_t bytes_to_read = std::min(CLUSTER_SIZE - in_cluster, length - done);
+        std::memcpy(out + done, buffer + in_cluster, bytes_to_read);
 
-        // Check the FAT to find the next cluster
-        int next_cluster = fat1[cluster];
-        cluster = next_cluster;
+        done += bytes_to_read;
+        in_cluster = 0;
+        cluster = fat1[cluster];
     }
 
-    fs_file.close();
-    std::cout.write(data.data(), it->size);
-    std::cout << std::endl;
-    return true;
+    return fs_status::ok;
 }
 
+fs_status filesystem::write_file_range(directory_item* current_dir, const std::string& path, int32_t offset,
+    const char* data, int32_t length, bool at_end) {
 
-std::vector<int32_t> filesystem::get_cluster_chain(int32_t start_cluster, const std::vector<int32_t>& fat) {
-    std::vector<int32_t> clusters;
-    int32_t current = start_cluster;
+    std::string file_name;
+    directory_item* parent = get_parent_directory(path, current_dir, file_name);
+    if (!parent) {
+        return fs_status::not_found;
+    }
 
-    while (current != FAT_FILE_END && current >= 0) {
-        clusters.push_back(current);
-        current = fat[current];
+    // The entry lock makes an append atomic, its offset is taken under the same lock as the write
+    shared_guard commit_guard(commit_lock);
+    exclusive_guard dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, file_name, true);
+    if (!file) {
+        return fs_status::not_found;
+    }
+    if (at_end) {
+        offset = file->size;
     }
 
-    return clusters;
+    if (offset < 0 || length < 0 || offset > INT32_MAX - length) {
+        return fs_status::invalid_argument;
+    }
+
+    if (file->flags & (FILE_COMPRESSED | FILE_DEDUP)) {
+        return fs_status::unsupported;
+    }
+
+    int32_t old_size = file->size;
+    int32_t new_size = std::max(old_size, offset + length);
+    int32_t clusters_needed = (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    // Grow the chain behind its current tail, nothing is linked until every cluster is reserved
+    chain_index& index = get_chain_index(file->start_cluster);
+    std::vector<int32_t> new_clusters;
+    if (!allocate_extent(clusters_needed - index.length, index.tail, new_clusters)) {
+        return fs_status::no_space;
+    }
+
+    extend_chain(file, new_clusters);
+
+    std::fstream fs_file(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+
+    // A write past the end leaves a hole that has to read back as zeros, so it is written too
+    int32_t begin = std::min(offset, old_size);
+    int32_t end = offset + length;
+    int32_t first_cluster = file->start_cluster;
+    chain_index& chain = get_chain_index(first_cluster);
+    int32_t previous = begin >= CLUSTER_SIZE ? chain.cluster_at(begin / CLUSTER_SIZE - 1, fat1) : -1;
+    int32_t cluster = chain.cluster_at(begin / CLUSTER_SIZE, fat1);
+    bool relinked = false;
+    char buffer[CLUSTER_SIZE];
+
+    for (int32_t base = begin - begin % CLUSTER_SIZE; base < end; base += CLUSTER_SIZE) {
+        int32_t copy_from = std::max(base, offset);
+        int32_t copy_to = std::min(base + CLUSTER_SIZE, end);
+        bool whole_cluster = copy_from == base && copy_to == base + CLUSTER_SIZE;
+
+        // Only partially overwritten clusters that still hold file data need to be read first
+        std::memset(buffer, 0, CLUSTER_SIZE);
+        if (!whole_cluster && base < old_size) {
+            fs_status status = read_cluster(fs_file, cluster, buffer);
+            if (status != fs_status::ok) {
+                return status;
+            }
+            if (old_size - base < CLUSTER_SIZE) {
+                std::memset(buffer + (old_size - base), 0, CLUSTER_SIZE - (old_size - base));
+            }
+        }
+        if (copy_from < copy_to) {
+            std::memcpy(buffer + (copy_from - base), data + (copy_from - offset), copy_to - copy_from);
+        }
+
+        // A cluster a snapshot still sees keeps its contents, the new ones go to a copy linked in its place
+        if (!snapshots.empty() && snapshot_pinned(cluster)) {
+            int32_t copy = allocate_cluster_near(previous >= 0 ? previous : cluster);
+            if (copy == -1) {
+                invalidate_chain_index(first_cluster);
+                return fs_status::no_space;
+            }
+            set_fat(copy, fat1[cluster]);
+            if (previous >= 0) {
+                set_fat(previous, copy);
+            } else {
+                file->start_cluster = copy;
+            }
+            release_cluster(cluster);
+            cluster = copy;
+            relinked = true;
+        }
+
+        write_cluster(fs_file, cluster, buffer);
+        previous = cluster;
+        cluster = fat1[cluster];
+    }
+    if (relinked) {
+        invalidate_chain_index(first_cluster);
+    }
+
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    fs_file.close();
+
+    usage_totals grown;
+    grown.bytes = new_size - old_size;
+    grown.clusters = static_cast<int64_t>(new_clusters.size());
+    add_usage(parent, grown);
+    file->size = new_size;
+    dir_guard.unlock();
+    commit_guard.unlock();
+    return save_fs();
 }
 
-bool filesystem::copy_file_in(const std::string& source_path, const std::string& dest_path) {
-    return copy_file_to_fs(source_path, current_directory, dest_path, fat1, desc.cluster_count);
+fs_status filesystem::write(const std::string& path, int32_t offset, std::span<const char> data) {
+    if (data.size() > static_cast<size_t>(INT32_MAX)) {
+        return fs_status::invalid_argument;
+    }
+    shared_guard namespace_guard(namespace_lock);
+    return write_file_range(working_directory(), path, offset, data.data(), static_cast<int32_t>(data.size()));
 }
 
-bool filesystem::copy_file_out(const std::string& source_path, const std::string& dest_path) {
-    return copy_file_from_fs(current_directory, source_path, dest_path, fat1);
+fs_status filesystem::append(const std::string& path, std::span<const char> data) {
+    if (data.size() > static_cast<size_t>(INT32_MAX)) {
+        return fs_status::invalid_argument;
+    }
+    shared_guard namespace_guard(namespace_lock);
+    return write_file_range(working_directory(), path, 0, data.data(), static_cast<int32_t>(data.size()), true);
 }
 
-std::string filesystem::get_file_info(const std::string& path) {
-    return get_file_clusters(current_directory, path, fat1);
+fs_status filesystem::copy_file_in(const std::string& source_path, const std::string& dest_path, uint8_t flags, import_report* report) {
+    timeline_span span("incp", "api");
+    shared_guard namespace_guard(namespace_lock);
+    return copy_file_to_fs(source_path, working_directory(), dest_path, flags, report);
 }
 
-bool filesystem::cat_file(const std::string& path) {
-    return read_file_content(current_directory, path);
+fs_status filesystem::copy_file_out(const std::string& source_path, const std::string& dest_path, bool verify) {
+    timeline_span span("outcp", "api");
+    shared_guard namespace_guard(namespace_lock);
+    return copy_file_from_fs(working_directory(), source_path, dest_path, verify);
 }
 
-bool filesystem::copy_file(const std::string& source_path, const std::string& dest_path) {
-    //Step 1: Locate the source file
+fs_status filesystem::copy_file(const std::string& source_path, const std::string& dest_path) {
+    timeline_span span("cp", "api");
+    shared_guard namespace_guard(namespace_lock);
+
+    //Step 1: Locate the source and destination directories
     std::string source_file_name;
-    directory_item* source_parent = get_parent_directory(source_path, current_directory, source_file_name);
+    directory_item* source_parent = get_parent_directory(source_path, working_directory(), source_file_name);
     if (!source_parent) {
-        std::cerr << "Source file not found\n";
-        return false;
-    }
-
-    auto source_it = std::find_if(source_parent->children.begin(), source_parent->children.end(),
-        [&source_file_name](const directory_item& item) {
-            return std::string(item.item_name) == source_file_name && item.is_file;
-        });
-
-    if (source_it == source_parent->children.end()) {
-        std::cerr << "Source file not found\n";
-        return false;
+        return fs_status::not_found;
     }
-
-    // Step 2: Locate the destination directory
     std::string dest_file_name;
-    directory_item* dest_parent = get_parent_directory(dest_path, current_directory, dest_file_name);
+    directory_item* dest_parent = get_parent_directory(dest_path, working_directory(), dest_file_name);
     if (!dest_parent) {
-        std::cerr << "Destination path not found\n";
-        return false;
+        return fs_status::path_not_found;
+    }
+
+    shared_guard shared_commit(commit_lock);
+    exclusive_guard first_guard, second_guard;
+    lock_directories(source_parent, dest_parent, first_guard, second_guard);
+
+    directory_item* source = find_child(source_parent, source_file_name, true);
+    if (!source) {
+        return fs_status::not_found;
     }
 
     // If no filename is provided in dest_path, use the source file's name as the destination name
@@ -795,286 +1611,306 @@ bool filesystem::copy_file(const std::string& source_path, const std::string& de
         dest_file_name = source_file_name;
     }
 
-    // Check for duplicate filename and ensure uniqueness
-    std::string final_name = dest_file_name;
-    int counter = 1;
-    size_t dot_pos = dest_file_name.find_last_of('.');
-    std::string name_part = (dot_pos != std::string::npos) ? dest_file_name.substr(0, dot_pos) : dest_file_name;
-    std::string ext_part = (dot_pos != std::string::npos) ? dest_file_name.substr(dot_pos) : "";
-
-    while (std::any_of(dest_parent->children.begin(), dest_parent->children.end(),
-           [&final_name](const directory_item& item) {
-               return std::string(item.item_name) == final_name;
-           })) {
-        final_name = name_part + std::to_string(counter) + ext_part;
-        counter++;
+    fs_status status = copy_entries({copy_job{source, dest_parent, dest_file_name}});
+    if (status != fs_status::ok) {
+        return status;
     }
+    first_guard = exclusive_guard();
+    second_guard = exclusive_guard();
+    shared_commit.unlock();
+    return save_fs();
+}
 
+// Copies a directory with everything below it. The directories are created first, then all files go
+// through one copy_entries() call, so the whole tree takes one extent allocation and one data transfer.
+fs_status filesystem::copy_tree(const std::string& source_path, const std::string& dest_path) {
+    timeline_span span("cp -r", "api");
+    exclusive_guard namespace_guard(namespace_lock);
+    directory_item* source = find_directory_by_path(working_directory(), source_path);
+    if (!source) {
+        return fs_status::not_found;
+    }
+    if (source->parent_id == -1) {
+        return fs_status::invalid_argument;
+    }
 
-    // Allocate clusters for the copy
-    int cluster = source_it->start_cluster;
-    std::vector<int> clusters;
-    int file_size = source_it->size;
-
-    while (cluster != FAT_FILE_END && cluster >= 0 && cluster < fat1.size()){
-        int new_cluster = allocate_cluster();
-        if (new_cluster == -1){
-            std::cerr << "Not enough space\n";
-            return false ;
+    // An existing directory receives the copy under the source's name
+    std::string dest_name = source->item_name;
+    directory_item* dest_parent = find_directory_by_path(working_directory(), dest_path);
+    if (!dest_parent) {
+        dest_parent = get_parent_directory(dest_path, working_directory(), dest_name);
+        if (!dest_parent) {
+            return fs_status::path_not_found;
         }
-        clusters.push_back(new_cluster);
-
-        // Copy data from the source cluster to the destination cluster
-        char buffer[CLUSTER_SIZE];
-        std::ifstream source_file(file_name, std::ios::binary);
-        source_file.seekg(desc.data_start_address + cluster * CLUSTER_SIZE);
-        source_file.read(buffer, std::min(CLUSTER_SIZE, file_size));
-
-
-        std::ofstream destin_file(file_name, std::ios::binary | std::ios::in | std::ios::out);
-        destin_file.seekp(desc.data_start_address + new_cluster * CLUSTER_SIZE);
-        destin_file.write(buffer, std::min(CLUSTER_SIZE, file_size));
+    }
+    if (dest_name.length() >= 12) {
+        return fs_status::name_too_long;
+    }
 
-        cluster = fat1[cluster];
-        file_size -= CLUSTER_SIZE; // Decrease remaining size by cluster size
+    // The source tree is listed before anything is created, a copy into the source's own subtree does
+    // not copy itself again. Every directory names the position of its parent in the list.
+    std::vector<std::pair<directory_item*, size_t>> dirs{{source, 0}};
+    std::vector<std::pair<directory_item*, size_t>> files;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        for (directory_item& child : dirs[i].first->contents->children) {
+            if (child.is_file) {
+                files.emplace_back(&child, i);
+            } else {
+                dirs.emplace_back(&child, i);
+            }
+        }
     }
 
-    // Update FAT to mark the end of the copied file's cluster chain
-    for (size_t i = 0; i < clusters.size(); ++i){
-        fat1[clusters[i]] = (i == clusters.size() - 1) ? FAT_FILE_END : clusters[i + 1];
+    if (!reserve_entries(static_cast<int64_t>(dirs.size()))) {
+        return fs_status::no_space;
+    }
+    std::vector<directory_item*> copies;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        directory_item* parent = i == 0 ? dest_parent : copies[dirs[i].second];
+        directory_item new_dir(i == 0 ? unique_name(dest_parent, dest_name) : std::string(dirs[i].first->item_name), false);
+        new_dir.parent_id = parent->id;
+        new_dir.id = next_dir_id++;
+        directory_item& added = parent->contents->children.emplace_back(std::move(new_dir));
+        std::unique_lock<std::shared_mutex> index_guard(index_mutex);
+        directory_index[added.id] = &added;
+        copies.push_back(&added);
     }
 
-    directory_item new_file;
-    std::strncpy(new_file.item_name, final_name.c_str(), sizeof(new_file.item_name) - 1);
-    new_file.is_file = true;
-    new_file.start_cluster = clusters[0];
-    new_file.id = next_dir_id++;
-    new_file.size = source_it->size;
-    new_file.parent_id = dest_parent->id;
+    std::vector<copy_job> jobs;
+    for (const auto& [file, dir] : files) {
+        jobs.push_back(copy_job{file, copies[dir], file->item_name});
+    }
+    fs_status status = copy_entries(jobs);
+    if (status != fs_status::ok) {
+        // Nothing was copied into the new directories, the top one is the last entry of dest_parent
+        {
+            std::unique_lock<std::shared_mutex> index_guard(index_mutex);
+            for (directory_item* copy : copies) {
+                directory_index.erase(copy->id);
+            }
+        }
+        dest_parent->contents->children.pop_back();
+        release_entries(static_cast<int64_t>(dirs.size()));
+        return status;
+    }
+    return save_fs();
+}
 
+// Copies every job's file in one go: the clusters of all copies are reserved as one extent and the data
+// moves in one pipelined transfer. Nothing is added when that fails. The caller holds commit_lock shared and
+// the locks of all source and target directories.
+fs_status filesystem::copy_entries(const std::vector<copy_job>& jobs) {
+    // Whole clusters are copied as compressed chains can outgrow the file size
+    std::vector<int32_t> source_clusters;
+    std::vector<size_t> chain_ends;
+    for (const copy_job& job : jobs) {
+        std::vector<int32_t> chain = get_cluster_chain(job.source->start_cluster, fat1);
+        source_clusters.insert(source_clusters.end(), chain.begin(), chain.end());
+        chain_ends.push_back(source_clusters.size());
+    }
+    if (!reserve_entries(static_cast<int64_t>(jobs.size()))) {
+        return fs_status::no_space;
+    }
+    std::vector<int32_t> clusters;
+    if (!allocate_extent(static_cast<int32_t>(source_clusters.size()), -1, clusters)) {
+        release_entries(static_cast<int64_t>(jobs.size()));
+        return fs_status::no_space;
+    }
+
+    int image_fd = ::open(file_name.c_str(), O_RDWR);
+    fs_status status = image_fd < 0 ? fs_status::io_error
+        : copy_clusters(copy_side{image_fd, &source_clusters}, copy_side{image_fd, &clusters}, static_cast<int32_t>(clusters.size()));
+    if (image_fd >= 0) {
+        ::close(image_fd);
+    }
+    if (status != fs_status::ok) {
+        free_clusters(clusters);
+        release_entries(static_cast<int64_t>(jobs.size()));
+        return status;
+    }
+
+    size_t chain_start = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const copy_job& job = jobs[i];
+        std::vector<int32_t> chain(clusters.begin() + chain_start, clusters.begin() + chain_ends[i]);
+        chain_start = chain_ends[i];
+        link_chain(chain);
+
+        directory_item new_file(unique_name(job.target, job.name), true);
+        new_file.start_cluster = chain.empty() ? -1 : chain[0];
+        new_file.id = next_dir_id++;
+        new_file.size = job.source->size;
+        new_file.flags = job.source->flags;
+        new_file.parent_id = job.target->id;
+
+        // The copied block map points to the same data clusters
+        if (new_file.flags & FILE_DEDUP) {
+            std::vector<int32_t> blocks;
+            read_block_map(job.source, blocks);
+            for (int32_t block : blocks) {
+                retain_block(block);
+            }
+        }
 
-    // Step 6: Add the new file to the destination directory
-    dest_parent->children.push_back(new_file);
-    save_fs();
-    std::cout << "OK\n";
-    return true;
+        add_usage(job.target, file_usage(new_file, static_cast<int64_t>(chain.size())));
+        job.target->contents->children.push_back(std::move(new_file));
+    }
+    return fs_status::ok;
 }
 
-bool filesystem::move_file(const std::string& source_path, const std::string& dest_path) {
+fs_status filesystem::move_file(const std::string& source_path, const std::string& dest_path) {
+    shared_guard namespace_guard(namespace_lock);
+
     std::string source_file_name;
-    directory_item* source_parent = get_parent_directory(source_path, current_directory, source_file_name);
+    directory_item* source_parent = get_parent_directory(source_path, working_directory(), source_file_name);
     if (!source_parent) {
-        std::cerr << "File not found\n";
-        return false;
+        return fs_status::not_found;
+    }
+
+    //Locate the destination directory, an existing directory receives the file under its own name
+    std::string dest_file_name;
+    directory_item* dest_parent = find_directory_by_path(working_directory(), dest_path);
+    if (dest_parent) {
+        dest_file_name = source_file_name;
+    } else {
+        dest_parent = get_parent_directory(dest_path, working_directory(), dest_file_name);
+    }
+    if (!dest_parent) {
+        return fs_status::path_not_found;
     }
 
-    auto source_it = std::find_if(source_parent->children.begin(), source_parent->children.end(),
+    shared_guard shared_commit(commit_lock);
+    exclusive_guard first_guard, second_guard;
+    lock_directories(source_parent, dest_parent, first_guard, second_guard);
+
+    auto source_it = std::find_if(source_parent->contents->children.begin(), source_parent->contents->children.end(),
         [&source_file_name](const directory_item& item) {
-            return std::string(item.item_name) == source_file_name && item.is_file;
+            return std::string(item.item_name) == source_file_name;
     });
 
-    if (source_it == source_parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+    if (source_it == source_parent->contents->children.end()) {
+        return fs_status::not_found;
     }
-
-    //Locate the destination directory
-    std::string dest_file_name;
-    directory_item* dest_parent = get_parent_directory(dest_path, current_directory, dest_file_name);
-    if (!dest_parent) {
-        std::cerr << "Path not found\n";
-        return false;
+    if (!source_it->is_file) {
+        first_guard = exclusive_guard();
+        second_guard = exclusive_guard();
+        shared_commit.unlock();
+        namespace_guard.unlock();
+        return move_directory(source_path, dest_path);
     }
 
     // If no filename is provided in dest_path, use the source file's name as the destination name
     if (dest_file_name.empty()) {
         dest_file_name = source_file_name;
     }
+    move_entry(source_parent, source_it, dest_parent, dest_file_name);
 
-    // Check for duplicate filename and ensure uniqueness
-    std::string final_name = dest_file_name;
-    int counter = 1;
-    size_t dot_pos = dest_file_name.find_last_of('.');
-    std::string name_part = (dot_pos != std::string::npos) ? dest_file_name.substr(0, dot_pos) : dest_file_name;
-    std::string ext_part = (dot_pos != std::string::npos) ? dest_file_name.substr(dot_pos) : "";
-
-    while (std::any_of(dest_parent->children.begin(), dest_parent->children.end(),
-           [&final_name](const directory_item& item) {
-               return std::string(item.item_name) == final_name;
-           })) {
-        final_name = name_part + std::to_string(counter) + ext_part;
-        counter++;
-    }
-
-
-    directory_item *src_p = (source_it->parent_id == -1) ? &root_folder[0] : source_parent;
-
-    if (src_p){
-        // Check if the parent is the root directory
-        if (src_p == &root_folder[0]){
-            // Attempt to remove the item directly from rootDirectory by comparing IDs explicitly
-            src_p->children.erase(
-                std::remove_if(src_p->children.begin(), src_p->children.end(),
-                               [&](const directory_item &item){
-                                   // Compare both the ID and name to avoid accidental deletion of similarly named items
-                                   bool isMatch = (item.id == source_it->id && item.item_name == source_it->item_name);
-                                   return isMatch;
-                               }),
-                src_p->children.end());
-        }
-        else{
-            src_p->children.erase(
-                std::remove_if(src_p->children.begin(), src_p->children.end(),
-                               [&](const directory_item &item){
-                                   // Explicitly compare the ID instead of pointer address
-                                   bool isMatch = (item.id == source_it->id && item.item_name == source_it->item_name);
-                                   return isMatch;
-                               }),
-                source_parent->children.end());
-        }
-    }
-
-    // Create a copy of the item with updated attributes for the destination directory
-    directory_item moved_item = *source_it;
-    moved_item.parent_id = dest_parent->id;
-    // std::cout << "New item name: " << newName << '\n';
-    std::strcpy(moved_item.item_name, final_name.c_str());
-    // std::cout << "Moved item name: " << movedItem.item_name << '\n';
-    moved_item.id = source_it->id;
-    moved_item.is_file = true;
-    // Add the moved item to the destination directory
-    dest_parent->children.push_back(moved_item);
-    save_fs();
-    std::cout << "OK\n";
-    return true;
+    first_guard = exclusive_guard();
+    second_guard = exclusive_guard();
+    shared_commit.unlock();
+    return save_fs();
 }
 
-bool filesystem::load(directory_item* current_dir, const std::string &filePath){
-    std::ifstream file(filePath);
-    if (!file){
-        std::cerr << "Failed to open file: " << filePath << std::endl;
-        return false;
+// Moves a directory with everything below it. Only its node is relinked, the entries below keep their
+// parents and no data moves. The namespace is held exclusively: the cycle check walks the target's
+// parents and no other move may change them meanwhile.
+fs_status filesystem::move_directory(const std::string& source_path, const std::string& dest_path) {
+    exclusive_guard namespace_guard(namespace_lock);
+    std::string source_name;
+    directory_item* source_parent = get_parent_directory(source_path, working_directory(), source_name);
+    if (!source_parent) {
+        return fs_status::not_found;
+    }
+    auto source_it = std::find_if(source_parent->contents->children.begin(), source_parent->contents->children.end(),
+        [&source_name](const directory_item& item) {
+            return std::string(item.item_name) == source_name;
+    });
+    if (source_it == source_parent->contents->children.end()) {
+        return fs_status::not_found;
+    }
+    if (source_it->is_file) {
+        return fs_status::not_a_directory;
     }
 
-    directory_item *cur_dir = current_dir;
-
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty()) continue;
-
-        std::istringstream lineStream(line);
-        std::string command;
-        lineStream >> command;
-
-        std::string arguments;
-        std::getline(lineStream, arguments);
-        arguments.erase(0, arguments.find_first_not_of(" \t"));
-        arguments.erase(arguments.find_last_not_of(" \t") + 1);
-
-        if (command == "mkdir") {
-            if (!make_directory(cur_dir, arguments)) {
-                std::cerr << "Failed to create directory: " << arguments << "\n";
-            }
-        }
-        else if (command == "rmdir") {
-            if (!remove_directory(cur_dir, arguments)) {
-                std::cerr << "Failed to remove directory: " << arguments << "\n";
-            }
-        }
-        else if (command == "cd") {
-            directory_item* new_dir = change_directory(cur_dir, arguments);
-            if (new_dir) {
-                cur_dir = new_dir;
-            } else {
-                std::cerr << "Directory not found: " << arguments << "\n";
-            }
-        }
-        else if (command == "ls") {
-            directory_item* target_dir = find_directory_by_path(cur_dir, arguments);
-            if (target_dir) {
-                list_directory(target_dir);
-            } else {
-                std::cerr << "Directory not found: " << arguments << "\n";
-            }
+    // An existing directory receives the source under its own name
+    std::string dest_name = source_name;
+    directory_item* dest_parent = find_directory_by_path(working_directory(), dest_path);
+    if (!dest_parent) {
+        dest_parent = get_parent_directory(dest_path, working_directory(), dest_name);
+        if (!dest_parent) {
+            return fs_status::path_not_found;
         }
-        else if (command == "incp" || command == "outcp" || command == "mv" || command == "cp") {
-            std::istringstream argsStream(arguments);
-            std::string src, dest;
-            argsStream >> src >> dest;
+    }
+    if (dest_name.length() >= 12) {
+        return fs_status::name_too_long;
+    }
 
-            if (command == "incp" && !copy_file_in(src, dest)) {
-                std::cerr << "Failed to copy file from: " << src << " to " << dest << "\n";
-            }
-            else if (command == "outcp" && !copy_file_out(src, dest)) {
-                std::cerr << "Failed to copy file from: " << src << " to " << dest << "\n";
-            }
-            else if (command == "mv" && !move_file(src, dest)) {
-                std::cerr << "Failed to move file from: " << src << " to " << dest << "\n";
-            }
-            else if (command == "cp" && !copy_file(src, dest)) {
-                std::cerr << "Failed to copy file from: " << src << " to " << dest << "\n";
-            }
-        }
-        else if (command == "rm") {
-            if (!remove_file(cur_dir, arguments)) {
-                std::cerr << "Failed to remove file: " << arguments << "\n";
-            }
-        }
-        else if (command == "cat") {
-            read_file_content(cur_dir, arguments);
-        }
-        else if (command == "info") {
-            std::cout << get_file_info(arguments) << std::endl;
-        }
-        else {
-            std::cerr << "Unknown command: " << command << "\n";
+    // A directory cannot become its own descendant
+    for (directory_item* dir = dest_parent; dir; dir = dir->parent_id == -1 ? nullptr : directory_by_id(dir->parent_id)) {
+        if (dir == &*source_it) {
+            return fs_status::invalid_argument;
         }
     }
+    if (dest_parent == source_parent && dest_name == source_name) {
+        return fs_status::ok;
+    }
 
-    file.close();
-    return true;
+    move_entry(source_parent, source_it, dest_parent, dest_name);
+    return save_fs();
 }
 
-bool filesystem::bug(const std::string &path) {
-    std::string source_file_name;
-    directory_item* source_parent = get_parent_directory(path, current_directory, source_file_name);
-    if (!source_parent) {
-        std::cerr << "File not found\n";
-        return false;
-    }
+// Relinks an entry under dest_parent as name or a unique variant of it. For a file the caller holds
+// commit_lock shared and both directories' locks, a directory is only moved under the exclusive namespace_lock.
+void filesystem::move_entry(directory_item* source_parent, std::list<directory_item>::iterator it, directory_item* dest_parent, const std::string& name) {
+    std::string final_name = unique_name(dest_parent, name);
+
+    // The totals move with the entry, both sides are locked so nobody sees it counted twice or not at all
+    // The chain length comes from the cached chain index, a move does not walk the file's chain again
+    usage_totals moved = it->is_file ? file_usage(*it, get_chain_index(it->start_cluster).length)
+                                     : it->contents->usage;
+    add_usage(source_parent, moved, -1);
+    add_usage(dest_parent, moved);
+
+    // Relink the node itself, the list keeps it (and anything pointing into it) where it is
+    dest_parent->contents->children.splice(dest_parent->contents->children.end(), source_parent->contents->children, it);
+    it->parent_id = dest_parent->id;
+    std::memset(it->item_name, 0, sizeof(it->item_name));
+    std::strncpy(it->item_name, final_name.c_str(), sizeof(it->item_name) - 1);
+}
 
-    auto it = std::find_if(source_parent->children.begin(), source_parent->children.end(),
-        [&source_file_name](const directory_item& item) {
-            return std::string(item.item_name) == source_file_name && item.is_file;
-    });
+fs_status filesystem::bug(const std::string &path) {
+    exclusive_guard namespace_guard(namespace_lock);
 
-    if (it == source_parent->children.end()) {
-        std::cerr << "File not found\n";
-        return false;
+    std::string name;
+    directory_item* parent = get_parent_directory(path, working_directory(), name);
+    directory_item* file = parent ? find_child(parent, name, true) : nullptr;
+    if (!file) {
+        return fs_status::not_found;
     }
 
-    int cluster = it->start_cluster;
+    invalidate_chain_index(file->start_cluster);
+    int cluster = file->start_cluster;
     bool corrupted = false;
 
     while (cluster != FAT_FILE_END && cluster >= 0 && cluster < fat1.size()){
         if (!corrupted){
-            fat1[cluster] = FAT_BAD_CLUSTER;
+            set_fat(cluster, FAT_BAD_CLUSTER);
             corrupted = true;
         }
         cluster = fat1[cluster];
     }
     if (corrupted){
-        std::cout << "OK\n";
-        save_fs();
-        return true;
+        return save_fs();
     }
 
-    std::cout << "Error: Unable to corrupt the file.\n";
-    return false;
+    // An empty file has no cluster to corrupt
+    return fs_status::invalid_argument;
 }
 
-bool filesystem::check(){
-    bool found_corrupted_files = false;
+fs_status filesystem::check(check_report& report){
+    timeline_span span("check", "maintenance");
+    exclusive_guard namespace_guard(namespace_lock);
+    report = check_report();
 
     // Lambda to check if a file is corrupted based on its cluster chain
     auto is_file_corrupted = [this](int32_t start_cluster) -> bool {
@@ -1091,12 +1927,10 @@ bool filesystem::check(){
     // Recursive function to check all files in a directory and its subdirectories
     std::function<void(directory_item*)> check_directory;
     check_directory = [&](directory_item* dir) {
-        for (directory_item& item : dir->children) {
+        for (directory_item& item : dir->contents->children) {
             if (item.is_file) {
                 if (is_file_corrupted(item.start_cluster)) {
-                    std::cout << "Filesystem is corrupted please use command 'format' to format the disk" << "\n";
-                    corrupted = true;
-                    found_corrupted_files = true;
+                    report.corrupted = true;
                 }
             } else if (!item.is_file) { // if it's a subdirectory
                 check_directory(&item);
@@ -1108,17 +1942,66 @@ bool filesystem::check(){
     for (directory_item& item : root_folder) {
         if (item.is_file) {
             if (is_file_corrupted(item.start_cluster)) {
-                found_corrupted_files = true;
+                report.corrupted = true;
             }
         } else if (!item.is_file) { // if it's a subdirectory
             check_directory(&item);
         }
     }
 
-    if (!found_corrupted_files) {
-        corrupted = false;
-        std::cout << "Filesystem is not corrupted\n";
+    corrupted = report.corrupted;
+    if (corrupted) {
+        return fs_status::corrupted;
     }
 
-    return found_corrupted_files;
-}
\ No newline at end of file
+    // Allocated clusters no file points to are leftovers of an interrupted operation (e.g. defrag)
+    std::vector<bool> reachable(fat1.size(), false);
+    std::function<void(const directory_item&)> mark_reachable = [&](const directory_item& dir) {
+        for (const directory_item& item : dir.contents->children) {
+            if (item.is_file) {
+                for (int32_t cluster : get_cluster_chain(item.start_cluster, fat1)) {
+                    reachable[cluster] = true;
+                }
+            } else {
+                mark_reachable(item);
+            }
+        }
+    };
+    for (const directory_item& item : root_folder) {
+        mark_reachable(item);
+    }
+    for (int32_t cluster : snapshot_store) {
+        reachable[cluster] = true;
+    }
+
+    // Shared clusters of deduplicated files are reachable through the block maps, their
+    // stored reference counts have to match the number of map entries pointing to them
+    std::vector<uint32_t> references(fat1.size(), 0);
+    count_block_references(&root_folder[0], references);
+    for (size_t i = 1; i < fat1.size(); ++i) {
+        if (references[i] > 0) {
+            reachable[i] = true;
+        }
+        if (refcounts[i] != references[i]) {
+            refcounts[i] = references[i];
+            if (references[i] == 0) {
+                fingerprints[i] = 0;
+            }
+            report.fixed_refcounts++;
+        }
+    }
+
+    for (size_t i = 1; i < fat1.size(); ++i) {
+        if (!reachable[i] && fat1[i] != FAT_UNUSED && fat1[i] != FAT_BAD_CLUSTER && fat1[i] != FAT_SNAPSHOT) {
+            release_cluster(static_cast<int32_t>(i));
+            report.reclaimed_clusters++;
+        }
+    }
+    if (report.fixed_refcounts > 0) {
+        rebuild_fingerprint_index();
+    }
+    if (report.fixed_refcounts > 0 || report.reclaimed_clusters > 0) {
+        return save_fs();
+    }
+    return fs_status::ok;
+}
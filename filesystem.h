@@ -3,56 +3,224 @@
 
 
 #include <vector>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <thread>
+#include <unordered_map>
 #include "structures.h"
+#include "chain_index.h"
+#include "status.h"
+#include "buffer_pool.h"
 #include <cstdint>
 
+// The zosfs library. Every operation reports an fs_status and nothing is printed,
+// file data goes through caller supplied buffers. Relative paths start in the working directory.
+//
+// The public operations may be called from several threads at once. Lock order:
+// namespace_lock -> commit_lock -> directory locks (by id when two are taken) -> table_mutex -> cache_mutex.
+// Regular operations hold namespace_lock shared, rmdir and the whole-image maintenance operations
+// (format, check, bug, defrag, scrub) hold it exclusively. Every metadata change holds commit_lock shared,
+// so save_fs can take a consistent snapshot by holding it exclusively for a moment.
 class filesystem{
 public:
     description desc;
     std::vector<int32_t> fat1;
     std::vector<int32_t> fat2;
+    std::vector<uint32_t> refcounts; // References to each deduplicated cluster
+    std::vector<uint64_t> fingerprints; // Content fingerprint of each deduplicated cluster
+    std::unordered_map<uint64_t, int32_t> fingerprint_index; // Fingerprint -> cluster, rebuilt on load
+    std::vector<uint32_t> checksums; // CRC32C of every data cluster, updated on each cluster write
+    bool verify_checksums = true;
+    std::atomic<int32_t> bad_cluster = -1; // Cluster behind the last checksum_error
     std::vector<directory_item> root_folder;
+    std::unordered_map<int32_t, directory_item*> directory_index; // Directory id -> node
     std::string file_name;
-    int32_t next_dir_id;
-    directory_item *current_directory;
+    std::atomic<int32_t> next_dir_id;
+    std::atomic<int32_t> current_directory_id = 0;
     bool corrupted = false;
+    std::unordered_map<int32_t, chain_index> chain_cache; // Skip indexes keyed by start cluster, built lazily
+    std::atomic<int32_t> defrag_budget_ms = 0; // Time budget of one background defrag step, 0 = background mode off
+    size_t defrag_cursor = 0; // Guarded by namespace_lock
+    std::thread defrag_worker; // Runs the background steps, see start_background_defrag()
+    std::mutex defrag_mutex;
+    std::condition_variable defrag_wake;
+    std::unordered_map<int32_t, std::vector<uint32_t>> chunk_cache; // Chunk offsets of compressed files by start cluster
+    unsigned io_depth = 64; // Cluster requests kept in flight by the copy paths
+    bool io_uring_enabled = true; // false forces the thread pool backend of io_engine
+    buffer_pool io_buffers; // Aligned 64 KB buffers shared by the copy paths
+    std::atomic<uint64_t> zero_copy_bytes = 0; // Bytes outcp and cat left to the kernel
+    std::atomic<uint64_t> buffered_bytes = 0; // Bytes outcp and cat moved through user space
+    std::atomic<int32_t> free_cluster_count = 0; // Kept by every allocation and release, recounted on load
+    std::atomic<int64_t> tree_entries = 0; // Entries of the tree, the root included, reserved before one is added
+    std::vector<snapshot> snapshots; // Oldest first, guarded by table_mutex
+    std::vector<int32_t> snapshot_store; // Clusters holding the serialized snapshots
+    std::vector<int32_t> trim_pending; // Clusters freed since the last commit, guarded by table_mutex
+    std::vector<int32_t> trim_retry; // Freed clusters the older slot still refers to, guarded by save_mutex
+    std::vector<int32_t> committed_fat; // FAT of the last commit, empty when unknown, guarded by save_mutex
+    std::atomic<int64_t> trimmed_clusters = 0; // Clusters punched out of the host file
+    std::atomic<int64_t> trimmed_runs = 0;
 
+    std::shared_mutex namespace_lock;
+    std::shared_mutex commit_lock;
+    std::recursive_mutex table_mutex; // fat1, refcounts, fingerprints, fingerprint_index, checksums
+    std::mutex cache_mutex; // chain_cache, chunk_cache
+    std::shared_mutex index_mutex; // directory_index
+    std::mutex save_mutex;
+    std::atomic<uint64_t> save_requests = 0;
+    uint64_t saved_requests = 0; // Requests covered by the last save, guarded by save_mutex
+    int32_t slot_size = 0;
+    int64_t slots_offset = 0; // Image offset of the first slot, guarded by save_mutex
+    int active_slot = 1; // Slot of the last commit, guarded by save_mutex
+    uint64_t generation = 0; // Generation of the last commit, guarded by save_mutex
+
+    // Public API
+    explicit filesystem(const std::string &file_name);
+    ~filesystem();
+    fs_status open(check_report* report = nullptr);
+    fs_status format_fs(const std::string &sizeStr);
+    fs_status make_directory(const std::string& path);
+    fs_status remove_directory(const std::string& path);
+    fs_status change_directory(const std::string& path);
+    fs_status list_directory(const std::string& path, std::vector<entry_info>& entries);
+    std::string print_working_directory();
+    fs_status stat(const std::string& path, entry_info& info);
+    fs_status remove_file(const std::string& path);
+    fs_status copy_file_in(const std::string& source_path, const std::string& dest_path, uint8_t flags = 0, import_report* report = nullptr);
+    fs_status copy_file_out(const std::string& source_path, const std::string& dest_path, bool verify = false);
+    fs_status send_file(const std::string& path, int out_fd);
+    fs_status read(const std::string& path, int32_t offset, std::span<char> buffer, int32_t& bytes_read);
+    fs_status write(const std::string& path, int32_t offset, std::span<const char> data);
+    fs_status append(const std::string& path, std::span<const char> data);
+    fs_status copy_file(const std::string& source_path, const std::string& dest_path);
+    fs_status move_file(const std::string& source_path, const std::string& dest_path);
+    fs_status move_directory(const std::string& source_path, const std::string& dest_path);
+    fs_status copy_tree(const std::string& source_path, const std::string& dest_path);
+    // Batch forms of remove_file, copy_file and move_file (batch.cpp). The last component of pattern may
+    // hold the wildcards * and ?, every matching file of that directory is handled and committed once.
+    fs_status remove_matching(const std::string& pattern, int32_t& count);
+    fs_status copy_matching(const std::string& pattern, const std::string& dest_dir, int32_t& count);
+    fs_status move_matching(const std::string& pattern, const std::string& dest_dir, int32_t& count);
+    fs_status bug(const std::string &filePath);
+    fs_status check(check_report& report);
+    fs_status disk_usage(const std::string& path, usage_totals& totals);
+    space_report disk_free();
+
+    // Internals
     int32_t parse_size(const std::string& size_str);
-    filesystem(const std::string &file_name);
-    bool format_fs(const std::string &sizeStr);
     void update_dir_id();
     std::string current_file_path(directory_item *dir);
-    void save_fs();
-    void load_fs();
-    directory_item *find_dir_by_given_id(int32_t id, directory_item *dir);
-    void save_directory(std::ofstream &out, const directory_item &dir);
-    void load_dir(std::ifstream &in, directory_item &dir);
+    int32_t compute_slot_layout();
+    static int64_t tree_area_size(int32_t cluster_count);
+    int64_t tree_capacity();
+    bool reserve_entries(int64_t count);
+    void release_entries(int64_t count);
+    bool write_superblock();
+    fs_status save_fs();
+    fs_status load_fs();
+    void rebuild_directory_index();
+    directory_item *directory_by_id(int32_t id);
+    directory_item *working_directory();
+    void save_directory(std::ostream &out, const directory_item &dir);
+    void load_dir(std::istream &in, directory_item &dir);
     std::string trim_spaces(const std::string &input);
-    bool make_directory(directory_item* current_dir, const std::string& dir_name);
-    void list_directory(directory_item* dir);
-    bool directory_exists(directory_item* current_dir, const std::string& dir_name);
-    directory_item* change_directory(directory_item* current_dir, const std::string& path);
     directory_item* find_directory_by_path(directory_item* start_dir, const std::string& path);
     directory_item* get_parent_directory(const std::string& path, directory_item* current_dir, std::string& child_name);
-    bool remove_directory(directory_item* current_dir, const std::string& path);
-    std::string print_working_directory(directory_item* dir);
-    bool remove_file(directory_item* current_dir, const std::string& path);
-    bool copy_file_in(const std::string& source_path, const std::string& dest_path);
-    bool copy_file_out(const std::string& source_path, const std::string& dest_path);
-    std::string get_file_info(const std::string& path);
-    bool cat_file(const std::string& path);
-    bool copy_file_to_fs(const std::string& source_path, directory_item* current_dir, const std::string& dest_path, std::vector<int32_t>& fat, int32_t& cluster_count);
-    bool copy_file_from_fs(directory_item* current_dir, const std::string& source_path, const std::string& dest_path, const std::vector<int32_t>& fat);
-    std::string get_file_clusters(directory_item* current_dir, const std::string& path, const std::vector<int32_t>& fat);
-    bool read_file_content(directory_item* current_dir, const std::string& path);
+    fs_status copy_file_to_fs(const std::string& source_path, directory_item* current_dir, const std::string& dest_path, uint8_t flags = 0, import_report* report = nullptr);
+    fs_status copy_file_from_fs(directory_item* current_dir, const std::string& source_path, const std::string& dest_path, bool verify = false);
     std::vector<int32_t> get_cluster_chain(int32_t start_cluster, const std::vector<int32_t>& fat);
-    bool copy_file(const std::string& source_path, const std::string& dest_path);
-    bool move_file(const std::string& source_path, const std::string& dest_path);
-    int allocate_cluster();
-    bool load(directory_item* current_dir, const std::string &filePath);
-    bool bug(const std::string &filePath);
-    bool check();
+    chain_index& get_chain_index(int32_t start_cluster);
+    void invalidate_chain_index(int32_t start_cluster);
+    directory_item* find_child(directory_item* dir, const std::string& name, bool files_only);
+    static void lock_directories(directory_item* a, directory_item* b, std::unique_lock<std::shared_mutex>& first, std::unique_lock<std::shared_mutex>& second);
+    std::string unique_name(directory_item* dir, const std::string& name);
+    // The range readers take an open image stream, callers reading a file piece by piece open it once
+    fs_status read_item_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out);
+    fs_status read_chain_range(std::istream& in, int32_t start_cluster, int32_t offset, int32_t length, char* out);
+    fs_status read_chain_range(int32_t start_cluster, int32_t offset, int32_t length, char* out);
+    fs_status write_file_range(directory_item* current_dir, const std::string& path, int32_t offset, const char* data, int32_t length, bool at_end = false);
+    fs_status read_cluster(std::istream& in, int32_t cluster, char* buffer);
+    void write_cluster(std::ostream& out, int32_t cluster, const char* buffer);
+    fs_status verify_cluster(int32_t cluster, const char* buffer);
+    void record_checksum(int32_t cluster, const char* buffer);
+    fs_status copy_clusters(const copy_side& from, const copy_side& to, int32_t count);
+    fs_status copy_entries(const std::vector<copy_job>& jobs);
+    void move_entry(directory_item* source_parent, std::list<directory_item>::iterator it, directory_item* dest_parent, const std::string& name);
+    void remove_entry(directory_item* parent, std::list<directory_item>::iterator it);
+    int allocate_cluster_near(int32_t hint);
+    bool allocate_extent(int32_t count, int32_t hint, std::vector<int32_t>& clusters);
+    void extend_chain(directory_item* file, const std::vector<int32_t>& clusters);
+    void link_chain(const std::vector<int32_t>& clusters);
+    void free_clusters(const std::vector<int32_t>& clusters);
+    usage_totals file_usage(const directory_item& file, int64_t chain_length);
+    void add_usage(directory_item* dir, const usage_totals& delta, int64_t sign = 1);
+    void rebuild_usage();
+
+    // Defragmentation (defrag.cpp)
+    int32_t count_runs(int32_t start_cluster, int32_t& clusters);
+    double fragmentation_score(int32_t start_cluster);
+    void collect_files(directory_item* dir, const std::string& path, std::vector<std::pair<std::string, directory_item*>>& files);
+    fragmentation_report fragmentation();
+    int32_t find_free_run(int32_t length);
+    void sync_image();
+    fs_status defrag_file(directory_item* file, bool& moved);
+    fs_status defrag_step(int32_t budget_ms, int32_t& moved);
+    fs_status defrag(int32_t& moved);
+    // Runs a step with the given budget from a worker thread until stopped, so files move while the volume is idle
+    void start_background_defrag(int32_t budget_ms);
+    void stop_background_defrag();
+
+    // Compressed files (compressed_file.cpp)
+    bool build_compressed_stream(std::ifstream& source, std::streamsize size, std::vector<char>& stream);
+    const std::vector<uint32_t>* get_chunk_index(directory_item* file);
+    int32_t compressed_stored_size(directory_item* file);
+    fs_status read_compressed_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out);
+
+    // Deduplicated files (dedup.cpp)
+    void rebuild_fingerprint_index();
+    void retain_block(int32_t cluster);
+    void release_block(int32_t cluster);
+    void release_dedup_map(const std::vector<char>& stream);
+    fs_status build_dedup_map(std::ifstream& source, std::streamsize size, std::vector<char>& stream, import_report* report);
+    fs_status read_block_map(directory_item* file, std::vector<int32_t>& blocks);
+    fs_status read_dedup_range(std::istream& in, directory_item* file, int32_t offset, int32_t length, char* out);
+    void count_block_references(directory_item* dir, std::vector<uint32_t>& references);
+    dedup_report dedup_statistics();
+
+    // Zero-copy export (export.cpp)
+    fs_status export_chain(directory_item* file, int out_fd, bool positioned);
+
+    // Copy-on-write snapshots (snapshot.cpp)
+    fs_status create_snapshot(const std::string& name);
+    fs_status list_snapshots(std::vector<snapshot_info>& list);
+    fs_status restore_snapshot(const std::string& name);
+    fs_status delete_snapshot(const std::string& name);
+    void set_fat(int32_t cluster, int32_t value);
+    int32_t snapshot_view(size_t index, int32_t cluster);
+    bool snapshot_pinned(int32_t cluster);
+    void release_cluster(int32_t cluster);
+    bool store_snapshots(std::string& bytes);
+    int32_t snapshot_headroom(int32_t count);
+    fs_status load_snapshots(std::istream& in);
+
+    // Space management (space.cpp)
+    fs_status preallocate(const std::string& path, int32_t size);
+    fs_status zero_clusters(const std::vector<int32_t>& clusters);
+    void punch_clusters(const std::vector<int32_t>& clusters);
+    void punch_freed(std::vector<int32_t>& freed, const std::vector<int32_t>& fat_committed);
+    fs_status trim(trim_report& report);
+
+    // Online resize (resize.cpp)
+    fs_status resize(const std::string& size_str);
+    fs_status migrate_clusters(int32_t limit);
+    fs_status relocate_slots(int64_t offset, int32_t size);
+
+    // Integrity (scrub.cpp)
+    fs_status scrub(scrub_report& report);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,204 +1,154 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <sstream> // This header provides std::stringstream
 #include "filesystem.h"
-
-std::vector<std::string> parse_command(const std::string& command_line) {
-    std::vector<std::string> args;
-    std::stringstream ss(command_line);
-    std::string arg;
-    while (ss >> arg) {
-        args.push_back(arg);
+#include "commands.h"
+#include "server.h"
+#include "trace.h"
+#include <unistd.h>
+
+// Daemon mode, the image is shared by every client of the socket instead of the shell
+int serve_image(const std::string& image, const std::string& socket_path) {
+    filesystem fs(image);
+    fs_status status = fs.open();
+    if (status == fs_status::ok && fs.corrupted) {
+        status = fs_status::corrupted;
+    }
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return 1;
     }
-    return args;
+
+    std::cout << "Serving " << image << " on " << socket_path << std::endl;
+    print_status(fs, serve(fs, socket_path));
+    return 1;
 }
 
 int main(int argc, char *argv[]){
-    std::string command, arg;
+    std::string command;
+    if (argc == 4 && std::string(argv[1]) == "--serve") {
+        return serve_image(argv[2], argv[3]);
+    }
+    if (argc >= 4 && std::string(argv[1]) == "--replay") {
+        bool realtime = false;
+        std::string snapshot_name;
+        bool valid = true;
+        for (int i = 4; i < argc && valid; ++i) {
+            std::string option = argv[i];
+            if (option == "--realtime") {
+                realtime = true;
+            } else if (option == "--snapshot" && i + 1 < argc) {
+                snapshot_name = argv[++i];
+            } else {
+                valid = false;
+            }
+        }
+        if (valid) {
+            return replay_trace(argv[2], argv[3], realtime, snapshot_name);
+        }
+    }
     if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <filesystem name>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <filesystem name>\n"
+                  << "       " << argv[0] << " --serve <filesystem name> <socket path>\n"
+                  << "       " << argv[0] << " --replay <filesystem name> <trace> [--realtime] [--snapshot <name>]" << std::endl;
         return 1;
     }
 
+    // Fed from a pipe the shell runs as a batch interpreter: no prompts and fully buffered output
+    bool interactive = isatty(STDIN_FILENO);
+    if (!interactive) {
+        std::ios::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+    }
+
     filesystem fs(argv[1]);
-    directory_item *cur_dir = &fs.root_folder[0];
-    while (fs.corrupted) {
-        fs.check();
-        std::cout << fs.current_file_path(cur_dir) + ">";
-        std::getline(std::cin, command);
+    check_report report;
+    fs_status status = fs.open(&report);
+    if (status == fs_status::not_formatted) {
+        while (true){
+            std::cout << "You need to format the file, enter format <size><unit(MB,KB)>" << std::endl;
+            std::cout << "> ";
+            if (!std::getline(std::cin, command)) {
+                return 0;
+            }
+
+            std::vector<std::string_view> args;
+            split_words(command, args);
+            if (args.empty()) continue;
+            if (args[0] == "exit") {
+                return 0;
+            }
+            if (args[0] == "format" && args.size() == 2) {
+                status = fs.format_fs(std::string(args[1]));
+                if (status == fs_status::ok) {
+                    std::cout << "OK\n";
+                    break;
+                }
+                print_status(fs, status);
+            }
+        }
+    } else if (status == fs_status::io_error) {
+        print_status(fs, status);
+        return 1;
+    } else {
+        print_check_report(report);
+        if (!fs.corrupted) {
+            std::cout << "Loaded filesystem with signature: " << fs.desc.signature << std::endl;
+            std::cout << "Disk size: " << fs.desc.disk_size << " bytes" << std::endl;
+            std::cout << "Cluster size: " << fs.desc.cluster_size << " bytes" << std::endl;
+            std::cout << "Total clusters: " << fs.desc.cluster_count << std::endl;
+        }
+    }
 
-        if (command.empty()) continue;
+    // A corrupted image only accepts format
+    while (fs.corrupted) {
+        if (interactive) {
+            std::cout << fs.current_file_path(fs.working_directory()) + ">";
+        }
+        if (!std::getline(std::cin, command)) {
+            return 0;
+        }
 
-        auto args = parse_command(command);
+        std::vector<std::string_view> args;
+        split_words(command, args);
         if (args.empty()) continue;
-        std::string cmd = args[0];
 
-        if (cmd == "format") {
+        if (args[0] == "format") {
             if (args.size() != 2) {
                 std::cerr << "Usage: format <size>" << std::endl;
                 continue;
             }
-            if (fs.format_fs(args[1])){
+            if (fs.format_fs(std::string(args[1])) == fs_status::ok){
+                std::cout << "OK\n";
                 break;
             }
 
             std::cout << "Cannot create file system\n";
-
         }
+        std::cout << status_message(fs_status::corrupted) << "\n";
     }
 
 
+    std::vector<std::string_view> words;
     while (true){
-        std::cout << fs.current_file_path(cur_dir) + ">";
-        std::getline(std::cin, command);
-
-        if (command.empty()) continue;
-
-        auto args = parse_command(command);
-        if (args.empty()) continue;
-
-        std::string cmd = args[0];
+        if (interactive) {
+            std::cout << fs.current_file_path(fs.working_directory()) + ">";
+        }
+        if (!std::getline(std::cin, command)) {
+            break;
+        }
 
-        if (cmd == "exit") {
+        split_words(command, words);
+        if (!words.empty() && words[0] == "exit") {
             std::cout << "Exiting program." << std::endl;
             break;
         }
         try {
-            if (cmd == "format") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: format <size>" << std::endl;
-                    continue;
-                }
-                if (fs.format_fs(args[1])){
-                    std::cout << "OK\n";
-                }
-                else{
-                    std::cout << "Cannot create file systen\n";
-                }
-            }
-            else if (cmd == "mkdir") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: mkdir <directory_name>" << std::endl;
-                    continue;
-                }
-                if (fs.make_directory(cur_dir, args[1])) {
-                    std::cout << "Directory created successfully\n";
-                } else {
-                    std::cout << "Failed to create directory\n";
-                }
-            }
-            else if (cmd == "ls") {
-                if (args.size() == 1) {
-                    fs.list_directory(cur_dir);
-                } else {
-                    directory_item* target_dir = fs.find_directory_by_path(cur_dir, args[1]);
-                    if (target_dir) {
-                        fs.list_directory(target_dir);
-                    } else {
-                        std::cerr << "Directory not found\n";
-                    }
-                }
-            }
-            else if (cmd == "cd") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: cd <directory_path>" << std::endl;
-                    continue;
-                }
-                directory_item* new_dir = fs.change_directory(cur_dir, args[1]);
-                if (new_dir != cur_dir) {
-                    cur_dir = new_dir;
-                }
-            }
-            else if (cmd == "rmdir") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: rmdir <directory_path>" << std::endl;
-                    continue;
-                }
-                fs.remove_directory(cur_dir, args[1]);
-            }
-            else if (cmd == "pwd") {
-                std::cout << fs.print_working_directory(cur_dir) << std::endl;
-            }
-            else if (cmd == "rm") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: rm <file_path>" << std::endl;
-                    continue;
-                }
-                fs.remove_file(cur_dir, args[1]);
-            }
-            else if (cmd == "incp") {
-                if (args.size() != 3) {
-                    std::cerr << "Usage: incp <source> <destination>" << std::endl;
-                    continue;
-                }
-                fs.copy_file_in(args[1], args[2]);
-            }
-            else if (cmd == "outcp") {
-                if (args.size() != 3) {
-                    std::cerr << "Usage: outcp <source> <destination>" << std::endl;
-                    continue;
-                }
-                fs.copy_file_out(args[1], args[2]);
-            }
-            else if (cmd == "info") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: info <path>" << std::endl;
-                    continue;
-                }
-                std::cout << fs.get_file_info(args[1]) << std::endl;
-            }
-            else if (cmd == "cat") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: cat <file>" << std::endl;
-                    continue;
-                }
-                fs.cat_file(args[1]);
-            }
-            else if (cmd == "cp") {
-                if (args.size() != 3) {
-                    std::cerr << "Usage: cp <source> <destination>" << std::endl;
-                    continue;
-                }
-                fs.copy_file(args[1], args[2]);
-            }
-            else if (cmd == "mv") {
-                if (args.size() != 3) {
-                    std::cerr << "Usage: mv <source> <destination>" << std::endl;
-                    continue;
-                }
-                fs.move_file(args[1], args[2]);
-            }
-            else if (cmd == "load") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: load <file_path>" << std::endl;
-                    continue;
-                }
-                fs.load(cur_dir, args[1]);
-            }
-            else if (cmd == "bug") {
-                if (args.size() != 2) {
-                    std::cerr << "Usage: bug <file_path>" << std::endl;
-                    continue;
-                }
-                fs.bug(args[1]);
-            }
-            else if (cmd == "check") {
-                if (args.size() != 1) {
-                    std::cerr << "Usage: check" << std::endl;
-                    continue;
-                }
-                fs.check();
-            }
-            else {
-                std::cerr << "Command not found" << std::endl;
-            }
+            execute_line(fs, command);
         }
-
-        catch (const std::runtime_error& e) {
+        catch (const std::exception& e) {
             std::cerr << e.what() << std::endl;
         }
-
     }
 
     return 0;
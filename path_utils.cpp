@@ -21,4 +21,34 @@ std::string join_path(const std::vector<std::string>& parts) {
         path += "/" + part;
     }
     return path.empty() ? "/" : path;
-}
\ No newline at end of file
+}
+
+bool has_wildcards(const std::string& name) {
+    return name.find_first_of("*?") != std::string::npos;
+}
+
+bool glob_match(const std::string& pattern, const std::string& name) {
+    // Greedy with backtracking to the last *, linear in practice for names of at most 11 characters
+    size_t p = 0;
+    size_t n = 0;
+    size_t star = std::string::npos;
+    size_t resume = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
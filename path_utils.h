@@ -6,5 +6,8 @@
 
 std::vector<std::string> split_path(const std::string& path);
 std::string join_path(const std::vector<std::string>& parts);
+bool has_wildcards(const std::string& name);
+// Shell style match of a name against a pattern, * stands for any run of characters and ? for one
+bool glob_match(const std::string& pattern, const std::string& name);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "protocol.h"
+#include <cstring>
+
+void put_u8(std::string& out, uint8_t value) {
+    out.push_back(static_cast<char>(value));
+}
+
+void put_u32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_u64(std::string& out, uint64_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+std::string u32_arg(uint32_t value) {
+    std::string arg;
+    put_u32(arg, value);
+    return arg;
+}
+
+static uint32_t get_u32(const char* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+body_reader::body_reader(const std::string& body): position(body.data()), end(body.data() + body.size()) {
+}
+
+bool body_reader::u8(uint8_t& value) {
+    if (end - position < 1) {
+        return false;
+    }
+    value = static_cast<uint8_t>(*position++);
+    return true;
+}
+
+bool body_reader::u32(uint32_t& value) {
+    if (end - position < static_cast<std::ptrdiff_t>(sizeof(value))) {
+        return false;
+    }
+    value = get_u32(position);
+    position += sizeof(value);
+    return true;
+}
+
+bool body_reader::u64(uint64_t& value) {
+    if (end - position < static_cast<std::ptrdiff_t>(sizeof(value))) {
+        return false;
+    }
+    std::memcpy(&value, position, sizeof(value));
+    position += sizeof(value);
+    return true;
+}
+
+bool body_reader::entry(entry_info& info) {
+    uint8_t is_file, flags;
+    uint32_t size, stored_size, name_length, cluster_count;
+    if (!u8(is_file) || !u8(flags) || !u32(size) || !u32(stored_size) || !u32(name_length) ||
+        end - position < static_cast<std::ptrdiff_t>(name_length)) {
+        return false;
+    }
+    info.name.assign(position, name_length);
+    position += name_length;
+    if (!u32(cluster_count) || (end - position) / static_cast<std::ptrdiff_t>(sizeof(int32_t)) < static_cast<std::ptrdiff_t>(cluster_count)) {
+        return false;
+    }
+    info.is_file = is_file != 0;
+    info.flags = flags;
+    info.size = static_cast<int32_t>(size);
+    info.stored_size = static_cast<int32_t>(stored_size);
+    info.clusters.resize(cluster_count);
+    std::memcpy(info.clusters.data(), position, cluster_count * sizeof(int32_t));
+    position += cluster_count * sizeof(int32_t);
+    return true;
+}
+
+// u8 is_file, u8 flags, u32 size, u32 stored size, u32 name length + name, u32 cluster count + clusters
+void encode_entry(std::string& out, const entry_info& info) {
+    put_u8(out, info.is_file ? 1 : 0);
+    put_u8(out, info.flags);
+    put_u32(out, static_cast<uint32_t>(info.size));
+    put_u32(out, static_cast<uint32_t>(info.stored_size));
+    put_u32(out, static_cast<uint32_t>(info.name.size()));
+    out += info.name;
+    put_u32(out, static_cast<uint32_t>(info.clusters.size()));
+    out.append(reinterpret_cast<const char*>(info.clusters.data()), info.clusters.size() * sizeof(int32_t));
+}
+
+void encode_request(std::string& out, const request& req) {
+    uint32_t length = sizeof(uint32_t) + 2;
+    for (const std::string& arg : req.args) {
+        length += sizeof(uint32_t) + arg.size();
+    }
+    put_u32(out, length);
+    put_u32(out, req.tag);
+    put_u8(out, static_cast<uint8_t>(req.op));
+    put_u8(out, static_cast<uint8_t>(req.args.size()));
+    for (const std::string& arg : req.args) {
+        put_u32(out, static_cast<uint32_t>(arg.size()));
+        out += arg;
+    }
+}
+
+void encode_response(std::string& out, const response& res) {
+    put_u32(out, static_cast<uint32_t>(sizeof(uint32_t) + 1 + res.body.size()));
+    put_u32(out, res.tag);
+    put_u8(out, static_cast<uint8_t>(res.status));
+    out += res.body;
+}
+
+// Checks the frame header, returns the body length or 0 when the frame is not complete yet
+static uint32_t frame_length(const char* data, size_t size, uint32_t min_length, bool& malformed) {
+    malformed = false;
+    if (size < sizeof(uint32_t)) {
+        return 0;
+    }
+    uint32_t length = get_u32(data);
+    if (length < min_length || length > MAX_FRAME_SIZE) {
+        malformed = true;
+        return 0;
+    }
+    return size - sizeof(uint32_t) < length ? 0 : length;
+}
+
+size_t decode_request(const char* data, size_t size, request& req, bool& malformed) {
+    uint32_t length = frame_length(data, size, sizeof(uint32_t) + 2, malformed);
+    if (length == 0) {
+        return 0;
+    }
+
+    const char* body = data + sizeof(uint32_t);
+    const char* end = body + length;
+    req.tag = get_u32(body);
+    req.op = static_cast<opcode>(static_cast<uint8_t>(body[4]));
+    uint8_t count = static_cast<uint8_t>(body[5]);
+    const char* position = body + 6;
+
+    req.args.resize(count);
+    for (std::string& arg : req.args) {
+        if (end - position < static_cast<std::ptrdiff_t>(sizeof(uint32_t))) {
+            malformed = true;
+            return 0;
+        }
+        uint32_t arg_length = get_u32(position);
+        position += sizeof(uint32_t);
+        if (static_cast<size_t>(end - position) < arg_length) {
+            malformed = true;
+            return 0;
+        }
+        arg.assign(position, arg_length);
+        position += arg_length;
+    }
+    if (position != end) {
+        malformed = true;
+        return 0;
+    }
+    return sizeof(uint32_t) + length;
+}
+
+size_t decode_response(const char* data, size_t size, response& res, bool& malformed) {
+    uint32_t length = frame_length(data, size, sizeof(uint32_t) + 1, malformed);
+    if (length == 0) {
+        return 0;
+    }
+
+    const char* body = data + sizeof(uint32_t);
+    res.tag = get_u32(body);
+    res.status = static_cast<fs_status>(static_cast<uint8_t>(body[4]));
+    res.body.assign(body + 5, length - 5);
+    return sizeof(uint32_t) + length;
+}
@@ -0,0 +1,82 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "status.h"
+#include "structures.h"
+
+// Binary protocol of 'ZOS_sem --serve'.
+// Every message is a frame: a uint32_t length of the body followed by the body, integers are in host byte order
+// as the socket is local. A request body is: uint32_t tag, uint8_t opcode, uint8_t argument count, then every
+// argument as uint32_t length + bytes. A response body is: uint32_t tag, uint8_t fs_status, then the result.
+// The tag is picked by the client and echoed back. A client may send any number of requests before reading,
+// the responses of one connection come back in request order.
+enum class opcode : uint8_t{
+    pwd = 1,    // -> path
+    cd,         // path
+    mkdir,      // path
+    rmdir,      // path
+    ls,         // [path] -> entries
+    stat,       // path -> one entry with its clusters
+    rm,         // path
+    incp,       // host source, destination, flags byte -> u32 shared clusters, u32 total clusters
+    outcp,      // source, host destination
+    read,       // path, u32 offset, u32 length -> data
+    write,      // path, u32 offset, data
+    append,     // path, data
+    cp,         // source, destination
+    mv,         // source, destination
+    check,      // -> u8 corrupted, u32 fixed refcounts, u32 reclaimed clusters
+    scrub,      // -> u64 verified clusters, u32 count, count x u32 bad cluster
+    dedup,      // -> u64 unique clusters, u64 references
+    du,         // [path] -> u64 files, u64 bytes, u64 clusters
+    df,         // -> u32 total clusters, u32 free clusters
+    fallocate,  // path, u32 size
+};
+
+constexpr uint32_t MAX_FRAME_SIZE = 64u << 20;
+
+struct request{
+    uint32_t tag = 0;
+    opcode op = opcode::pwd;
+    std::vector<std::string> args;
+};
+
+// A checksum_error response carries the bad cluster as u32 instead of a result
+struct response{
+    uint32_t tag = 0;
+    fs_status status = fs_status::ok;
+    std::string body;
+};
+
+void put_u8(std::string& out, uint8_t value);
+void put_u32(std::string& out, uint32_t value);
+void put_u64(std::string& out, uint64_t value);
+std::string u32_arg(uint32_t value);
+
+// Reads fixed size values and entries from a body, false when it is too short
+class body_reader{
+public:
+    body_reader(const std::string& body);
+    bool u8(uint8_t& value);
+    bool u32(uint32_t& value);
+    bool u64(uint64_t& value);
+    bool entry(entry_info& info);
+private:
+    const char* position;
+    const char* end;
+};
+
+void encode_entry(std::string& out, const entry_info& info);
+void encode_request(std::string& out, const request& req);
+void encode_response(std::string& out, const response& res);
+
+// Decode the frame at the start of data. They return the bytes it took, 0 while the frame is incomplete
+// or when it is malformed, which is reported separately.
+size_t decode_request(const char* data, size_t size, request& req, bool& malformed);
+size_t decode_response(const char* data, size_t size, response& res, bool& malformed);
+
+#endif
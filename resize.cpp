@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+#include "filesystem.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Moves every cluster at or past limit below it. The data is copied and flushed first, then every
+// reference is rewritten: FAT links, start clusters and the block maps of deduplicated files, whose
+// rewritten maps go to new clusters. The old clusters keep their contents, so the last commit stays
+// readable until the caller commits the result.
+// A cluster a snapshot still sees cannot move, the snapshot's tree points to it.
+fs_status filesystem::migrate_clusters(int32_t limit) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    int32_t count = static_cast<int32_t>(fat1.size());
+
+    // The snapshot store is rewritten below the limit by the next commit, it does not move
+    std::vector<int32_t> sources;
+    for (int32_t cluster = limit; cluster < count; ++cluster) {
+        int32_t value = fat1[cluster];
+        if (value == FAT_UNUSED || value == FAT_BAD_CLUSTER ||
+            std::find(snapshot_store.begin(), snapshot_store.end(), cluster) != snapshot_store.end()) {
+            continue;
+        }
+        if (value == FAT_SNAPSHOT || (!snapshots.empty() && snapshot_pinned(cluster))) {
+            return fs_status::no_space;
+        }
+        sources.push_back(cluster);
+    }
+    if (sources.empty()) {
+        return fs_status::ok;
+    }
+    if (static_cast<int32_t>(std::count(fat1.begin() + 1, fat1.begin() + limit, FAT_UNUSED)) < static_cast<int32_t>(sources.size())) {
+        return fs_status::no_space;
+    }
+
+    std::fstream fs_file(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    std::unordered_map<int32_t, int32_t> moved;  // Old cluster -> new cluster
+    std::unordered_map<int32_t, int32_t> origin; // New cluster -> old cluster
+    char buffer[CLUSTER_SIZE];
+    int32_t target = 1;
+    for (int32_t cluster : sources) {
+        while (fat1[target] != FAT_UNUSED) {
+            target++;
+        }
+        fs_status status = read_cluster(fs_file, cluster, buffer);
+        if (status != fs_status::ok) {
+            return status;
+        }
+        write_cluster(fs_file, target, buffer);
+        refcounts[target] = refcounts[cluster];
+        fingerprints[target] = fingerprints[cluster];
+        set_fat(target, FAT_FILE_END);
+        free_cluster_count--;
+        moved.emplace(cluster, target);
+        origin.emplace(target, cluster);
+    }
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    fs_file.close();
+    sync_image();
+
+    // A moved cluster takes the link of its original, every link to a moved cluster follows it
+    for (int32_t cluster = 1; cluster < limit; ++cluster) {
+        auto from = origin.find(cluster);
+        int32_t value = from != origin.end() ? fat1[from->second] : fat1[cluster];
+        auto to = moved.find(value);
+        if (to != moved.end()) {
+            value = to->second;
+        }
+        if (value != fat1[cluster]) {
+            set_fat(cluster, value);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> cache_guard(cache_mutex);
+        chain_cache.clear();
+        chunk_cache.clear();
+    }
+
+    std::vector<std::pair<std::string, directory_item*>> files;
+    collect_files(&root_folder[0], "", files);
+    for (const auto& [path, file] : files) {
+        auto start = moved.find(file->start_cluster);
+        if (start != moved.end()) {
+            file->start_cluster = start->second;
+        }
+    }
+
+    // Block maps are data, the ones that name a moved block are written again into free clusters and
+    // the file takes the new chain. The old map stays intact for the last commit and is freed at the end,
+    // so no later map lands on it either.
+    fs_file.open(filesystem::file_name, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    std::vector<int32_t> replaced;
+    for (const auto& [path, file] : files) {
+        if (!(file->flags & FILE_DEDUP)) {
+            continue;
+        }
+        std::vector<int32_t> blocks;
+        fs_status status = read_block_map(file, blocks);
+        if (status != fs_status::ok) {
+            return status;
+        }
+        bool changed = false;
+        for (int32_t& block : blocks) {
+            auto to = moved.find(block);
+            if (to != moved.end()) {
+                block = to->second;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            continue;
+        }
+
+        std::vector<int32_t> chain = get_cluster_chain(file->start_cluster, fat1);
+        std::vector<int32_t> map_chain;
+        const char* map = reinterpret_cast<const char*>(blocks.data());
+        size_t map_bytes = blocks.size() * sizeof(int32_t);
+        for (size_t i = 0; i < chain.size(); ++i) {
+            while (target < limit && fat1[target] != FAT_UNUSED) {
+                target++;
+            }
+            if (target >= limit) {
+                return fs_status::no_space;
+            }
+            status = read_cluster(fs_file, chain[i], buffer);
+            if (status != fs_status::ok) {
+                return status;
+            }
+            if (i * CLUSTER_SIZE < map_bytes) {
+                std::memcpy(buffer, map + i * CLUSTER_SIZE, std::min<size_t>(CLUSTER_SIZE, map_bytes - i * CLUSTER_SIZE));
+            }
+            write_cluster(fs_file, target, buffer);
+            refcounts[target] = refcounts[chain[i]];
+            set_fat(target, FAT_FILE_END);
+            free_cluster_count--;
+            map_chain.push_back(target);
+        }
+        link_chain(map_chain);
+        invalidate_chain_index(file->start_cluster);
+        file->start_cluster = map_chain.empty() ? -1 : map_chain[0];
+        replaced.insert(replaced.end(), chain.begin(), chain.end());
+    }
+    if (!fs_file) {
+        return fs_status::io_error;
+    }
+    fs_file.close();
+    sync_image();
+    free_clusters(replaced);
+    rebuild_fingerprint_index();
+    return fs_status::ok;
+}
+
+// Moves the metadata slots to offset. Both slots get the current state there before the superblock
+// switches over, until then a crash finds the old slots as they were.
+fs_status filesystem::relocate_slots(int64_t offset, int32_t size) {
+    {
+        std::lock_guard<std::mutex> save_guard(save_mutex);
+        slots_offset = offset;
+        slot_size = size;
+    }
+    fs_status status = save_fs();
+    if (status == fs_status::ok) {
+        status = save_fs();
+    }
+    if (status == fs_status::ok && !write_superblock()) {
+        status = fs_status::io_error;
+    }
+    return status;
+}
+
+// Grows or shrinks the volume in place. The data region keeps its start, so growing copies no data:
+// the FAT gets new entries and the metadata slots, which grow with it, move behind the new end. Shrinking
+// migrates the clusters past the new end first. On any failure the last commit is loaded again.
+fs_status filesystem::resize(const std::string& size_str) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    int32_t new_size = parse_size(size_str);
+    int32_t new_count = new_size / CLUSTER_SIZE;
+    if (new_size <= 0 || new_count < 2) {
+        return fs_status::invalid_argument;
+    }
+    int32_t old_count = desc.cluster_count;
+    if (new_count == old_count) {
+        return fs_status::ok;
+    }
+    // The tree area shrinks with the volume, the tree has to fit the smaller one
+    if (tree_entries * TREE_ENTRY_SIZE > tree_area_size(new_count)) {
+        return fs_status::no_space;
+    }
+
+    fs_status status = new_count < old_count ? migrate_clusters(new_count) : fs_status::ok;
+    if (status != fs_status::ok) {
+        load_fs();
+        return status;
+    }
+
+    // New clusters may cover the old slots, they are held back as bad clusters until the superblock
+    // points past them and no commit can place snapshot data there before
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        fat1.resize(new_count, FAT_BAD_CLUSTER);
+        fat2.resize(new_count, FAT_UNUSED);
+        refcounts.resize(new_count, 0);
+        fingerprints.resize(new_count, 0);
+        checksums.resize(new_count, 0);
+        for (snapshot& s : snapshots) {
+            std::erase_if(s.fat_undo, [&](const auto& entry) { return entry.first >= new_count; });
+        }
+        desc.disk_size = new_size;
+        desc.cluster_count = new_count;
+        desc.fat_count = new_count;
+    }
+
+    int64_t old_offset = slots_offset;
+    int32_t old_slot_size = slot_size;
+    int64_t old_slots_end = old_offset + 2 * static_cast<int64_t>(old_slot_size);
+    int64_t data_end = desc.data_start_address + static_cast<int64_t>(new_count) * CLUSTER_SIZE;
+    int32_t new_slot_size = compute_slot_layout();
+
+    if (old_offset < desc.data_start_address && new_slot_size <= old_slot_size) {
+        // The slots in front of the data still hold the tables, both are rewritten in place
+        status = save_fs();
+        if (status == fs_status::ok) {
+            status = save_fs();
+        }
+    }
+    else if (new_count > old_count) {
+        status = relocate_slots(std::max(data_end, old_slots_end), new_slot_size);
+    }
+    else {
+        // Slots behind the data move down with the end. If the new place overlaps the old slots they
+        // make a stop behind them first, so one complete pair is on disk at every moment.
+        if (old_offset >= desc.data_start_address && data_end + 2 * static_cast<int64_t>(new_slot_size) > old_offset) {
+            status = relocate_slots(old_slots_end, new_slot_size);
+        }
+        if (status == fs_status::ok) {
+            status = relocate_slots(data_end, new_slot_size);
+        }
+    }
+    if (status != fs_status::ok) {
+        load_fs();
+        return status;
+    }
+
+    // No snapshot has seen the new clusters, set_fat has nothing to preserve for them
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        for (int32_t cluster = old_count; cluster < new_count; ++cluster) {
+            fat1[cluster] = FAT_UNUSED;
+        }
+    }
+    rebuild_usage();
+    status = save_fs();
+
+    int64_t image_end = std::max(data_end, slots_offset + 2 * static_cast<int64_t>(slot_size));
+    if (::truncate(file_name.c_str(), image_end) != 0 && status == fs_status::ok) {
+        status = fs_status::io_error;
+    }
+    return status;
+}
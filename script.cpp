@@ -0,0 +1,53 @@
+#include "script.h"
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+void compile_script(std::istream& in, script_plan& plan) {
+    std::unordered_map<std::string_view, const std::string*> interned;
+    std::vector<std::string_view> words;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        split_command(line, words);
+        if (words.empty()) {
+            continue;
+        }
+
+        script_plan::step step{find_command(words[0]), static_cast<uint32_t>(plan.args.size()), static_cast<uint32_t>(words.size())};
+        for (std::string_view word : words) {
+            auto it = interned.find(word);
+            if (it == interned.end()) {
+                const std::string& stored = plan.strings.emplace_back(word);
+                it = interned.emplace(stored, &stored).first;
+            }
+            plan.args.push_back(it->second);
+        }
+        plan.steps.push_back(step);
+    }
+}
+
+void run_plan(filesystem& fs, const script_plan& plan) {
+    for (const script_plan::step& step : plan.steps) {
+        try {
+            execute_command(fs, step.spec, arg_list(plan.args.data() + step.first, step.count));
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+        }
+    }
+}
+
+// Runs every line of a script file as a shell command
+bool run_script(filesystem& fs, const std::string& path) {
+    std::ifstream file(path);
+    if (!file){
+        std::cerr << "Failed to open file: " << path << "\n";
+        return false;
+    }
+
+    script_plan plan;
+    compile_script(file, plan);
+    run_plan(fs, plan);
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <deque>
+#include <istream>
+#include <string>
+#include <vector>
+#include "commands.h"
+
+// A script compiled once before it runs. Every line is looked up in the command table up front and
+// its arguments are interned, a path used by many lines is stored once and shared by all of them.
+struct script_plan{
+    struct step{
+        const command_spec* spec; // nullptr for an unknown command
+        uint32_t first;           // Index of the command name in args
+        uint32_t count;
+    };
+    std::deque<std::string> strings; // Interned words, a deque keeps their addresses stable
+    std::vector<const std::string*> args;
+    std::vector<step> steps;
+};
+
+void compile_script(std::istream& in, script_plan& plan);
+void run_plan(filesystem& fs, const script_plan& plan);
+bool run_script(filesystem& fs, const std::string& path);
+
+#endif
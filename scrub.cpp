@@ -0,0 +1,93 @@
+#include <chrono>
+#include <map>
+#include "filesystem.h"
+#include "crc32c.h"
+#include "async_io.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+fs_status filesystem::scrub(scrub_report& report) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    report = scrub_report();
+    int image_fd = ::open(filesystem::file_name.c_str(), O_RDONLY);
+    if (image_fd < 0) {
+        return fs_status::io_error;
+    }
+
+    // The data region is read in large batches, several of them in flight, only allocated clusters are verified
+    const int32_t batch_clusters = 256;
+    const size_t batches_in_flight = 4;
+    std::vector<char> batches(batches_in_flight * batch_clusters * CLUSTER_SIZE);
+    std::vector<size_t> free_batches = {3, 2, 1, 0};
+    std::vector<int32_t> bad_clusters;
+    int32_t count = static_cast<int32_t>(fat1.size());
+    io_engine engine(static_cast<unsigned>(batches_in_flight), io_uring_enabled);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t first = 1; first < count; first += batch_clusters) {
+        int32_t last = std::min(count, first + batch_clusters);
+        int32_t used_from = first;
+        while (used_from < last && fat1[used_from] == FAT_UNUSED) {
+            used_from++;
+        }
+        if (used_from == last) {
+            continue;
+        }
+
+        while (free_batches.empty()) {
+            engine.poll();
+        }
+        size_t slot = free_batches.back();
+        free_batches.pop_back();
+        char* batch = batches.data() + slot * batch_clusters * CLUSTER_SIZE;
+        engine.read(image_fd, batch, static_cast<size_t>(last - used_from) * CLUSTER_SIZE,
+            desc.data_start_address + static_cast<off_t>(used_from) * CLUSTER_SIZE,
+            [&, slot, batch, used_from, last](ssize_t got) {
+                for (int32_t cluster = used_from; cluster < last; ++cluster) {
+                    if (fat1[cluster] == FAT_UNUSED || fat1[cluster] == FAT_BAD_CLUSTER) {
+                        continue;
+                    }
+                    ssize_t offset = static_cast<ssize_t>(cluster - used_from) * CLUSTER_SIZE;
+                    report.verified_clusters++;
+                    if (offset + CLUSTER_SIZE > got || crc32c(0, batch + offset, CLUSTER_SIZE) != checksums[cluster]) {
+                        bad_clusters.push_back(cluster);
+                    }
+                }
+                free_batches.push_back(slot);
+            });
+    }
+    engine.wait();
+    ::close(image_fd);
+    std::sort(bad_clusters.begin(), bad_clusters.end());
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (bad_clusters.empty()) {
+        return fs_status::ok;
+    }
+
+    // Name the files the damaged clusters belong to
+    std::map<int32_t, std::string> owners;
+    std::vector<std::pair<std::string, directory_item*>> files;
+    collect_files(&root_folder[0], "", files);
+    for (const auto& [path, file] : files) {
+        for (int32_t cluster : get_cluster_chain(file->start_cluster, fat1)) {
+            owners[cluster] = path;
+        }
+        if (file->flags & FILE_DEDUP) {
+            std::vector<int32_t> blocks;
+            if (read_block_map(file, blocks) == fs_status::ok) {
+                for (int32_t block : blocks) {
+                    owners[block] = path;
+                }
+            }
+        }
+    }
+
+    for (int32_t cluster : bad_clusters) {
+        auto owner = owners.find(cluster);
+        report.bad_clusters.emplace_back(cluster, owner != owners.end() ? owner->second : std::string());
+    }
+    bad_cluster = bad_clusters.front();
+    return fs_status::checksum_error;
+}
@@ -0,0 +1,280 @@
+#include "server.h"
+#include "path_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The filesystem has one working directory, connections keep their own and send absolute paths
+static std::string resolve(const std::string& cwd, const std::string& path) {
+    std::vector<std::string> parts;
+    for (const std::string& part : split_path(path.starts_with('/') ? path : cwd + "/" + path)) {
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (part != ".") {
+            parts.push_back(part);
+        }
+    }
+    return join_path(parts);
+}
+
+static bool argument_count(const request& req, size_t count) {
+    return req.args.size() == count;
+}
+
+static uint32_t u32_value(const std::string& arg) {
+    uint32_t value = 0;
+    std::memcpy(&value, arg.data(), std::min(arg.size(), sizeof(value)));
+    return value;
+}
+
+response execute_request(filesystem& fs, std::string& cwd, const request& req) {
+    response res;
+    res.tag = req.tag;
+    const std::vector<std::string>& args = req.args;
+
+    // Argument counts are checked per operation, a mismatch is an invalid_argument answer
+    switch (req.op) {
+        case opcode::pwd:
+            res.body = cwd;
+            break;
+        case opcode::cd: {
+            if (!argument_count(req, 1)) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            std::string path = resolve(cwd, args[0]);
+            std::vector<entry_info> entries;
+            res.status = fs.list_directory(path, entries);
+            if (res.status == fs_status::ok) {
+                cwd = path;
+            }
+            break;
+        }
+        case opcode::mkdir:
+            res.status = argument_count(req, 1) ? fs.make_directory(resolve(cwd, args[0])) : fs_status::invalid_argument;
+            break;
+        case opcode::rmdir:
+            res.status = argument_count(req, 1) ? fs.remove_directory(resolve(cwd, args[0])) : fs_status::invalid_argument;
+            break;
+        case opcode::ls: {
+            if (args.size() > 1) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            std::vector<entry_info> entries;
+            res.status = fs.list_directory(resolve(cwd, args.empty() ? "" : args[0]), entries);
+            for (const entry_info& entry : entries) {
+                encode_entry(res.body, entry);
+            }
+            break;
+        }
+        case opcode::stat: {
+            if (!argument_count(req, 1)) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            entry_info info;
+            res.status = fs.stat(resolve(cwd, args[0]), info);
+            if (res.status == fs_status::ok) {
+                encode_entry(res.body, info);
+            }
+            break;
+        }
+        case opcode::rm:
+            res.status = argument_count(req, 1) ? fs.remove_file(resolve(cwd, args[0])) : fs_status::invalid_argument;
+            break;
+        case opcode::incp: {
+            if (!argument_count(req, 3) || args[2].size() != 1) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            import_report report;
+            res.status = fs.copy_file_in(args[0], resolve(cwd, args[1]), static_cast<uint8_t>(args[2][0]), &report);
+            if (res.status == fs_status::ok) {
+                put_u32(res.body, static_cast<uint32_t>(report.shared_clusters));
+                put_u32(res.body, static_cast<uint32_t>(report.total_clusters));
+            }
+            break;
+        }
+        case opcode::outcp:
+            res.status = argument_count(req, 2) ? fs.copy_file_out(resolve(cwd, args[0]), args[1]) : fs_status::invalid_argument;
+            break;
+        case opcode::read: {
+            uint32_t length = argument_count(req, 3) ? u32_value(args[2]) : 0;
+            if (!argument_count(req, 3) || length > MAX_FRAME_SIZE - 16) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            res.body.resize(length);
+            int32_t bytes_read = 0;
+            res.status = fs.read(resolve(cwd, args[0]), static_cast<int32_t>(u32_value(args[1])),
+                std::span<char>(res.body.data(), res.body.size()), bytes_read);
+            res.body.resize(res.status == fs_status::ok ? bytes_read : 0);
+            break;
+        }
+        case opcode::write:
+            res.status = argument_count(req, 3)
+                ? fs.write(resolve(cwd, args[0]), static_cast<int32_t>(u32_value(args[1])), args[2])
+                : fs_status::invalid_argument;
+            break;
+        case opcode::append:
+            res.status = argument_count(req, 2) ? fs.append(resolve(cwd, args[0]), args[1]) : fs_status::invalid_argument;
+            break;
+        case opcode::cp:
+            res.status = argument_count(req, 2) ? fs.copy_file(resolve(cwd, args[0]), resolve(cwd, args[1])) : fs_status::invalid_argument;
+            break;
+        case opcode::mv:
+            res.status = argument_count(req, 2) ? fs.move_file(resolve(cwd, args[0]), resolve(cwd, args[1])) : fs_status::invalid_argument;
+            break;
+        case opcode::check: {
+            check_report report;
+            res.status = fs.check(report);
+            put_u8(res.body, report.corrupted ? 1 : 0);
+            put_u32(res.body, static_cast<uint32_t>(report.fixed_refcounts));
+            put_u32(res.body, static_cast<uint32_t>(report.reclaimed_clusters));
+            break;
+        }
+        case opcode::scrub: {
+            scrub_report report;
+            res.status = fs.scrub(report);
+            if (res.status == fs_status::checksum_error) {
+                res.status = fs_status::ok;
+            }
+            put_u64(res.body, static_cast<uint64_t>(report.verified_clusters));
+            put_u32(res.body, static_cast<uint32_t>(report.bad_clusters.size()));
+            for (const auto& [cluster, owner] : report.bad_clusters) {
+                put_u32(res.body, static_cast<uint32_t>(cluster));
+            }
+            break;
+        }
+        case opcode::dedup: {
+            dedup_report report = fs.dedup_statistics();
+            put_u64(res.body, static_cast<uint64_t>(report.unique_clusters));
+            put_u64(res.body, static_cast<uint64_t>(report.references));
+            break;
+        }
+        case opcode::du: {
+            if (args.size() > 1) {
+                res.status = fs_status::invalid_argument;
+                break;
+            }
+            usage_totals totals;
+            res.status = fs.disk_usage(resolve(cwd, args.empty() ? "" : args[0]), totals);
+            if (res.status == fs_status::ok) {
+                put_u64(res.body, static_cast<uint64_t>(totals.files));
+                put_u64(res.body, static_cast<uint64_t>(totals.bytes));
+                put_u64(res.body, static_cast<uint64_t>(totals.clusters));
+            }
+            break;
+        }
+        case opcode::df: {
+            space_report report = fs.disk_free();
+            put_u32(res.body, static_cast<uint32_t>(report.total_clusters));
+            put_u32(res.body, static_cast<uint32_t>(report.free_clusters));
+            break;
+        }
+        case opcode::fallocate:
+            res.status = argument_count(req, 2)
+                ? fs.preallocate(resolve(cwd, args[0]), static_cast<int32_t>(u32_value(args[1])))
+                : fs_status::invalid_argument;
+            break;
+        default:
+            res.status = fs_status::unsupported;
+            break;
+    }
+
+    if (res.status == fs_status::checksum_error) {
+        res.body.clear();
+        put_u32(res.body, static_cast<uint32_t>(fs.bad_cluster.load()));
+    }
+    return res;
+}
+
+static bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+static void serve_connection(filesystem& fs, int fd) {
+    std::string cwd = "/";
+    std::string in;
+    std::string out;
+    char chunk[64 * 1024];
+    request req;
+
+    for (;;) {
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        in.append(chunk, n);
+
+        // Everything that arrived is executed before answering, so a pipelining client gets one write per batch
+        size_t consumed = 0;
+        bool malformed = false;
+        while (size_t used = decode_request(in.data() + consumed, in.size() - consumed, req, malformed)) {
+            consumed += used;
+            encode_response(out, execute_request(fs, cwd, req));
+        }
+        in.erase(0, consumed);
+
+        if (!write_all(fd, out) || malformed) {
+            break;
+        }
+        out.clear();
+    }
+    ::close(fd);
+}
+
+fs_status serve(filesystem& fs, const std::string& socket_path) {
+    sockaddr_un address{};
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        return fs_status::name_too_long;
+    }
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return fs_status::io_error;
+    }
+    // A socket file left behind by a previous server would make bind fail
+    ::unlink(socket_path.c_str());
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(listener, SOMAXCONN) < 0) {
+        ::close(listener);
+        return fs_status::io_error;
+    }
+
+    for (;;) {
+        int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        std::thread(serve_connection, std::ref(fs), client).detach();
+    }
+    ::close(listener);
+    ::unlink(socket_path.c_str());
+    return fs_status::io_error;
+}
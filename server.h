@@ -0,0 +1,16 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include "filesystem.h"
+#include "protocol.h"
+
+// Accepts clients on a Unix domain socket and answers their requests (protocol.h) until accepting fails.
+// Every connection gets its own thread and working directory, pipelined requests are executed in order
+// and their responses are written back together.
+fs_status serve(filesystem& fs, const std::string& socket_path);
+
+// Runs one request against the filesystem, cwd is the connection's working directory
+response execute_request(filesystem& fs, std::string& cwd, const request& req);
+
+#endif
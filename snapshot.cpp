@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include "filesystem.h"
+
+static const uint32_t SNAPSHOT_MAGIC = 0x31504E53; // "SNP1"
+static const size_t MAX_SNAPSHOT_NAME = 32;
+
+static void put_bytes(std::string& out, const void* data, size_t length) {
+    out.append(static_cast<const char*>(data), length);
+}
+
+template <typename T>
+static void put_value(std::string& out, T value) {
+    put_bytes(out, &value, sizeof(value));
+}
+
+template <typename T>
+static bool get_value(std::istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static bool get_string(std::istream& in, std::string& value) {
+    uint32_t length;
+    if (!get_value(in, length) || length > (64u << 20)) {
+        return false;
+    }
+    value.resize(length);
+    return static_cast<bool>(in.read(value.data(), length));
+}
+
+static snapshot* find_snapshot(std::vector<snapshot>& snapshots, const std::string& name) {
+    auto it = std::find_if(snapshots.begin(), snapshots.end(), [&](const snapshot& s) { return s.name == name; });
+    return it == snapshots.end() ? nullptr : &*it;
+}
+
+// Every FAT change goes through here, the newest snapshot keeps the value it replaces
+void filesystem::set_fat(int32_t cluster, int32_t value) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    if (!snapshots.empty()) {
+        snapshots.back().fat_undo.try_emplace(cluster, fat1[cluster]);
+    }
+    fat1[cluster] = value;
+}
+
+// The FAT entry as snapshot index saw it
+int32_t filesystem::snapshot_view(size_t index, int32_t cluster) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    for (size_t i = index; i < snapshots.size(); ++i) {
+        auto it = snapshots[i].fat_undo.find(cluster);
+        if (it != snapshots[i].fat_undo.end()) {
+            return it->second;
+        }
+    }
+    return fat1[cluster];
+}
+
+// True while some snapshot sees the cluster in use, its contents must then stay as they are
+bool filesystem::snapshot_pinned(int32_t cluster) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    int32_t value = fat1[cluster];
+    for (size_t i = snapshots.size(); i-- > 0;) {
+        auto it = snapshots[i].fat_undo.find(cluster);
+        if (it != snapshots[i].fat_undo.end()) {
+            value = it->second;
+        }
+        if (value != FAT_UNUSED && value != FAT_SNAPSHOT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Gives a cluster up for the live volume. A cluster a snapshot still sees is held until the last such snapshot goes.
+void filesystem::release_cluster(int32_t cluster) {
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    if (!snapshots.empty() && snapshot_pinned(cluster)) {
+        set_fat(cluster, FAT_SNAPSHOT);
+        return;
+    }
+    set_fat(cluster, FAT_UNUSED);
+    free_cluster_count++;
+    trim_pending.push_back(cluster);
+}
+
+fs_status filesystem::create_snapshot(const std::string& name) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    if (name.empty() || name.size() > MAX_SNAPSHOT_NAME) {
+        return fs_status::invalid_argument;
+    }
+
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        if (find_snapshot(snapshots, name)) {
+            return fs_status::already_exists;
+        }
+
+        // Only the tree is copied, so the cost depends on the number of entries and not on the volume size
+        std::ostringstream tree;
+        for (const auto& dir : root_folder) {
+            save_directory(tree, dir);
+        }
+        snapshot taken;
+        taken.name = name;
+        taken.created = static_cast<int64_t>(std::time(nullptr));
+        taken.tree = tree.str();
+        snapshots.push_back(std::move(taken));
+    }
+    // Without free clusters for the store nothing was written, the snapshot is not kept
+    fs_status status = save_fs();
+    if (status == fs_status::no_space) {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        snapshots.pop_back();
+    }
+    return status;
+}
+
+fs_status filesystem::list_snapshots(std::vector<snapshot_info>& list) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    list.clear();
+    for (const snapshot& s : snapshots) {
+        list.push_back(snapshot_info{s.name, s.created, s.fat_undo.size()});
+    }
+    return fs_status::ok;
+}
+
+fs_status filesystem::restore_snapshot(const std::string& name) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        snapshot* restored = find_snapshot(snapshots, name);
+        if (!restored) {
+            return fs_status::not_found;
+        }
+        size_t index = restored - snapshots.data();
+        // The volume may have shrunk since, the restored tree has to fit the current tree area
+        if (static_cast<int64_t>(restored->tree.size() / TREE_ENTRY_SIZE) > tree_capacity()) {
+            return fs_status::no_space;
+        }
+
+        std::istringstream tree(restored->tree);
+        std::vector<directory_item> folder;
+        while (tree.peek() != std::char_traits<char>::eof()) {
+            directory_item dir;
+            load_dir(tree, dir);
+            if (!tree || std::strlen(dir.item_name) == 0 || dir.id < 0) {
+                break;
+            }
+            folder.push_back(std::move(dir));
+        }
+        if (folder.empty()) {
+            return fs_status::io_error;
+        }
+
+        // The live FAT takes the snapshot's view. Every other snapshot keeps its own view, as the changes
+        // go through set_fat. What the restored tree does not use is free or held for another snapshot.
+        std::vector<int32_t> target(fat1.size());
+        for (size_t i = 1; i < fat1.size(); ++i) {
+            int32_t value = snapshot_view(index, static_cast<int32_t>(i));
+            if (value == FAT_UNUSED || value == FAT_SNAPSHOT) {
+                value = snapshot_pinned(static_cast<int32_t>(i)) ? FAT_SNAPSHOT : FAT_UNUSED;
+            }
+            target[i] = value;
+        }
+        for (int32_t cluster : snapshot_store) {
+            target[cluster] = fat1[cluster];
+        }
+        for (size_t i = 1; i < fat1.size(); ++i) {
+            if (fat1[i] != target[i]) {
+                set_fat(static_cast<int32_t>(i), target[i]);
+                if (target[i] == FAT_UNUSED) {
+                    trim_pending.push_back(static_cast<int32_t>(i));
+                }
+            }
+        }
+
+        root_folder = std::move(folder);
+        rebuild_directory_index();
+        update_dir_id();
+        current_directory_id = root_folder[0].id;
+        {
+            std::lock_guard<std::mutex> cache_guard(cache_mutex);
+            chain_cache.clear();
+            chunk_cache.clear();
+        }
+
+        // Deduplicated blocks are counted again from the restored block maps
+        std::vector<uint32_t> references(fat1.size(), 0);
+        count_block_references(&root_folder[0], references);
+        for (size_t i = 1; i < fat1.size(); ++i) {
+            refcounts[i] = references[i];
+            if (references[i] == 0 && fat1[i] != FAT_SNAPSHOT) {
+                fingerprints[i] = 0;
+            }
+        }
+        rebuild_fingerprint_index();
+        rebuild_usage();
+    }
+    return save_fs();
+}
+
+fs_status filesystem::delete_snapshot(const std::string& name) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        snapshot* deleted = find_snapshot(snapshots, name);
+        if (!deleted) {
+            return fs_status::not_found;
+        }
+
+        // The next older snapshot relied on the saved entries for its own view
+        size_t index = deleted - snapshots.data();
+        if (index > 0) {
+            for (const auto& [cluster, value] : deleted->fat_undo) {
+                snapshots[index - 1].fat_undo.try_emplace(cluster, value);
+            }
+        }
+        snapshots.erase(snapshots.begin() + index);
+
+        // Held clusters nobody sees any more go back to the free pool
+        for (size_t i = 1; i < fat1.size(); ++i) {
+            if (fat1[i] == FAT_SNAPSHOT && !snapshot_pinned(static_cast<int32_t>(i))) {
+                set_fat(static_cast<int32_t>(i), FAT_UNUSED);
+                fingerprints[i] = 0;
+                free_cluster_count++;
+                trim_pending.push_back(static_cast<int32_t>(i));
+            }
+        }
+    }
+    return save_fs();
+}
+
+// Free clusters an allocation of count clusters has to leave for the next commit's snapshot store,
+// called with table_mutex held. The new store is written before the old one is freed and grows by
+// an undo entry for every FAT entry the allocation changes.
+int32_t filesystem::snapshot_headroom(int32_t count) {
+    if (snapshots.empty()) {
+        return 0;
+    }
+    int64_t growth = (static_cast<int64_t>(count) + 1) * 2 * sizeof(int32_t);
+    return static_cast<int32_t>(snapshot_store.size() + (growth + CLUSTER_SIZE - 1) / CLUSTER_SIZE + 1);
+}
+
+// Serializes the snapshots into a fresh chain, called by save_fs() with table_mutex held.
+// The store is metadata: its clusters come from and go back to the free pool without set_fat, so no
+// snapshot ever sees them and no snapshot's view of a free cluster changes.
+bool filesystem::store_snapshots(std::string& bytes) {
+    bytes.clear();
+    if (!snapshots.empty()) {
+        put_value(bytes, SNAPSHOT_MAGIC);
+        put_value(bytes, static_cast<uint32_t>(snapshots.size()));
+        for (const snapshot& s : snapshots) {
+            put_value(bytes, static_cast<uint32_t>(s.name.size()));
+            put_bytes(bytes, s.name.data(), s.name.size());
+            put_value(bytes, s.created);
+            put_value(bytes, static_cast<uint32_t>(s.tree.size()));
+            put_bytes(bytes, s.tree.data(), s.tree.size());
+            put_value(bytes, static_cast<uint32_t>(s.fat_undo.size()));
+            for (const auto& [cluster, value] : s.fat_undo) {
+                put_value(bytes, cluster);
+                put_value(bytes, value);
+            }
+        }
+    }
+
+    size_t needed = (bytes.size() + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    std::vector<int32_t> chain;
+    for (size_t i = 1; i < fat1.size() && chain.size() < needed; ++i) {
+        if (fat1[i] == FAT_UNUSED) {
+            chain.push_back(static_cast<int32_t>(i));
+        }
+    }
+    if (chain.size() < needed) {
+        return false;
+    }
+
+    // A shrinking resize may have cut off part of the old store
+    for (int32_t cluster : snapshot_store) {
+        if (cluster < static_cast<int32_t>(fat1.size())) {
+            fat1[cluster] = FAT_UNUSED;
+            free_cluster_count++;
+            trim_pending.push_back(cluster);
+        }
+    }
+    for (size_t i = 0; i < chain.size(); ++i) {
+        fat1[chain[i]] = i + 1 == chain.size() ? FAT_FILE_END : chain[i + 1];
+    }
+    free_cluster_count -= static_cast<int32_t>(chain.size());
+    snapshot_store = std::move(chain);
+    desc.snapshot_cluster = snapshot_store.empty() ? -1 : snapshot_store[0];
+
+    // Checksummed now, the caller writes the clusters after its snapshot of the tables
+    bytes.resize(needed * CLUSTER_SIZE, '\0');
+    for (size_t i = 0; i < needed; ++i) {
+        record_checksum(snapshot_store[i], bytes.data() + i * CLUSTER_SIZE);
+    }
+    return true;
+}
+
+fs_status filesystem::load_snapshots(std::istream& in) {
+    snapshots.clear();
+    snapshot_store.clear();
+    if (desc.snapshot_cluster < 0) {
+        return fs_status::ok;
+    }
+
+    snapshot_store = get_cluster_chain(desc.snapshot_cluster, fat1);
+    std::string bytes(snapshot_store.size() * CLUSTER_SIZE, '\0');
+    for (size_t i = 0; i < snapshot_store.size(); ++i) {
+        fs_status status = read_cluster(in, snapshot_store[i], bytes.data() + i * CLUSTER_SIZE);
+        if (status != fs_status::ok) {
+            return status;
+        }
+    }
+
+    std::istringstream stream(bytes);
+    uint32_t magic, count;
+    if (!get_value(stream, magic) || magic != SNAPSHOT_MAGIC || !get_value(stream, count)) {
+        return fs_status::io_error;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        snapshot s;
+        uint32_t entries;
+        if (!get_string(stream, s.name) || !get_value(stream, s.created) || !get_string(stream, s.tree) ||
+            !get_value(stream, entries)) {
+            return fs_status::io_error;
+        }
+        for (uint32_t j = 0; j < entries; ++j) {
+            int32_t cluster, value;
+            if (!get_value(stream, cluster) || !get_value(stream, value) || cluster <= 0 ||
+                cluster >= static_cast<int32_t>(fat1.size())) {
+                return fs_status::io_error;
+            }
+            s.fat_undo.emplace(cluster, value);
+        }
+        snapshots.push_back(std::move(s));
+    }
+    return fs_status::ok;
+}
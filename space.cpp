@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+#include "filesystem.h"
+#include "timeline.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Zeroes the clusters on the host image, run by run, and records the checksum of a zero cluster for them.
+// The host file system does this without writing data where it supports it. The image grows if a run
+// ends past it, as in images formatted before the image covered the whole data region.
+fs_status filesystem::zero_clusters(const std::vector<int32_t>& clusters) {
+    static const std::vector<char> zeros(CLUSTER_SIZE, '\0');
+    static const uint32_t zero_checksum = crc32c(0, zeros.data(), CLUSTER_SIZE);
+
+    int image_fd = ::open(filesystem::file_name.c_str(), O_RDWR);
+    if (image_fd < 0) {
+        return fs_status::io_error;
+    }
+    fs_status status = fs_status::ok;
+    for (size_t first = 0; first < clusters.size() && status == fs_status::ok;) {
+        size_t run = 1;
+        while (first + run < clusters.size() && clusters[first + run] == clusters[first + run - 1] + 1) {
+            run++;
+        }
+        off_t offset = desc.data_start_address + static_cast<off_t>(clusters[first]) * CLUSTER_SIZE;
+        off_t length = static_cast<off_t>(run) * CLUSTER_SIZE;
+        if (::fallocate(image_fd, FALLOC_FL_ZERO_RANGE, offset, length) != 0) {
+            for (off_t done = 0; done < length; done += CLUSTER_SIZE) {
+                if (::pwrite(image_fd, zeros.data(), CLUSTER_SIZE, offset + done) != CLUSTER_SIZE) {
+                    status = fs_status::io_error;
+                    break;
+                }
+            }
+        }
+        first += run;
+    }
+    ::close(image_fd);
+    if (status != fs_status::ok) {
+        return status;
+    }
+
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    for (int32_t cluster : clusters) {
+        checksums[cluster] = zero_checksum;
+    }
+    return fs_status::ok;
+}
+
+// Reserves the clusters for size bytes and links them as the file's chain, a missing file is created empty.
+// The file keeps its size: everything past it is unwritten and reads back as zeros, so appends fill the
+// reservation without allocating and cannot run out of space halfway.
+fs_status filesystem::preallocate(const std::string& path, int32_t size) {
+    if (size < 0) {
+        return fs_status::invalid_argument;
+    }
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    std::string file_name;
+    directory_item* parent = get_parent_directory(path, working_directory(), file_name);
+    if (!parent) {
+        return fs_status::path_not_found;
+    }
+    if (file_name.empty()) {
+        return fs_status::invalid_argument;
+    }
+
+    std::shared_lock<std::shared_mutex> commit_guard(commit_lock);
+    std::unique_lock<std::shared_mutex> dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, file_name, false);
+    if (file && !file->is_file) {
+        return fs_status::already_exists;
+    }
+    if (file && (file->flags & (FILE_COMPRESSED | FILE_DEDUP))) {
+        return fs_status::unsupported;
+    }
+
+    int32_t clusters_needed = static_cast<int32_t>((static_cast<int64_t>(size) + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    int32_t length = file ? get_chain_index(file->start_cluster).length : 0;
+    int32_t tail = file ? get_chain_index(file->start_cluster).tail : -1;
+    if (file && length >= clusters_needed) {
+        return fs_status::ok;
+    }
+
+    // A new chain takes the best fitting free run, an existing one grows right behind its tail if it can
+    if (!file && !reserve_entries(1)) {
+        return fs_status::no_space;
+    }
+    std::vector<int32_t> reserved;
+    if (!allocate_extent(clusters_needed - length, tail, reserved)) {
+        if (!file) {
+            release_entries(1);
+        }
+        return fs_status::no_space;
+    }
+    fs_status status = zero_clusters(reserved);
+    if (status != fs_status::ok) {
+        free_clusters(reserved);
+        if (!file) {
+            release_entries(1);
+        }
+        return status;
+    }
+
+    usage_totals reserved_usage;
+    reserved_usage.clusters = static_cast<int64_t>(reserved.size());
+    if (!file) {
+        file = &parent->contents->children.emplace_back(file_name, true);
+        file->id = next_dir_id++;
+        file->parent_id = parent->id;
+        reserved_usage.files = 1;
+    }
+    extend_chain(file, reserved);
+    add_usage(parent, reserved_usage);
+
+    dir_guard.unlock();
+    commit_guard.unlock();
+    return save_fs();
+}
+
+// Punches the clusters out of the host file run by run, the caller holds table_mutex so none of them is
+// allocated meanwhile. A host file system without hole punching keeps the bytes, nothing else changes.
+void filesystem::punch_clusters(const std::vector<int32_t>& clusters) {
+    if (clusters.empty()) {
+        return;
+    }
+    int image_fd = ::open(filesystem::file_name.c_str(), O_RDWR);
+    if (image_fd < 0) {
+        return;
+    }
+    for (size_t first = 0; first < clusters.size();) {
+        size_t run = 1;
+        while (first + run < clusters.size() && clusters[first + run] == clusters[first + run - 1] + 1) {
+            run++;
+        }
+        off_t offset = desc.data_start_address + static_cast<off_t>(clusters[first]) * CLUSTER_SIZE;
+        if (::fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, static_cast<off_t>(run) * CLUSTER_SIZE) != 0) {
+            break;
+        }
+        trimmed_clusters += static_cast<int64_t>(run);
+        trimmed_runs++;
+        first += run;
+    }
+    ::close(image_fd);
+}
+
+// Called by save_fs() with save_mutex held once a commit is durable. A freed cluster is punched only when
+// both slots on disk and the live FAT agree it is free, so falling back to the older slot never finds a
+// hole where it expects data. Those the older slot still uses wait for the next commit.
+void filesystem::punch_freed(std::vector<int32_t>& freed, const std::vector<int32_t>& fat_committed) {
+    timeline_span span("punch freed", "commit");
+    freed.insert(freed.end(), trim_retry.begin(), trim_retry.end());
+    trim_retry.clear();
+    std::sort(freed.begin(), freed.end());
+    freed.erase(std::unique(freed.begin(), freed.end()), freed.end());
+
+    std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+    std::vector<int32_t> punch;
+    for (int32_t cluster : freed) {
+        if (cluster >= static_cast<int32_t>(fat1.size()) || fat1[cluster] != FAT_UNUSED || fat_committed[cluster] != FAT_UNUSED) {
+            continue;
+        }
+        if (committed_fat.size() != fat1.size() || committed_fat[cluster] != FAT_UNUSED) {
+            trim_retry.push_back(cluster);
+        }
+        else {
+            punch.push_back(cluster);
+        }
+    }
+    punch_clusters(punch);
+}
+
+static int64_t host_allocated_bytes(const std::string& path) {
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0 ? static_cast<int64_t>(info.st_blocks) * 512 : 0;
+}
+
+// Punches every free cluster of the image, for images written before holes were punched on release
+fs_status filesystem::trim(trim_report& report) {
+    std::unique_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    report = trim_report();
+    report.host_bytes_before = host_allocated_bytes(file_name);
+    int64_t clusters_before = trimmed_clusters;
+    int64_t runs_before = trimmed_runs;
+    {
+        std::lock_guard<std::recursive_mutex> table_guard(table_mutex);
+        for (size_t i = 1; i < fat1.size(); ++i) {
+            if (fat1[i] == FAT_UNUSED) {
+                trim_pending.push_back(static_cast<int32_t>(i));
+            }
+        }
+    }
+
+    // Two commits put the current tables into both slots, after that neither slot uses a free cluster
+    fs_status status = save_fs();
+    if (status == fs_status::ok) {
+        status = save_fs();
+    }
+    report.clusters = trimmed_clusters - clusters_before;
+    report.runs = trimmed_runs - runs_before;
+    report.host_bytes_after = host_allocated_bytes(file_name);
+    return status;
+}
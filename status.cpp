@@ -0,0 +1,22 @@
+#include "status.h"
+
+const char* status_message(fs_status status){
+    switch (status){
+        case fs_status::ok: return "OK";
+        case fs_status::not_found: return "File not found";
+        case fs_status::path_not_found: return "Path not found";
+        case fs_status::already_exists: return "Already exists";
+        case fs_status::not_a_file: return "Not a file";
+        case fs_status::not_a_directory: return "Not a directory";
+        case fs_status::not_empty: return "Directory is not empty";
+        case fs_status::name_too_long: return "Name too long (max 11 characters)";
+        case fs_status::no_space: return "Not enough space";
+        case fs_status::invalid_argument: return "Invalid argument";
+        case fs_status::unsupported: return "Not supported for compressed or deduplicated files";
+        case fs_status::io_error: return "Error accessing filesystem";
+        case fs_status::checksum_error: return "Checksum mismatch";
+        case fs_status::not_formatted: return "Filesystem is not formatted";
+        case fs_status::corrupted: return "Filesystem is corrupted please use command 'format' to format the disk";
+    }
+    return "Unknown error";
+}
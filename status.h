@@ -0,0 +1,25 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+// Result of a filesystem operation. The library never prints, callers turn these into messages.
+enum class fs_status{
+    ok,
+    not_found,          // File or directory does not exist
+    path_not_found,     // Parent directory of the path does not exist
+    already_exists,
+    not_a_file,
+    not_a_directory,
+    not_empty,
+    name_too_long,
+    no_space,
+    invalid_argument,
+    unsupported,        // Operation not possible on compressed / deduplicated files
+    io_error,
+    checksum_error,     // A cluster failed CRC32C verification, see filesystem::bad_cluster
+    not_formatted,      // Image does not exist yet
+    corrupted,          // Image has files with bad clusters, only format is possible
+};
+
+const char* status_message(fs_status status);
+
+#endif
@@ -1,18 +1,49 @@
 #ifndef STRUCTURES_H
 #define STRUCTURES_H
 #include <vector>
+#include <list>
+#include <memory>
+#include <shared_mutex>
 #include <cstring>
 #include <sstream>
+#include <string>
+#include <utility>
 #include <cstdint>
+#include <unordered_map>
 
 extern const int32_t FAT_UNUSED;
 extern const int32_t FAT_FILE_END;
 extern const int32_t FAT_BAD_CLUSTER;
+extern const int32_t FAT_SNAPSHOT; // Freed by the live volume but still seen by a snapshot
 
 extern const int32_t CLUSTER_SIZE;
 extern const int32_t DISK_SIZE;
 
-// Description structure
+extern const uint8_t FILE_COMPRESSED;
+// A deduplicated file's chain holds one int32_t cluster number per CLUSTER_SIZE block of the file,
+// the data clusters themselves are shared between files and reference counted.
+extern const uint8_t FILE_DEDUP;
+extern const uint32_t COMPRESSED_MAGIC;
+extern const uint32_t CHUNK_RAW;
+
+// Written by format at offset 0, it locates the two metadata slots. resize rewrites it when it moves them.
+struct superblock{
+    char signature[8];
+    uint32_t version;
+    int32_t slot_size;
+    int64_t slots_offset; // 0 for slots right behind the superblock
+};
+
+// Start of a metadata slot, followed by length bytes of description, tables and directory tree.
+// Commits alternate between the two slots, the valid slot with the higher generation is current.
+struct slot_header{
+    uint32_t magic;
+    uint32_t checksum; // CRC32C of the length bytes after the header
+    uint64_t generation;
+    uint64_t length;
+};
+
+// Description structure, the table and directory addresses are offsets within a metadata slot
 struct description{
     char signature[9];
     int32_t disk_size;
@@ -22,22 +53,48 @@ struct description{
     int32_t fat1_start_address;
     int32_t fat2_start_address;
     int32_t data_start_address;
-    int32_t directory_start_address; // New field for directory metadata start
+    int32_t directory_start_address; // Length prefixed directory tree
+    int32_t refcount_start_address; // Reference counts of deduplicated clusters
+    int32_t fingerprint_start_address; // Content fingerprints of deduplicated clusters
+    int32_t checksum_start_address; // CRC32C of every data cluster
+    int32_t snapshot_cluster; // First cluster of the serialized snapshots, -1 without snapshots
+};
+
+// Files, bytes and clusters below a directory. The clusters of a file are its own chain plus, for a
+// deduplicated file, every data cluster its block map references, so shared clusters count once per file.
+struct usage_totals{
+    int64_t files = 0;
+    int64_t bytes = 0;
+    int64_t clusters = 0;
+};
+
+struct directory_item;
+
+// What only a directory has. Files make up most of a tree, so this lives in its own allocation that
+// files do without.
+struct directory_contents{
+    std::list<directory_item> children; // A list so that entries keep their address while siblings come and go
+    std::shared_mutex lock; // Guards children and the entries in it
+    usage_totals usage; // Whole subtree, updated atomically by filesystem::add_usage()
 };
 
-// Directory item structure
+extern const int32_t TREE_ENTRY_SIZE; // Bytes of one entry in a serialized tree
+
+// Directory item structure, the fields are ordered so that an entry has no padding holes
 struct directory_item{
     char item_name[12]; // 8 chars for name + 3 for extension + 1 for null terminator
-    bool is_file;
     int32_t size;
     int32_t start_cluster;
     int32_t parent_id;
     int32_t id;
-    std::vector<directory_item> children;
+    bool is_file;
+    uint8_t flags; // FILE_COMPRESSED, FILE_DEDUP
+    std::unique_ptr<directory_contents> contents; // nullptr for files
 
     // Constructor
     directory_item(const std::string &name = "", bool is_file = false)
-        : is_file(is_file), size(0), start_cluster(-1), parent_id(-1), id(-1){
+        : size(0), start_cluster(-1), parent_id(-1), id(-1), is_file(is_file), flags(0),
+          contents(is_file ? nullptr : std::make_unique<directory_contents>()){
         std::memset(item_name, 0, sizeof(item_name));
         if (name.length() >= sizeof(item_name)){
             std::strncpy(item_name, name.c_str(), sizeof(item_name) - 1);
@@ -47,4 +104,101 @@ struct directory_item{
         }
     }
 };
+// Header at the start of a compressed file's cluster chain.
+// It is followed by chunk_count + 1 offsets (relative to the end of the offset table) of the chunks,
+// each chunk holds CLUSTER_SIZE bytes of the file. Offsets with CHUNK_RAW set mark chunks stored uncompressed.
+struct compressed_header{
+    uint32_t magic;
+    uint32_t chunk_count;
+};
+
+// One directory entry as reported by filesystem::stat() and filesystem::list_directory()
+struct entry_info{
+    std::string name;
+    bool is_file = false;
+    int32_t size = 0;
+    uint8_t flags = 0;
+    int32_t stored_size = 0;        // Bytes a compressed file occupies in its chain
+    std::vector<int32_t> clusters;  // Cluster chain, only filled by stat()
+};
+
+struct check_report{
+    bool corrupted = false;
+    int32_t fixed_refcounts = 0;
+    int32_t reclaimed_clusters = 0;
+};
+
+struct scrub_report{
+    int64_t verified_clusters = 0;
+    double seconds = 0.0;
+    std::vector<std::pair<int32_t, std::string>> bad_clusters; // Cluster and path of the file owning it
+};
+
+struct file_fragmentation{
+    std::string path;
+    int32_t clusters = 0;
+    int32_t runs = 0;
+    double score = 0.0;
+};
+
+struct fragmentation_report{
+    std::vector<file_fragmentation> files;
+    double image_score = 0.0;
+};
+
+struct dedup_report{
+    int64_t unique_clusters = 0;
+    int64_t references = 0;
+};
+
+// One end of filesystem::copy_clusters(). Image ends list the clusters, host ends are read or written
+// from offset 0 and only the first size bytes count. A memory source replaces the descriptor.
+struct copy_side{
+    int fd = -1;
+    const std::vector<int32_t>* clusters = nullptr;
+    int64_t size = 0;
+    const char* memory = nullptr;
+};
+
+// One file of filesystem::copy_entries(), copied into target as name or a unique variant of it
+struct copy_job{
+    directory_item* source = nullptr;
+    directory_item* target = nullptr;
+    std::string name;
+};
+
+struct space_report{
+    int32_t total_clusters = 0; // Data clusters, the directory tree's cluster excluded
+    int32_t free_clusters = 0;
+};
+
+// Result of filesystem::trim(), the host sizes are the bytes the host file system allocated to the image
+struct trim_report{
+    int64_t clusters = 0;
+    int64_t runs = 0;
+    int64_t host_bytes_before = 0;
+    int64_t host_bytes_after = 0;
+};
+
+// A point-in-time copy of the volume. Taking one copies the directory tree only. The FAT is preserved lazily:
+// the first change of an entry after the newest snapshot was taken saves the old value in that snapshot's
+// fat_undo. A snapshot sees the entries saved by itself and by newer snapshots, and the live FAT for the rest.
+struct snapshot{
+    std::string name;
+    int64_t created = 0; // Unix time
+    std::string tree;    // Directory tree as filesystem::save_directory() writes it
+    std::unordered_map<int32_t, int32_t> fat_undo;
+};
+
+struct snapshot_info{
+    std::string name;
+    int64_t created = 0;
+    size_t saved_entries = 0; // FAT entries changed since the snapshot (or the next one) was taken
+};
+
+// Filled by filesystem::copy_file_in() for deduplicated imports
+struct import_report{
+    int32_t shared_clusters = 0;
+    int32_t total_clusters = 0;
+};
 #endif //STRUCTURES_H
@@ -0,0 +1,82 @@
+#include "timeline.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+std::atomic<bool> timeline_active = false;
+
+namespace {
+
+struct timeline_event{
+    const char* name;
+    const char* category;
+    int64_t start;
+    int64_t end;
+    const char* arg_name;
+    int64_t arg;
+    int thread;
+};
+
+std::mutex events_mutex;
+std::vector<timeline_event> events; // Guarded by events_mutex
+int64_t origin = 0;                 // Start of the recording, guarded by events_mutex
+std::atomic<int> next_thread = 1;
+
+// Small numbers read better in the viewer than native thread ids
+int thread_number() {
+    thread_local int number = next_thread++;
+    return number;
+}
+
+}
+
+int64_t timeline_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void timeline_start() {
+    std::lock_guard<std::mutex> guard(events_mutex);
+    events.clear();
+    origin = timeline_now();
+    timeline_active = true;
+}
+
+void timeline_record(const char* name, const char* category, int64_t start, int64_t end, const char* arg_name, int64_t arg) {
+    int thread = thread_number();
+    std::lock_guard<std::mutex> guard(events_mutex);
+    events.push_back(timeline_event{name, category, start, end, arg_name, arg, thread});
+}
+
+fs_status timeline_stop(const std::string& path) {
+    timeline_active = false;
+    std::vector<timeline_event> recorded;
+    int64_t start;
+    {
+        std::lock_guard<std::mutex> guard(events_mutex);
+        recorded.swap(events);
+        start = origin;
+    }
+
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        return fs_status::io_error;
+    }
+    // Complete ("X") events in microseconds, the viewer nests the spans of a thread by their times
+    int pid = static_cast<int>(::getpid());
+    std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < recorded.size(); ++i) {
+        const timeline_event& event = recorded[i];
+        std::fprintf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                     event.name, event.category, (event.start - start) / 1000.0, (event.end - event.start) / 1000.0, pid, event.thread);
+        if (event.arg_name) {
+            std::fprintf(out, ",\"args\":{\"%s\":%lld}", event.arg_name, static_cast<long long>(event.arg));
+        }
+        std::fprintf(out, "}%s\n", i + 1 < recorded.size() ? "," : "");
+    }
+    std::fprintf(out, "]}\n");
+    bool written = !std::ferror(out);
+    written = std::fclose(out) == 0 && written;
+    return written ? fs_status::ok : fs_status::io_error;
+}
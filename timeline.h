@@ -0,0 +1,57 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include "status.h"
+
+// Timeline of internal phases, written in the Chrome Trace Event format for a timeline viewer.
+// Spans are compiled in unless ZOSFS_NO_TIMELINE is defined and record nothing until timeline_start(),
+// a disabled span costs one relaxed load. Recording is process wide, every thread shows up as its own track.
+
+extern std::atomic<bool> timeline_active;
+
+inline bool timeline_enabled() {
+#ifdef ZOSFS_NO_TIMELINE
+    return false;
+#else
+    return timeline_active.load(std::memory_order_relaxed);
+#endif
+}
+
+// Nanoseconds on the steady clock
+int64_t timeline_now();
+void timeline_start();
+// Stops recording and writes the events as JSON to path
+fs_status timeline_stop(const std::string& path);
+// Adds one complete event, names and categories must be string literals. arg_name may be nullptr.
+void timeline_record(const char* name, const char* category, int64_t start, int64_t end, const char* arg_name = nullptr, int64_t arg = 0);
+
+// Records the time between its construction and its destruction
+class timeline_span{
+public:
+    timeline_span(const char* name, const char* category): name(name), category(category), start(timeline_enabled() ? timeline_now() : -1) {}
+    ~timeline_span() {
+        if (start >= 0) {
+            timeline_record(name, category, start, timeline_now(), arg_name, arg);
+        }
+    }
+    timeline_span(const timeline_span&) = delete;
+    timeline_span& operator=(const timeline_span&) = delete;
+
+    // Attaches one value to the event, shown in the viewer's details
+    void note(const char* key, int64_t value) {
+        arg_name = key;
+        arg = value;
+    }
+
+private:
+    const char* name;
+    const char* category;
+    int64_t start;
+    const char* arg_name = nullptr;
+    int64_t arg = 0;
+};
+
+#endif
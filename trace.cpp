@@ -0,0 +1,265 @@
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include "script.h"
+
+namespace {
+
+struct trace_writer{
+    std::ofstream out;
+    std::unordered_map<std::string, uint32_t> words; // Word -> index of its first appearance
+    std::chrono::steady_clock::time_point last; // Start of the previous record
+};
+
+std::unique_ptr<trace_writer> writer; // Flushed and closed at exit if the trace is never stopped
+
+void put_varint(std::ostream& out, uint64_t value) {
+    char bytes[10];
+    int length = 0;
+    do {
+        bytes[length] = static_cast<char>(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            bytes[length] |= static_cast<char>(0x80);
+        }
+        length++;
+    } while (value != 0);
+    out.write(bytes, length);
+}
+
+bool get_varint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A trace read back into a script plan, the plan's interned strings are the trace's word table
+struct trace_data{
+    int32_t disk_size = 0;
+    int64_t created = 0;
+    script_plan plan;
+    std::vector<uint64_t> offsets;   // Start of every command since the start of the trace, in ns
+    std::vector<uint64_t> durations; // Recorded duration in ns
+    std::vector<fs_status> statuses;
+};
+
+bool read_trace(const std::string& path, trace_data& trace) {
+    std::ifstream in(path, std::ios::binary);
+    char signature[8];
+    uint32_t version = 0;
+    if (!in.read(signature, sizeof(signature)) || std::memcmp(signature, "ZOSTRACE", sizeof(signature)) != 0 ||
+        !in.read(reinterpret_cast<char*>(&version), sizeof(version)) || version != TRACE_VERSION ||
+        !in.read(reinterpret_cast<char*>(&trace.disk_size), sizeof(trace.disk_size)) ||
+        !in.read(reinterpret_cast<char*>(&trace.created), sizeof(trace.created))) {
+        return false;
+    }
+
+    std::vector<const std::string*> table;
+    uint64_t offset = 0;
+    uint64_t gap = 0;
+    while (get_varint(in, gap)) {
+        uint64_t duration = 0;
+        uint64_t count = 0;
+        int status = 0;
+        if (!get_varint(in, duration) || (status = in.get()) == std::char_traits<char>::eof() || !get_varint(in, count) || count == 0) {
+            return false;
+        }
+        script_plan::step step{nullptr, static_cast<uint32_t>(trace.plan.args.size()), static_cast<uint32_t>(count)};
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t word = 0;
+            if (!get_varint(in, word)) {
+                return false;
+            }
+            if (word & 1) {
+                if ((word >> 1) >= table.size()) {
+                    return false;
+                }
+                trace.plan.args.push_back(table[word >> 1]);
+                continue;
+            }
+            std::string& stored = trace.plan.strings.emplace_back(word >> 1, '\0');
+            if (!in.read(stored.data(), static_cast<std::streamsize>(stored.size()))) {
+                return false;
+            }
+            table.push_back(&stored);
+            trace.plan.args.push_back(&stored);
+        }
+        step.spec = find_command(*trace.plan.args[step.first]);
+        trace.plan.steps.push_back(step);
+        offset += gap;
+        trace.offsets.push_back(offset);
+        trace.durations.push_back(duration);
+        trace.statuses.push_back(static_cast<fs_status>(status));
+    }
+    return in.eof();
+}
+
+// Sends stdout and stderr to /dev/null while the commands run, their output is not what a replay measures
+class output_silencer{
+public:
+    output_silencer() {
+        std::cout.flush();
+        std::cerr.flush();
+        int null_fd = ::open("/dev/null", O_WRONLY);
+        saved_out = ::dup(STDOUT_FILENO);
+        saved_err = ::dup(STDERR_FILENO);
+        ::dup2(null_fd, STDOUT_FILENO);
+        ::dup2(null_fd, STDERR_FILENO);
+        ::close(null_fd);
+    }
+    ~output_silencer() {
+        std::cout.flush();
+        std::cerr.flush();
+        ::dup2(saved_out, STDOUT_FILENO);
+        ::dup2(saved_err, STDERR_FILENO);
+        ::close(saved_out);
+        ::close(saved_err);
+    }
+
+private:
+    int saved_out;
+    int saved_err;
+};
+
+double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+}
+
+bool start_trace(const filesystem& fs, const std::string& path) {
+    auto next = std::make_unique<trace_writer>();
+    next->out.open(path, std::ios::binary | std::ios::trunc);
+    if (!next->out) {
+        return false;
+    }
+    int32_t disk_size = fs.corrupted ? 0 : fs.desc.disk_size;
+    int64_t created = static_cast<int64_t>(std::time(nullptr));
+    next->out.write("ZOSTRACE", 8);
+    next->out.write(reinterpret_cast<const char*>(&TRACE_VERSION), sizeof(TRACE_VERSION));
+    next->out.write(reinterpret_cast<const char*>(&disk_size), sizeof(disk_size));
+    next->out.write(reinterpret_cast<const char*>(&created), sizeof(created));
+    next->last = std::chrono::steady_clock::now();
+    writer = std::move(next);
+    return true;
+}
+
+void stop_trace() {
+    writer.reset();
+}
+
+bool tracing() {
+    return writer != nullptr;
+}
+
+void record_command(const arg_list& args, std::chrono::steady_clock::time_point start, fs_status status) {
+    // load only runs the commands it reads, they are recorded one by one
+    if (!writer || args[0] == "load" || args[0] == "trace") {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now();
+    put_varint(writer->out, std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(start - writer->last).count()));
+    put_varint(writer->out, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    writer->out.put(static_cast<char>(status));
+    put_varint(writer->out, args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto [it, added] = writer->words.emplace(args[i], static_cast<uint32_t>(writer->words.size()));
+        if (!added) {
+            put_varint(writer->out, (static_cast<uint64_t>(it->second) << 1) | 1);
+            continue;
+        }
+        put_varint(writer->out, static_cast<uint64_t>(args[i].size()) << 1);
+        writer->out.write(args[i].data(), static_cast<std::streamsize>(args[i].size()));
+    }
+    writer->last = start;
+}
+
+int replay_trace(const std::string& image, const std::string& path, bool realtime, const std::string& snapshot_name) {
+    trace_data trace;
+    if (!read_trace(path, trace)) {
+        std::cerr << "Not a readable trace: " << path << std::endl;
+        return 1;
+    }
+
+    filesystem fs(image);
+    fs_status status = fs.open();
+    if (status == fs_status::not_formatted && trace.disk_size > 0) {
+        status = fs.format_fs(std::to_string(trace.disk_size) + "B");
+    }
+    if (status == fs_status::ok && fs.corrupted) {
+        status = fs_status::corrupted;
+    }
+    if (status == fs_status::ok && !snapshot_name.empty()) {
+        status = fs.restore_snapshot(snapshot_name);
+    }
+    if (status != fs_status::ok) {
+        print_status(fs, status);
+        return 1;
+    }
+
+    // Commands are grouped by name, the map keeps the report sorted
+    std::map<std::string, std::pair<std::vector<double>, std::vector<double>>> latencies; // Replayed, recorded in us
+    size_t diverged = 0;
+    auto replay_start = std::chrono::steady_clock::now();
+    {
+        output_silencer silence;
+        for (size_t i = 0; i < trace.plan.steps.size(); ++i) {
+            const script_plan::step& step = trace.plan.steps[i];
+            if (realtime) {
+                std::this_thread::sleep_until(replay_start + std::chrono::nanoseconds(trace.offsets[i]));
+            }
+            arg_list args(trace.plan.args.data() + step.first, step.count);
+            auto start = std::chrono::steady_clock::now();
+            try {
+                status = execute_command(fs, step.spec, args);
+            }
+            catch (const std::exception&) {
+                status = fs_status::invalid_argument;
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            auto& entry = latencies[args[0]];
+            entry.first.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+            entry.second.push_back(trace.durations[i] / 1000.0);
+            if (status != trace.statuses[i]) {
+                diverged++;
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    std::printf("Replayed %zu commands in %.3f s (%s)\n", trace.plan.steps.size(), elapsed, realtime ? "real time" : "full speed");
+    std::printf("%-10s %-8s %-10s %-10s %-10s %-10s %s\n", "command", "count", "p50 us", "p99 us", "max us", "rec p50", "rec p99");
+    for (auto& [name, samples] : latencies) {
+        std::vector<double>& replayed = samples.first;
+        std::vector<double>& recorded = samples.second;
+        std::sort(replayed.begin(), replayed.end());
+        std::sort(recorded.begin(), recorded.end());
+        std::printf("%-10s %-8zu %-10.1f %-10.1f %-10.1f %-10.1f %.1f\n", name.c_str(), replayed.size(),
+                    percentile(replayed, 0.50), percentile(replayed, 0.99), replayed.back(),
+                    percentile(recorded, 0.50), percentile(recorded, 0.99));
+    }
+    if (diverged > 0) {
+        std::printf("%zu commands ended with another status than recorded\n", diverged);
+    }
+    return 0;
+}
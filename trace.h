@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <string>
+#include "commands.h"
+
+// Binary trace of the commands the shell dispatches, typed or run by load.
+// A trace starts with a header: char[8] "ZOSTRACE", uint32_t version, int32_t disk size of the image when
+// recording started (0 when it was not formatted) and int64_t Unix time of the start. Every record is:
+// varint nanoseconds from the start of the previous record (of the trace for the first one), varint duration
+// in nanoseconds, uint8_t fs_status the command reported, varint word count and the words. A word is a varint
+// (index << 1) | 1 when it appeared before in the trace, words are numbered in order of their first appearance,
+// otherwise a varint length << 1 followed by the bytes. Integers are little endian, varints are LEB128.
+constexpr uint32_t TRACE_VERSION = 1;
+
+bool start_trace(const filesystem& fs, const std::string& path);
+void stop_trace();
+bool tracing();
+// Appends one dispatched command, a no-op while no trace is recorded
+void record_command(const arg_list& args, std::chrono::steady_clock::time_point start, fs_status status);
+
+// Runs a trace against an image at full speed or, with realtime, at the recorded pace and prints latency
+// percentiles per command. An unformatted image is formatted with the recorded size first, a snapshot name
+// restores that snapshot first. Returns the process exit code.
+int replay_trace(const std::string& image, const std::string& path, bool realtime, const std::string& snapshot_name);
+
+#endif
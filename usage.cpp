@@ -0,0 +1,91 @@
+#include <atomic>
+#include <functional>
+#include "filesystem.h"
+
+// What one file adds to the totals of every directory above it
+usage_totals filesystem::file_usage(const directory_item& file, int64_t chain_length) {
+    usage_totals usage;
+    usage.files = 1;
+    usage.bytes = file.size;
+    usage.clusters = chain_length;
+    if (file.flags & FILE_DEDUP) {
+        usage.clusters += (static_cast<int64_t>(file.size) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    }
+    return usage;
+}
+
+// Adds sign * delta to dir and all its ancestors. Operations in different directories update a shared
+// ancestor at the same time, so the totals are only touched atomically.
+void filesystem::add_usage(directory_item* dir, const usage_totals& delta, int64_t sign) {
+    while (dir) {
+        std::atomic_ref<int64_t>(dir->contents->usage.files).fetch_add(sign * delta.files, std::memory_order_relaxed);
+        std::atomic_ref<int64_t>(dir->contents->usage.bytes).fetch_add(sign * delta.bytes, std::memory_order_relaxed);
+        std::atomic_ref<int64_t>(dir->contents->usage.clusters).fetch_add(sign * delta.clusters, std::memory_order_relaxed);
+        dir = dir->parent_id == -1 ? nullptr : directory_by_id(dir->parent_id);
+    }
+}
+
+// Recounts the free clusters and every directory's totals, the caller has the image to itself
+void filesystem::rebuild_usage() {
+    int32_t free = 0;
+    for (size_t i = 1; i < fat1.size(); ++i) {
+        if (fat1[i] == FAT_UNUSED) {
+            free++;
+        }
+    }
+    free_cluster_count = free;
+
+    std::function<usage_totals(directory_item&)> total = [&](directory_item& dir) {
+        dir.contents->usage = usage_totals();
+        for (directory_item& child : dir.contents->children) {
+            usage_totals part = child.is_file
+                ? file_usage(child, static_cast<int64_t>(get_cluster_chain(child.start_cluster, fat1).size()))
+                : total(child);
+            dir.contents->usage.files += part.files;
+            dir.contents->usage.bytes += part.bytes;
+            dir.contents->usage.clusters += part.clusters;
+        }
+        return dir.contents->usage;
+    };
+    int64_t entries = 0;
+    for (directory_item& dir : root_folder) {
+        entries += total(dir).files;
+    }
+
+    // Every directory is in the index
+    std::shared_lock<std::shared_mutex> index_guard(index_mutex);
+    tree_entries = entries + static_cast<int64_t>(directory_index.size());
+}
+
+fs_status filesystem::disk_usage(const std::string& path, usage_totals& totals) {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    directory_item* dir = path.empty() ? working_directory() : find_directory_by_path(working_directory(), path);
+    if (dir) {
+        totals.files = std::atomic_ref<int64_t>(dir->contents->usage.files).load(std::memory_order_relaxed);
+        totals.bytes = std::atomic_ref<int64_t>(dir->contents->usage.bytes).load(std::memory_order_relaxed);
+        totals.clusters = std::atomic_ref<int64_t>(dir->contents->usage.clusters).load(std::memory_order_relaxed);
+        return fs_status::ok;
+    }
+
+    // A single file is not aggregated anywhere, its chain is counted
+    std::string name;
+    directory_item* parent = get_parent_directory(path, working_directory(), name);
+    if (!parent) {
+        return fs_status::not_found;
+    }
+    std::shared_lock<std::shared_mutex> dir_guard(parent->contents->lock);
+    directory_item* file = find_child(parent, name, true);
+    if (!file) {
+        return fs_status::not_found;
+    }
+    totals = file_usage(*file, static_cast<int64_t>(get_cluster_chain(file->start_cluster, fat1).size()));
+    return fs_status::ok;
+}
+
+space_report filesystem::disk_free() {
+    std::shared_lock<std::shared_mutex> namespace_guard(namespace_lock);
+    space_report report;
+    report.total_clusters = desc.cluster_count - 1;
+    report.free_clusters = free_cluster_count;
+    return report;
+}